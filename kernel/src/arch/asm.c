@@ -53,6 +53,76 @@ uint64_t read_cr3() {
     return cr3;
 }
 
+void write_cr3(uint64_t cr3) {
+    asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+uint64_t read_cr4() {
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+void write_cr4(uint64_t cr4) {
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" :: "a"((uint32_t)value), "d"((uint32_t)(value >> 32)), "c"(msr) : "memory");
+}
+
+void cpuid(uint32_t leaf, uint32_t subleaf, struct cpuid_result *result_out) {
+    asm volatile (
+        "cpuid"
+        : "=a"(result_out->eax), "=b"(result_out->ebx), "=c"(result_out->ecx), "=d"(result_out->edx)
+        : "a"(leaf), "c"(subleaf)
+    );
+}
+
+uint64_t read_tsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Invalidate the TLB entry for a single page in the current address space
+void invlpg(void *address) {
+    asm volatile ("invlpg (%0)" :: "r"(address) : "memory");
+}
+
+// Invalidate TLB entries selected by type (INVPCID_*). Requires CPUID.(EAX=7):EBX.INVPCID
+void invpcid(uint64_t type, uint16_t pcid, void *address) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor = { pcid, (uint64_t)address };
+    asm volatile ("invpcid %0, %1" :: "m"(descriptor), "r"(type) : "memory");
+}
+
+// Zero a page with non-temporal stores, so that zeroing does not evict useful cache lines
+void zero_page_nontemporal(void *page) {
+    asm volatile (
+        "xor %%eax, %%eax\n"
+        "mov $128, %%ecx\n" // 4096 bytes / 32 bytes per iteration
+        "1:\n"
+        "movnti %%rax, (%0)\n"
+        "movnti %%rax, 8(%0)\n"
+        "movnti %%rax, 16(%0)\n"
+        "movnti %%rax, 24(%0)\n"
+        "add $32, %0\n"
+        "dec %%ecx\n"
+        "jnz 1b\n"
+        "sfence\n" // Order the weakly-ordered stores before the page is handed out
+        : "+r"(page) :: "rax", "rcx", "memory"
+    );
+}
+
 bool are_interrupts_enabled() {
     return read_rflags() & EFLAGS_IF;
 }
@@ -16,9 +16,37 @@ void halt_until_any_interrupt(void);
 uint64_t read_rflags();
 
 uint64_t read_cr3();
+void write_cr3(uint64_t cr3);
+uint64_t read_cr4();
+void write_cr4(uint64_t cr4);
+uint64_t read_tsc();
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
+void invlpg(void *address);
+void invpcid(uint64_t type, uint16_t pcid, void *address);
+void zero_page_nontemporal(void *page);
+
+struct cpuid_result {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+void cpuid(uint32_t leaf, uint32_t subleaf, struct cpuid_result *result_out);
 
 #define EFLAGS_IF (1 << 9)
 
+#define CPUID_1_ECX_PCID (1 << 17)
+#define CPUID_7_EBX_INVPCID (1 << 10)
+#define CR4_PCIDE (1 << 17)
+#define CR3_PCID_MASK 0xFFF
+#define CR3_NO_FLUSH (1ULL << 63) // Keep the TLB entries tagged with the new PCID
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_SINGLE_CONTEXT 1
+#define INVPCID_ALL_CONTEXTS_WITH_GLOBAL 2
+#define INVPCID_ALL_CONTEXTS 3
+
 bool are_interrupts_enabled();
 
 #endif
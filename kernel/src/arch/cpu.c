@@ -0,0 +1,28 @@
+// Per-CPU descriptor tables
+#include <stdint.h>
+#include "arch/cpu.h"
+#include "arch/gdt.h"
+#include "lib/cstd.h"
+
+struct cpu cpus[MAX_CPUS];
+uint32_t num_cpus = 1;
+
+// Give the executing CPU its own GDT and TSS, starting from the GDT that Limine loaded on it
+// Afterwards this_cpu() returns cpu. The IDT is shared and loaded separately
+void cpu_init(struct cpu *cpu) {
+    struct {
+        uint16_t limit;
+        uint64_t base;
+    } __attribute__((packed)) gdtr;
+    asm volatile ("sgdt %0" : "=m"(gdtr));
+    memcpy(cpu->gdt, (void*)gdtr.base, LIMINE_GDT_ENTRIES * sizeof(uint64_t));
+    gdtr.base = (uint64_t)cpu->gdt;
+    gdtr.limit = LIMINE_GDT_ENTRIES * sizeof(uint64_t) - 1;
+    asm volatile ("lgdt %0" :: "m"(gdtr) : "memory");
+
+    add_usermode_gdt_entries();
+    memset(&cpu->tss, 0, sizeof(tss64_t));
+    cpu->tss.iomap = 0xdfff; // For now, point beyond the TSS limit (no iomap)
+    add_tss_gdt_entry(&cpu->tss);
+}
+
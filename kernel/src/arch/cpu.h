@@ -0,0 +1,69 @@
+#ifndef CPU_H
+#define CPU_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "lib/list.h"
+#include "lib/rbtree.h"
+
+// Upper bound on the number of CPUs that per-CPU state is kept for
+#define MAX_CPUS 16
+
+// Limine's 7 entries, user code and data at 7 and 8, then the TSS at 9 (occupies two slots)
+#define CPU_GDT_ENTRIES 11
+#define LIMINE_GDT_ENTRIES 7
+
+typedef struct {
+    uint32_t reserved0;
+    uint32_t rsp0_low;
+    uint32_t rsp0_high;
+    uint32_t reserved1[22];
+    uint16_t reserved2;
+    uint16_t iomap;
+} __attribute__((packed)) tss64_t;
+
+struct task_struct;
+
+struct cpu {
+    uint64_t gdt[CPU_GDT_ENTRIES]; // Must stay first. this_cpu finds the struct through GDTR
+    tss64_t tss;
+    uint32_t id; // Index in cpus
+    uint32_t lapic_id;
+    volatile bool online;
+    struct task_struct *current_task;
+    struct task_struct *idle_task; // Runs when run_queue_tree is empty
+    struct rb_root run_queue_tree; // Runnable struct task_struct waiting for this CPU, ordered by vruntime
+    uint32_t nr_queued; // Tasks in run_queue_tree
+    uint64_t min_vruntime; // Only increases. Tasks joining the run queue start from it
+    uint64_t exec_start_tsc; // TSC when current_task was last charged for its runtime
+    uint32_t kernel_lock_depth; // Nesting of kernel_lock. Only meaningful on the CPU that holds it
+    uint64_t kernel_tlb_generation; // Value of kernel_tlb_generation when this CPU last flushed kernel mappings
+    uint64_t pcid_generation;
+    uint16_t pcid_next;
+    uint64_t context_switches;
+    uint64_t migrations; // Tasks moved onto this CPU by load balancing
+    volatile bool need_resched; // The time slice of current_task is used up. Switch before returning to user mode
+    uint64_t slice_start_ticks; // timer_ticks when current_task last got the CPU
+    uint64_t preemptions; // Switches forced by need_resched
+} __attribute__((aligned(64)));
+
+extern struct cpu cpus[MAX_CPUS];
+extern uint32_t num_cpus;
+
+// The executing CPU. Each CPU loads its own GDT, which is the first member of its struct cpu
+static inline struct cpu *this_cpu() {
+    struct {
+        uint16_t limit;
+        uint64_t base;
+    } __attribute__((packed)) gdtr;
+    asm volatile ("sgdt %0" : "=m"(gdtr));
+    return (struct cpu*)gdtr.base;
+}
+
+// Index of the executing CPU
+static inline uint32_t cpu_id() {
+    return this_cpu()->id;
+}
+
+void cpu_init(struct cpu *cpu);
+
+#endif
@@ -1,13 +1,17 @@
 #include "lib/cstd.h"
 #include "arch/asm.h"
 #include "arch/idt.h"
+#include "arch/lapic.h"
 #include "arch/pic.h"
 #include "drivers/keyboard.h"
 #include "drivers/pit.h"
 #include "drivers/nvme.h"
 #include "drivers/tty.h"
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
 #include "kernel/syscall.h"
+#include "kernel/waitqueue.h"
+#include "mm/userspace.h"
 
 #define KERNEL_CODE_GDT_ENTRY_IDX 5 // Based on Limine boot protocol
 
@@ -46,6 +50,7 @@ void cpu_exception_handler(
     uint64_t interrupt_rsp,
     uint64_t arg1
 ) {
+    kernel_lock();
     if (interrupt_number == 0) {
         printk(u8p("Division by zero\n"));
         current_task_ts->task_state = TS_ZOMBIE;
@@ -59,6 +64,11 @@ void cpu_exception_handler(
         current_task_ts->exit_code = 128 + 11; // 11 is SIGSEGV
         task_yield();
     } else if (interrupt_number == 14) {
+        // Faults on userspace addresses may come from user mode or from the kernel accessing user buffers
+        if (arg1 < 0x0000800000000000 && handle_user_page_fault(current_task_ts, arg1, error_code)) {
+            kernel_unlock();
+            return;
+        }
         uint8_t access_address_buf[17];
         sprintf_uint64(arg1, access_address_buf);
         
@@ -82,6 +92,27 @@ void cpu_exception_handler(
 }
 
 uint64_t timer_ticks = 0;
+
+// Tasks in timer_sleep_until. Woken on the tick that reaches timer_next_wake_ticks, the earliest
+// end of their sleeps. Those that need to sleep longer register their own end again
+static struct wait_queue timer_wait_queue;
+static uint64_t timer_next_wake_ticks = UINT64_MAX;
+
+// Block the current task until timer_ticks reaches end_ticks
+void timer_sleep_until(uint64_t end_ticks) {
+    while (true) {
+        prepare_to_wait(&timer_wait_queue);
+        if (timer_ticks >= end_ticks) {
+            break;
+        }
+        if (end_ticks < timer_next_wake_ticks) {
+            timer_next_wake_ticks = end_ticks;
+        }
+        task_yield();
+    }
+    finish_wait(&timer_wait_queue);
+}
+
 uint64_t hw_interrupt_handler(
     uint32_t interrupt_number,
     uint64_t arg1,
@@ -90,12 +121,23 @@ uint64_t hw_interrupt_handler(
     uint64_t arg4,
     uint64_t arg5
 ) {
+    kernel_lock();
+    uint64_t result = 0;
     uint8_t interrupt_line = interrupt_number - 0x20;
     if (interrupt_line == 0x7) {
         // Spurious interrupt. Return without sending EOI
     } else if (interrupt_line == 0x0) {
         timer_ticks++;
         pic_send_eoi(interrupt_line);
+        if (timer_ticks >= timer_next_wake_ticks) {
+            timer_next_wake_ticks = UINT64_MAX;
+            wake_up(&timer_wait_queue);
+        }
+        scheduler_tick();
+        if (this_cpu()->kernel_lock_depth == 1) {
+            // Run queues may be mid-update if the interrupt nested in kernel code
+            scheduler_balance();
+        }
     } else if (interrupt_line == 0x1) {
         // Keyboard interrupt
         keyboard_rb_fill();
@@ -106,11 +148,31 @@ uint64_t hw_interrupt_handler(
         nvme_handle_interrupt(interrupt_line);
         pic_send_eoi(interrupt_line);
     } else if (interrupt_line == 0x60) { // software int 0x80
-        return handle_syscall(arg1, arg2, arg3, arg4, arg5);
+        result = handle_syscall(arg1, arg2, arg3, arg4, arg5);
+    } else if (interrupt_number == LAPIC_RESCHEDULE_VECTOR) {
+        // Another CPU queued or woke a task here, killed the task running here, or ended its time slice
+        lapic_eoi();
     } else {
         panic(u8p("Unknown interrupt"));
     }
-    return 0; // Unknown interrupt
+    if (this_cpu()->kernel_lock_depth == 1) {
+        // About to return to user mode, or to the idle task's halt. Kernel code interrupted at a
+        // deeper nesting is left alone, and switches at its next preemption point or return
+        if (current_task_ts->task_state == TS_ZOMBIE) {
+            // Killed by another CPU. Must not return to user mode
+            task_yield();
+            // No return
+        } else if (this_cpu()->need_resched) {
+            task_yield();
+        }
+    }
+    kernel_unlock();
+    return result;
+}
+
+// Load the IDT on the executing CPU. All CPUs share it
+void idt_load() {
+    asm volatile ("lidt %0" : : "m"(idtr));
 }
 
 void idt_init() {
@@ -128,11 +190,14 @@ void idt_init() {
     idt_set_descriptor(41, handle_interrupt_41, 0x8E); // PCI
     idt_set_descriptor(42, handle_interrupt_42, 0x8E); // PCI
     idt_set_descriptor(43, handle_interrupt_43, 0x8E); // PCI
+    idt_set_descriptor(LAPIC_RESCHEDULE_VECTOR, handle_interrupt_240, 0x8E); // Inter-processor interrupt
+    idt_set_descriptor(LAPIC_SPURIOUS_VECTOR, handle_interrupt_255, 0x8E);
 
 
     idt_set_descriptor(128, handle_interrupt_128, 0xEE); // Software interrupt
 
-    asm volatile ("lidt %0" : : "m"(idtr)); // load the new IDT
+    idt_load();
+    wait_queue_init(&timer_wait_queue, u8p("timer"));
     pic_remap(); // Remap PIC
     set_pit_channel_0(TIMER_TICKS_PER_SECOND); // Initialize PIT channel 0 to tick at 100Hz
 
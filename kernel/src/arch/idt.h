@@ -14,17 +14,21 @@ void handle_interrupt_33(void);
 void handle_interrupt_41(void);
 void handle_interrupt_42(void);
 void handle_interrupt_43(void);
+void handle_interrupt_240(void);
+void handle_interrupt_255(void);
 
 void handle_interrupt_128(void);
 
 #define IDT_SYSCALL_NUM_SAVED_REGISTERS 14
 
 void idt_init();
+void idt_load();
 void zero_rax_and_iret();
 
 // idt.c
 
 extern uint64_t timer_ticks;
 #define TIMER_TICKS_PER_SECOND 100
+void timer_sleep_until(uint64_t end_ticks);
 
 #endif
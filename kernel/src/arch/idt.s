@@ -246,6 +246,37 @@ handle_interrupt_43:
     pop %rax
     iretq
 
+.global handle_interrupt_240
+.type handle_interrupt_240, @function
+handle_interrupt_240:
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    mov $240, %rdi
+    mov $0, %rsi
+    call hw_interrupt_handler
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
+    iretq
+
+// Spurious local APIC interrupt. Needs no EOI
+.global handle_interrupt_255
+.type handle_interrupt_255, @function
+handle_interrupt_255:
+    iretq
 
 .global handle_interrupt_128
 .global zero_rax_and_iret
@@ -277,6 +308,8 @@ handle_interrupt_128:
     call hw_interrupt_handler
     jmp skip_zero_rax
 zero_rax_and_iret:
+    // New tasks are switched to with the kernel lock held, and leave the kernel here
+    call kernel_unlock
     mov $0, %rax
 skip_zero_rax:
     pop %r15
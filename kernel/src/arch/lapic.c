@@ -0,0 +1,75 @@
+// Local APIC, used for inter-processor interrupts
+// Device interrupts still come through the legacy PIC to the bootstrap processor
+#include <stdbool.h>
+#include <stdint.h>
+#include "arch/asm.h"
+#include "arch/lapic.h"
+#include "mm/vmalloc.h"
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ADDRESS_MASK 0xFFFFFFFFFF000
+#define X2APIC_MSR_BASE 0x800
+
+#define LAPIC_ID 0x20
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_ICR_DELIVERY_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+
+static volatile uint32_t *lapic_registers = NULL; // xAPIC only
+static bool lapic_x2apic = false;
+
+static uint32_t lapic_read(uint32_t reg) {
+    if (lapic_x2apic) {
+        return rdmsr(X2APIC_MSR_BASE + (reg >> 4));
+    }
+    return lapic_registers[reg / sizeof(uint32_t)];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    if (lapic_x2apic) {
+        wrmsr(X2APIC_MSR_BASE + (reg >> 4), value);
+        return;
+    }
+    lapic_registers[reg / sizeof(uint32_t)] = value;
+}
+
+// Map the local APIC registers. Every CPU sees its own APIC at the same address
+// x2apic is set if the bootloader switched the APICs to x2APIC mode
+void lapic_init(bool x2apic) {
+    lapic_x2apic = x2apic;
+    if (!x2apic) {
+        lapic_registers = vmap_mmio(rdmsr(IA32_APIC_BASE_MSR) & IA32_APIC_BASE_ADDRESS_MASK, 0x400);
+    }
+}
+
+// Software-enable the APIC of the executing CPU
+void lapic_enable() {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id() {
+    uint32_t id = lapic_read(LAPIC_ID);
+    return lapic_x2apic ? id : id >> 24;
+}
+
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    if (lapic_x2apic) {
+        // The ICR is a single 64-bit register in x2APIC mode
+        wrmsr(X2APIC_MSR_BASE + (LAPIC_ICR_LOW >> 4), ((uint64_t)lapic_id << 32) | LAPIC_ICR_ASSERT | vector);
+        return;
+    }
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_DELIVERY_PENDING) {
+        asm volatile ("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, LAPIC_ICR_ASSERT | vector); // Writing the low half sends the IPI
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
@@ -0,0 +1,15 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LAPIC_RESCHEDULE_VECTOR 0xF0 // Wakes a CPU to look at its run queue
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+void lapic_init(bool x2apic);
+void lapic_enable();
+uint32_t lapic_id();
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+void lapic_eoi();
+
+#endif
@@ -7,7 +7,7 @@
 #include "lib/cstd.h"
 #include "kernel/scheduler.h"
 #include "mm/kmem.h"
-#include "mm/map.h"
+#include "mm/vmalloc.h"
 #include "mm/page.h"
 #include "nvme.h"
 
@@ -67,13 +67,12 @@ void finish_command(struct nvme_device *dev, uint16_t command_id) {
         printk(u8p("\n"));
     }
     dev->command_statuses[command_id] = NVME_COMMAND_COMPLETED; // in flight -> completed
+    wake_up(&dev->command_wait_queue);
 }
 
 // Must be called in task context
 void await_command_finish(struct nvme_device *dev, uint16_t command_id) {
-    while (dev->command_statuses[command_id] == NVME_COMMAND_IN_FLIGHT) {
-        task_yield();
-    }
+    wait_event(&dev->command_wait_queue, dev->command_statuses[command_id] != NVME_COMMAND_IN_FLIGHT);
 }
 
 
@@ -86,6 +85,8 @@ void nvme_probe_1(struct pci_device *pci_device) {
     uint16_t device_number = num_nvme_devices++;
     struct nvme_device *nvme_device = &nvme_devices[device_number];
     nvme_device->pci_device = pci_device;
+    spin_lock_init(&nvme_device->queue_lock, u8p("nvme_queue"));
+    wait_queue_init(&nvme_device->command_wait_queue, u8p("nvme_command"));
 
     uint8_t name_buffer[6];
     strcpy(name_buffer, u8p("nvmeX"));
@@ -99,23 +100,8 @@ void nvme_probe_1(struct pci_device *pci_device) {
         nvme_device
     );
 
-    uint64_t num_device_pages = pci_device->mmio_size >> 12;
-
     // Map device memory
-    pci_device->mmio_virt_base = (uint64_t)dpage_alloc(num_device_pages);
-    for (uint64_t i = 0; i < num_device_pages; i++) {
-        set_page_mapping(
-            (void*)read_cr3() + hhdm_offset,
-            (void*)pci_device->mmio_virt_base + i * PAGE_SIZE,
-            (void*)pci_device->mmio_phys_base + i * PAGE_SIZE,
-            true
-        );
-    }
-    // Flush TLB
-    asm volatile (
-        "movq %%cr3, %%rax\n"
-        "movq %%rax, %%cr3" : : : "%rax"
-    );
+    pci_device->mmio_virt_base = (uint64_t)vmap_mmio(pci_device->mmio_phys_base, pci_device->mmio_size);
 }
 
 // Must be called in task context
@@ -330,9 +316,7 @@ void nvme_probe_contents(struct nvme_device *dev) {
     dev->metadata_size = (ins_lbaf & 0xFFFF);
 
     // If ASQ is full, wait until there is an empty slot
-    while ((dev->asq_tail + 1) % NVME_QUEUE_SIZE == dev->asq_head) {
-        task_yield();
-    }
+    wait_event(&dev->command_wait_queue, (dev->asq_tail + 1) % NVME_QUEUE_SIZE != dev->asq_head);
 
     uint64_t iocq_phys = (uint64_t)(dev->iocq - hhdm_offset);
 
@@ -375,9 +359,7 @@ void nvme_probe_contents(struct nvme_device *dev) {
     }
 
     // If ASQ is full, wait until there is an empty slot
-    while ((dev->asq_tail + 1) % NVME_QUEUE_SIZE == dev->asq_head) {
-        task_yield();
-    }
+    wait_event(&dev->command_wait_queue, (dev->asq_tail + 1) % NVME_QUEUE_SIZE != dev->asq_head);
 
     uint64_t iosq_phys = (uint64_t)(dev->iosq - hhdm_offset);
 
@@ -436,7 +418,8 @@ void nvme_handle_interrupt(uint8_t interrupt_line) {
         // }
     
         // Interrupt could have come from this device
-        
+        spin_lock(&dev->queue_lock);
+
         // Check if any unacknowledged entries in the admin completion queue
         bool acq_doorbell_write_needed = false;
         while(true) {
@@ -488,18 +471,22 @@ void nvme_handle_interrupt(uint8_t interrupt_line) {
         if (iocq_doorbell_write_needed) {
             *((uint32_t*)(dev->pci_device->mmio_virt_base + 0x1000 + (3 * (4 << dev->dstrd_exponent)))) = dev->iocq_head;
         }
+        spin_unlock(&dev->queue_lock);
     }
 }
 
 // Must be called from task context
 void nvme_readpage(struct nvme_device *dev, uint32_t lba, void* result_page) {
     // If IOSQ is full, wait until there is an empty slot
+    bool interrupts_enabled = spin_lock_irqsave(&dev->queue_lock);
     while ((dev->iosq_tail + 1) % NVME_QUEUE_SIZE == dev->iosq_head) {
-        task_yield();
+        spin_unlock_irqrestore(&dev->queue_lock, interrupts_enabled);
+        wait_event(&dev->command_wait_queue, (dev->iosq_tail + 1) % NVME_QUEUE_SIZE != dev->iosq_head);
+        interrupts_enabled = spin_lock_irqsave(&dev->queue_lock);
     }
   
     struct nvme_sq_entry *tail_iosq_entry;
-    uint64_t result_page_phys = (uint64_t)(result_page - hhdm_offset);
+    uint64_t result_page_phys = kvirt_to_phys(result_page);
   
     // Enqueue 'read' command
     uint16_t command_id = start_command(dev);
@@ -525,6 +512,7 @@ void nvme_readpage(struct nvme_device *dev, uint32_t lba, void* result_page) {
     // Write Submission Queue 1 Tail Doorbell
     uint8_t iocq_head = dev->iocq_head;
     *((uint32_t*)(dev->pci_device->mmio_virt_base + 0x1000 + (2 * (4 << dev->dstrd_exponent)))) = dev->iosq_tail;
+    spin_unlock_irqrestore(&dev->queue_lock, interrupts_enabled);
   
     await_command_finish(dev, command_id);
     free_command(dev, command_id);
@@ -539,9 +527,15 @@ void nvme_readpage(struct nvme_device *dev, uint32_t lba, void* result_page) {
     }
 }
 
+// A transfer can target buffer directly if it is a page aligned page of normal memory
+// Userspace buffers and the kernel image are not, because kvirt_to_phys cannot translate them
+static bool nvme_can_transfer_directly(uint8_t *buffer) {
+    return !((uint64_t)buffer & PAGE_OFFSET_MASK) && kmem_zone_of(buffer) != NULL;
+}
+
 ssize_t nvme_read(void *dev, uint8_t* buffer, uint64_t offset, size_t length) {
     struct nvme_device *nvme_device = dev;
-    void *temp_page = kpage_alloc(1);
+    void *temp_page = NULL; // Bounce page, allocated on the first chunk that cannot be transferred directly
   
     // Avoid overflow
     int64_t bytes_readable = (nvme_device->lba_count << nvme_device->lbads_exponent) - offset;
@@ -556,32 +550,44 @@ ssize_t nvme_read(void *dev, uint8_t* buffer, uint64_t offset, size_t length) {
     while (bytes_read < length) {
         size_t bytes_remaining = length - bytes_read;
         uint32_t lba = offset >> 12 << (12 - nvme_device->lbads_exponent);
-        nvme_readpage(nvme_device, lba, temp_page);
-        
         size_t chunk_page_offset = offset % 4096;
         size_t chunk_length = 4096 - chunk_page_offset;
         if (chunk_length > bytes_remaining) {
             chunk_length = bytes_remaining;
         }
-    
-        memcpy(buffer, temp_page + chunk_page_offset, chunk_length);
+
+        if (chunk_length == 4096 && nvme_can_transfer_directly(buffer)) {
+            // Whole page into a kernel page. Skip the bounce page
+            nvme_readpage(nvme_device, lba, buffer);
+        } else {
+            if (temp_page == NULL) {
+                temp_page = kpage_alloc(1);
+            }
+            nvme_readpage(nvme_device, lba, temp_page);
+            memcpy(buffer, temp_page + chunk_page_offset, chunk_length);
+        }
     
         buffer += chunk_length;
         offset += chunk_length;
         bytes_read += chunk_length;
     }
-    kpage_free(temp_page, 1);
+    if (temp_page != NULL) {
+        kpage_free(temp_page, 1);
+    }
     return bytes_read;
 }
 
 void nvme_writepage(struct nvme_device *dev, uint32_t lba, void* content_page) {
     // If IOSQ is full, wait until there is an empty slot
+    bool interrupts_enabled = spin_lock_irqsave(&dev->queue_lock);
     while ((dev->iosq_tail + 1) % NVME_QUEUE_SIZE == dev->iosq_head) {
-        task_yield();
+        spin_unlock_irqrestore(&dev->queue_lock, interrupts_enabled);
+        wait_event(&dev->command_wait_queue, (dev->iosq_tail + 1) % NVME_QUEUE_SIZE != dev->iosq_head);
+        interrupts_enabled = spin_lock_irqsave(&dev->queue_lock);
     }
   
     struct nvme_sq_entry *tail_iosq_entry;
-    uint64_t result_page_phys = (uint64_t)(content_page - hhdm_offset);
+    uint64_t result_page_phys = kvirt_to_phys(content_page);
   
     // Enqueue 'read' command
     uint16_t command_id = start_command(dev);
@@ -607,6 +613,7 @@ void nvme_writepage(struct nvme_device *dev, uint32_t lba, void* content_page) {
     // Write Submission Queue 1 Tail Doorbell
     uint8_t iocq_head = dev->iocq_head;
     *((uint32_t*)(dev->pci_device->mmio_virt_base + 0x1000 + (2 * (4 << dev->dstrd_exponent)))) = dev->iosq_tail;
+    spin_unlock_irqrestore(&dev->queue_lock, interrupts_enabled);
   
     await_command_finish(dev, command_id);
     free_command(dev, command_id);
@@ -623,7 +630,7 @@ void nvme_writepage(struct nvme_device *dev, uint32_t lba, void* content_page) {
 
 ssize_t nvme_write(void *dev, uint8_t* buffer, uint64_t offset, size_t length) {
     struct nvme_device *nvme_device = dev;
-    void *temp_page = kpage_alloc(1);
+    void *temp_page = NULL; // Bounce page, allocated on the first chunk that cannot be transferred directly
 
     // Avoid overflow
     int64_t bytes_writeable = (nvme_device->lba_count << nvme_device->lbads_exponent) - offset;
@@ -638,22 +645,31 @@ ssize_t nvme_write(void *dev, uint8_t* buffer, uint64_t offset, size_t length) {
     while (bytes_written < length) {
         size_t bytes_remaining = length - bytes_written;
         uint32_t lba = offset >> 12 << (12 - nvme_device->lbads_exponent);
-        nvme_readpage(nvme_device, lba, temp_page);
-        
         size_t chunk_page_offset = offset % 4096;
         size_t chunk_length = 4096 - chunk_page_offset;
         if (chunk_length > bytes_remaining) {
         chunk_length = bytes_remaining;
         }
 
-        memcpy(temp_page + chunk_page_offset, buffer, chunk_length);
-        nvme_writepage(nvme_device, lba, temp_page);
+        if (chunk_length == 4096 && nvme_can_transfer_directly(buffer)) {
+            // Whole page from a kernel page. No read-modify-write needed
+            nvme_writepage(nvme_device, lba, buffer);
+        } else {
+            if (temp_page == NULL) {
+                temp_page = kpage_alloc(1);
+            }
+            nvme_readpage(nvme_device, lba, temp_page);
+            memcpy(temp_page + chunk_page_offset, buffer, chunk_length);
+            nvme_writepage(nvme_device, lba, temp_page);
+        }
 
         buffer += chunk_length;
         offset += chunk_length;
         bytes_written += chunk_length;
     }
-    kpage_free(temp_page, 1);
+    if (temp_page != NULL) {
+        kpage_free(temp_page, 1);
+    }
     return bytes_written;
 }
 
@@ -1,6 +1,8 @@
 #ifndef NVME_H
 #define NVME_H
 #include "lib/cstd.h"
+#include "kernel/waitqueue.h"
+#include "lib/spinlock.h"
 
 struct pci_device;
 
@@ -44,6 +46,11 @@ struct nvme_device {
 
     uint8_t command_statuses[NVME_MAX_COMMANDS];
 
+    // Protects the IO queues and command_statuses against other submitters and the interrupt handler
+    // The admin queue is only used while probing, before any IO is submitted
+    struct spinlock queue_lock;
+    struct wait_queue command_wait_queue; // Tasks waiting for a command to complete or for an IOSQ slot
+
     void *admin_result_buffer;
 };
 
@@ -5,6 +5,7 @@
 #include "drivers/tty.h"
 #include "fs/vfs.h"
 #include "mm/kmem.h"
+#include "mm/vmalloc.h"
 #include "nvmepart.h"
 
 uint16_t num_nvmepart_devices = 0;
@@ -23,7 +24,8 @@ struct gpt_partition_entry {
 } __attribute__((packed));
 
 void nvmepart_probe(struct nvme_device *dev) {
-    void *disk_start_buffer = kpage_alloc(5);
+    // Only needs to be virtually contiguous. nvme_readpage translates each page with kvirt_to_phys
+    void *disk_start_buffer = vmalloc(5);
     nvme_readpage(dev, 0, disk_start_buffer);
     nvme_readpage(dev, 8 * 1, disk_start_buffer + 4096 * 1); // Hack: what if block size is different to 512?
     nvme_readpage(dev, 8 * 2, disk_start_buffer + 4096 * 2);
@@ -33,6 +35,7 @@ void nvmepart_probe(struct nvme_device *dev) {
         printk(u8p("No GPT found on nvme device 0x"));
         printk_uint8(dev - nvme_devices);
         printk(u8p("\n"));
+        vfree(disk_start_buffer);
         return;
     }
     uint32_t num_partition_entries = *((uint32_t*)(disk_start_buffer + 0x250));
@@ -42,6 +45,7 @@ void nvmepart_probe(struct nvme_device *dev) {
         uint32_t partition_entry_offset = 0x400 + pnum * partition_entry_size;
         if (partition_entry_size + partition_entry_offset > 4096 * 5) {
             printk(u8p("GPT partition entries go past disk_start_buffer\n"));
+            vfree(disk_start_buffer);
             return;
         }
         struct gpt_partition_entry *pe = disk_start_buffer + partition_entry_offset;
@@ -56,10 +60,12 @@ void nvmepart_probe(struct nvme_device *dev) {
         }
         if (pe->first_lba_high != 0) {
             printk(u8p("GPT partition start exceeds 2TB\n"));
+            vfree(disk_start_buffer);
             return;
         }
         if (pe->last_lba_high != 0) {
             printk(u8p("GPT partition end exceeds 2TB\n"));
+            vfree(disk_start_buffer);
             return;
         }
         uint16_t device_number = num_nvmepart_devices++;
@@ -95,6 +101,7 @@ void nvmepart_probe(struct nvme_device *dev) {
             partition
         );
     }
+    vfree(disk_start_buffer);
 }
 
 ssize_t nvmepart_read(void *dev, uint8_t* buffer, uint64_t offset, size_t length) {
@@ -58,6 +58,7 @@ void vt_device_init(
     vt->terminal_height = terminal_height;
     vt->escape_state.type = VT_ESCAPE_NONE;
     vt->device_number = device_number;
+    wait_queue_init(&vt->input_wait_queue, u8p("tty_input"));
 }
 
 void set_active_vt(struct vt_device *vt) {
@@ -335,7 +336,7 @@ ssize_t vt_read(void *dev, uint8_t *buffer, uint64_t offset, size_t length) {
     struct vt_device *vt_device = dev;
     uint8_t *buf = buffer;
     while(true) {
-        task_yield();
+        wait_event(&vt_device->input_wait_queue, vt_device->input_rb_head_idx != vt_device->input_rb_tail_idx);
         while (vt_device->input_rb_head_idx != vt_device->input_rb_tail_idx) {
             int8_t c = vt_device->input_rb[vt_device->input_rb_head_idx];
             *buf++ = c;
@@ -359,6 +360,7 @@ void vt_append_input_character(struct vt_device *vt_device, uint8_t character) {
     }
     vt_device->input_rb[vt_device->input_rb_tail_idx] = character;
     vt_device->input_rb_tail_idx = (vt_device->input_rb_tail_idx + 1) % VT_INPUT_BUFFER_LENGTH;
+    wake_up(&vt_device->input_wait_queue);
 }
 
 // Called in interrupt context
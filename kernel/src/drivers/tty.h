@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <lib/cstd.h>
 #include "keyboard.h"
+#include "kernel/waitqueue.h"
 
 #define VT_MAX_WIDTH 240
 #define VT_MAX_HEIGHT 135
@@ -32,6 +33,7 @@ struct vt_device {
     uint32_t input_rb_tail_idx;
     uint32_t device_number;
     int8_t input_rb[VT_INPUT_BUFFER_LENGTH];
+    struct wait_queue input_wait_queue; // Readers waiting for input_rb to fill
 };
 
 extern struct vt_device tty1;
@@ -1 +1,50 @@
 #include "fs/elf.h"
+#include "fs/vfs.h"
+#include "mm/kmalloc.h"
+#include "mm/userspace.h"
+
+// Returns the parsed image of the binary open in filp, reading and caching it on first use
+// The caller gets a reference, to be dropped with elf_image_put, so that the image outlives an
+// invalidation while it is being loaded. Returns NULL if the binary has too many program headers
+struct elf_image *elf_image_get(struct file *filp) {
+    struct inode *inode = filp->inode;
+    if (inode->elf_image != NULL) {
+        vmstat.exec_elf_image_hits++;
+        inode->elf_image->refcount++;
+        return inode->elf_image;
+    }
+    vmstat.exec_elf_image_misses++;
+
+    struct elf64_hdr elf_file_header;
+    filp->offset = 0;
+    vfs_read(filp, &elf_file_header, sizeof(struct elf64_hdr));
+    if (elf_file_header.e_phnum > ELF_IMAGE_MAX_SEGMENTS) {
+        return NULL;
+    }
+
+    // Read the whole program header table at once
+    struct elf_image *image = kmalloc(sizeof(struct elf_image) + elf_file_header.e_phnum * sizeof(struct elf64_phdr));
+    image->refcount = 2; // The inode's and the caller's
+    image->entry = elf_file_header.e_entry;
+    image->num_segments = elf_file_header.e_phnum;
+    filp->offset = elf_file_header.e_phoff;
+    vfs_read(filp, image->segments, elf_file_header.e_phnum * sizeof(struct elf64_phdr));
+    inode->elf_image = image;
+    return image;
+}
+
+void elf_image_put(struct elf_image *image) {
+    image->refcount--;
+    if (image->refcount == 0) {
+        kfree(image);
+    }
+}
+
+// Drop the cached image of inode. Called whenever the file changes
+// Execs that already got the image keep their own reference to it
+void elf_image_invalidate(struct inode *inode) {
+    if (inode->elf_image != NULL) {
+        elf_image_put(inode->elf_image);
+        inode->elf_image = NULL;
+    }
+}
@@ -2,6 +2,10 @@
 #define ELF_H
 
 #include "lib/cstd.h"
+#include "mm/page.h"
+
+struct file;
+struct inode;
 
 /* 64-bit ELF base types. */
 typedef uint64_t Elf64_Addr;
@@ -46,4 +50,29 @@ typedef struct elf64_phdr {
 
 ct_assert(sizeof(Elf64_Phdr) == 56);
 
+// p_type
+#define PT_LOAD 1
+
+// p_flags
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
+// Parsed ELF header and program header table of a binary, cached on its inode
+// Dropped when the file is written to
+// Each caller of elf_image_get holds a reference, and so does the inode while the image is cached on it
+struct elf_image {
+    uint32_t refcount;
+    uint64_t entry;
+    uint32_t num_segments;
+    Elf64_Phdr segments[];
+};
+
+// The cached image is kmalloc'd, so it must fit in a page
+#define ELF_IMAGE_MAX_SEGMENTS ((PAGE_SIZE - sizeof(struct elf_image)) / sizeof(Elf64_Phdr))
+
+struct elf_image *elf_image_get(struct file *filp);
+void elf_image_put(struct elf_image *image);
+void elf_image_invalidate(struct inode *inode);
+
 #endif
@@ -4,7 +4,9 @@
 #include "drivers/tty.h"
 #include "lib/cstd.h"
 #include "fs/vfs.h"
+#include "mm/kmalloc.h"
 #include "mm/kmem.h"
+#include "mm/page.h"
 #include "mm/slab.h"
 
 struct slab_allocator exfat_inode_allocator = SLAB_OF(struct exfat_inode);
@@ -30,7 +32,7 @@ ssize_t exfat_mount(struct inode *device_inode, struct dentry *mountpoint_dentry
         return -11;
     }
 
-    struct exfat_superblock *exfat_superblock = kpage_alloc(1); // TODO: don't waste memory
+    struct exfat_superblock *exfat_superblock = kmalloc(sizeof(struct exfat_superblock));
     exfat_superblock->fat_offset = *((uint32_t*)(page0 + 0x50));
     exfat_superblock->fat_length = *((uint32_t*)(page0 + 0x54));
     exfat_superblock->cluster_heap_offset = *((uint32_t*)(page0 + 0x58));
@@ -38,7 +40,7 @@ ssize_t exfat_mount(struct inode *device_inode, struct dentry *mountpoint_dentry
     exfat_superblock->bytes_per_sector_exponent = *((uint8_t*)(page0 + 0x6C));
     exfat_superblock->sectors_per_cluster_exponent = *((uint8_t*)(page0 + 0x6D));
 
-    struct superblock *vfs_superblock = kpage_alloc(1); // TODO: don't waste memory
+    struct superblock *vfs_superblock = kmalloc(sizeof(struct superblock));
     vfs_superblock->device_fops = fops;
     vfs_superblock->device = dev;
     vfs_superblock->ops = &exfat_superblock_ops;
@@ -109,7 +111,7 @@ void exfat_load_dir_inode(struct inode *dir_inode) {
                 struct exfat_inode *child_inode = exfat_inode_alloc();
                 vfs_inode->private = child_inode;
                 file_dentry->inode = vfs_inode;
-                list_add_tail(&file_dentry->dentry_le, &dir_inode->dentry_lh);
+                vfs_dentry_add(dir_inode, file_dentry);
                 
                 uint16_t file_attributes = *((uint16_t*)(x + 4));
                 bool is_directory = file_attributes & (1 << 4);
@@ -119,6 +121,8 @@ void exfat_load_dir_inode(struct inode *dir_inode) {
                 } else {
                     file_dentry->inode->type = INODE_REGULAR_FILE;
                     file_dentry->inode->file_length = 0;
+                    file_dentry->inode->page_cache_tree.node = NULL;
+                    file_dentry->inode->elf_image = NULL;
                     init_list(&child_inode->file_clusters_lh);
                 }
                 child_inode->load_needed = true;
@@ -254,7 +258,6 @@ void exfat_load_file_inode(struct inode *file_inode) {
 
 ssize_t exfat_read(struct file *filp, void *buf, size_t length) {
     struct exfat_inode* exfat_inode = filp->inode->private;
-    void *content_buffer = kpage_alloc(1);
     size_t total_bytes_read = 0;
     for (
         struct list_head *file_clusters_le = exfat_inode->file_clusters_lh.next;
@@ -274,19 +277,18 @@ ssize_t exfat_read(struct file *filp, void *buf, size_t length) {
             goto finalize;
         }
 
+        // Read straight into the caller's buffer
         ssize_t bytes_read = filp->inode->superblock->device_fops->read(
             filp->inode->superblock->device,
-            content_buffer,
+            buf,
             cluster->device_offset + page_offset,
             bytes_to_read
         );
-        memcpy(buf, content_buffer, bytes_read);
         total_bytes_read += bytes_read;
         buf += bytes_read;
         filp->offset += bytes_read;
     }
     finalize:
-    kpage_free(content_buffer, 1);
     return total_bytes_read;
 }
 
@@ -383,4 +385,5 @@ struct filesystem_ops exfat_superblock_ops = {
     .read = exfat_read,
     .write = exfat_write,
     .set_size = exfat_set_size,
+    .supports_mmap = true,
 };
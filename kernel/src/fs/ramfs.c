@@ -32,13 +32,15 @@ ssize_t ramfs_create_file_inode(
 ) {
     out_inode->type = INODE_REGULAR_FILE;
     out_inode->superblock = parent_dir->superblock;
-    init_list(&out_inode->dentry_lh);
+    out_inode->file_length = 0;
+    out_inode->page_cache_tree.node = NULL;
+    out_inode->elf_image = NULL;
     out_dentry->inode = out_inode;
     out_dentry->mounted_inode = NULL;
     struct ramfs_inode *ramfs_inode = ramfs_inode_alloc();
     init_list(&ramfs_inode->ramfs_clusters_lh);
     out_inode->private = ramfs_inode;
-    list_add_tail(&out_dentry->dentry_le, &parent_dir->dentry_lh);
+    vfs_dentry_add(parent_dir, out_dentry);
     return 0;
 }
 
@@ -53,7 +55,7 @@ ssize_t ramfs_create_dir_inode(
     init_list(&out_inode->dentry_lh);
     out_dentry->inode = out_inode;
     out_dentry->mounted_inode = NULL;
-    list_add_tail(&out_dentry->dentry_le, &parent_dir->dentry_lh);
+    vfs_dentry_add(parent_dir, out_dentry);
     return 0;
 }
 
@@ -75,7 +77,7 @@ ssize_t ramfs_create_dev_inode(
     out_inode->device = device;
     out_dentry->inode = out_inode;
     out_dentry->mounted_inode = NULL;
-    list_add_tail(&out_dentry->dentry_le, &parent_dir->dentry_lh);
+    vfs_dentry_add(parent_dir, out_dentry);
     return 0;
 }
 
@@ -194,6 +196,7 @@ ssize_t ramfs_set_size(struct file *filp, size_t size) {
         ramfs_drop_cluster(cluster);
     }
     ramfs_inode->size = size;
+    filp->inode->file_length = size;
     return 0;
 }
 
@@ -206,4 +209,5 @@ struct filesystem_ops ramfs_superblock_ops = {
     .read = ramfs_read,
     .write = ramfs_write,
     .set_size = ramfs_set_size,
+    .supports_mmap = true,
 };
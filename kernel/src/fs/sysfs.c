@@ -2,12 +2,19 @@
 #include <stddef.h>
 #include "sysfs.h"
 #include "arch/asm.h"
+#include "arch/idt.h"
 #include "drivers/pci.h"
 #include "drivers/nvme.h"
 #include "drivers/tty.h"
+#include "kernel/scheduler.h"
 #include "lib/cstd.h"
+#include "lib/spinlock.h"
+#include "mm/kmalloc.h"
 #include "mm/kmem.h"
+#include "mm/pagecache.h"
 #include "mm/slab.h"
+#include "mm/userspace.h"
+#include "mm/vmalloc.h"
 
 #define SYSFS_MOUNT_NOT_IMPLEMENTED 3
 
@@ -19,6 +26,18 @@ struct dentry sysfs_meminfo_dentry;
 struct inode sysfs_meminfo_inode;
 struct dentry sysfs_nvme_dentry;
 struct inode sysfs_nvme_inode;
+struct dentry sysfs_buddyinfo_dentry;
+struct inode sysfs_buddyinfo_inode;
+struct dentry sysfs_vmstat_dentry;
+struct inode sysfs_vmstat_inode;
+struct dentry sysfs_slabinfo_dentry;
+struct inode sysfs_slabinfo_inode;
+struct dentry sysfs_schedstat_dentry;
+struct inode sysfs_schedstat_inode;
+struct dentry sysfs_lockstat_dentry;
+struct inode sysfs_lockstat_inode;
+struct dentry sysfs_sched_time_slice_dentry;
+struct inode sysfs_sched_time_slice_inode;
 
 ssize_t sysfs_mount(struct inode *device_inode, struct dentry *mountpoint_dentry) {
     (void) device_inode;
@@ -61,6 +80,54 @@ void sysfs_init() {
     list_add_tail(&sysfs_nvme_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
     sysfs_nvme_dentry.inode = &sysfs_nvme_inode;
 
+    sysfs_buddyinfo_inode.type = INODE_REGULAR_FILE;
+    sysfs_buddyinfo_inode.file_length = 10;
+    sysfs_buddyinfo_inode.superblock = &sysfs_superblock;
+
+    strcpy(sysfs_buddyinfo_dentry.name, u8p("buddyinfo"));
+    list_add_tail(&sysfs_buddyinfo_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
+    sysfs_buddyinfo_dentry.inode = &sysfs_buddyinfo_inode;
+
+    sysfs_vmstat_inode.type = INODE_REGULAR_FILE;
+    sysfs_vmstat_inode.file_length = 10;
+    sysfs_vmstat_inode.superblock = &sysfs_superblock;
+
+    strcpy(sysfs_vmstat_dentry.name, u8p("vmstat"));
+    list_add_tail(&sysfs_vmstat_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
+    sysfs_vmstat_dentry.inode = &sysfs_vmstat_inode;
+
+    sysfs_slabinfo_inode.type = INODE_REGULAR_FILE;
+    sysfs_slabinfo_inode.file_length = 10;
+    sysfs_slabinfo_inode.superblock = &sysfs_superblock;
+
+    strcpy(sysfs_slabinfo_dentry.name, u8p("slabinfo"));
+    list_add_tail(&sysfs_slabinfo_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
+    sysfs_slabinfo_dentry.inode = &sysfs_slabinfo_inode;
+
+    sysfs_schedstat_inode.type = INODE_REGULAR_FILE;
+    sysfs_schedstat_inode.file_length = 10;
+    sysfs_schedstat_inode.superblock = &sysfs_superblock;
+
+    strcpy(sysfs_schedstat_dentry.name, u8p("schedstat"));
+    list_add_tail(&sysfs_schedstat_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
+    sysfs_schedstat_dentry.inode = &sysfs_schedstat_inode;
+
+    sysfs_lockstat_inode.type = INODE_REGULAR_FILE;
+    sysfs_lockstat_inode.file_length = 10;
+    sysfs_lockstat_inode.superblock = &sysfs_superblock;
+
+    strcpy(sysfs_lockstat_dentry.name, u8p("lockstat"));
+    list_add_tail(&sysfs_lockstat_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
+    sysfs_lockstat_dentry.inode = &sysfs_lockstat_inode;
+
+    sysfs_sched_time_slice_inode.type = INODE_REGULAR_FILE;
+    sysfs_sched_time_slice_inode.file_length = 10;
+    sysfs_sched_time_slice_inode.superblock = &sysfs_superblock;
+
+    strcpy(sysfs_sched_time_slice_dentry.name, u8p("sched_time_slice"));
+    list_add_tail(&sysfs_sched_time_slice_dentry.dentry_le, &sysfs_root_inode.dentry_lh);
+    sysfs_sched_time_slice_dentry.inode = &sysfs_sched_time_slice_inode;
+
     struct vfs_lookup_result sys_resolve_result;
     vfs_resolve(u8p("sys"), &sys_resolve_result);
     if (sys_resolve_result.status != VFS_RESOLVE_SUCCESS_EXISTS) {
@@ -246,7 +313,238 @@ ssize_t sysfs_read(struct file *filp, void *buffer, size_t length) {
         safe_copy_string(&destination, &destination_length, u8p("\nused_memory_kib = "));
         sprintf_dec(kmem_used_pages * 4, num_string_buffer, 0, 0);
         safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nvmalloc_used_kib = "));
+        sprintf_dec(vmalloc_used_pages * 4, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nzero_pool_pages = "));
+        sprintf_dec(kmem_zero_pool_count, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nzero_pool_hits = "));
+        sprintf_dec(kmem_zero_pool_hits, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nzero_pool_misses = "));
+        sprintf_dec(kmem_zero_pool_misses, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
         safe_copy_string(&destination, &destination_length, u8p("\n"));
+        for (uint32_t i = 0; i < kmem_num_zones; i++) {
+            struct kmem_zone *zone = &kmem_zones[i];
+            uint8_t zone_string_buffer[11];
+            sprintf_dec(i, zone_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, u8p("zone_"));
+            safe_copy_string(&destination, &destination_length, zone_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("_total_memory_kib = "));
+            sprintf_dec(zone->total_pages * 4, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("\nzone_"));
+            safe_copy_string(&destination, &destination_length, zone_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("_used_memory_kib = "));
+            sprintf_dec(zone->used_pages * 4, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("\n"));
+        }
+    } else if (filp->inode == &sysfs_buddyinfo_inode) {
+        uint8_t num_string_buffer[11];
+        // One line per zone with the number of free blocks of each order, like Linux /proc/buddyinfo
+        for (uint32_t i = 0; i < kmem_num_zones; i++) {
+            safe_copy_string(&destination, &destination_length, u8p("zone_"));
+            sprintf_dec(i, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("_free_blocks ="));
+            for (uint8_t order = 0; order <= KMEM_MAX_ORDER; order++) {
+                safe_copy_string(&destination, &destination_length, u8p(" "));
+                sprintf_dec(kmem_zones[i].free_blocks[order], num_string_buffer, 0, 0);
+                safe_copy_string(&destination, &destination_length, num_string_buffer);
+            }
+            safe_copy_string(&destination, &destination_length, u8p("\n"));
+        }
+    } else if (filp->inode == &sysfs_vmstat_inode) {
+        uint8_t num_string_buffer[11];
+        safe_copy_string(&destination, &destination_length, u8p("fork_count = "));
+        sprintf_dec(vmstat.fork_count, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nfork_avg_cycles = "));
+        sprintf_dec(vmstat.fork_count ? vmstat.fork_cycles / vmstat.fork_count : 0, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nfork_pages_shared = "));
+        sprintf_dec(vmstat.fork_pages_shared, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\ncow_faults = "));
+        sprintf_dec(vmstat.cow_faults, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\ncow_pages_copied = "));
+        sprintf_dec(vmstat.cow_pages_copied, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\ndemand_zero_pages = "));
+        sprintf_dec(vmstat.demand_zero_pages, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nzero_page_maps = "));
+        sprintf_dec(vmstat.zero_page_maps, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nhuge_page_faults = "));
+        sprintf_dec(vmstat.huge_page_faults, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nhuge_page_splits = "));
+        sprintf_dec(vmstat.huge_page_splits, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nspawn_count = "));
+        sprintf_dec(vmstat.spawn_count, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nspawn_avg_cycles = "));
+        sprintf_dec(vmstat.spawn_count ? vmstat.spawn_cycles / vmstat.spawn_count : 0, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexec_count = "));
+        sprintf_dec(vmstat.exec_count, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexec_avg_cycles = "));
+        sprintf_dec(vmstat.exec_count ? vmstat.exec_cycles / vmstat.exec_count : 0, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexec_page_tables_freed = "));
+        sprintf_dec(vmstat.exec_page_tables_freed, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexit_count = "));
+        sprintf_dec(vmstat.exit_count, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexit_avg_cycles = "));
+        sprintf_dec(vmstat.exit_count ? vmstat.exit_cycles / vmstat.exit_count : 0, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexec_shared_segments = "));
+        sprintf_dec(vmstat.exec_shared_segments, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexec_elf_image_hits = "));
+        sprintf_dec(vmstat.exec_elf_image_hits, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\nexec_elf_image_misses = "));
+        sprintf_dec(vmstat.exec_elf_image_misses, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\npage_cache_pages = "));
+        sprintf_dec(page_cache_stats.pages, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\npage_cache_hits = "));
+        sprintf_dec(page_cache_stats.hits, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\npage_cache_misses = "));
+        sprintf_dec(page_cache_stats.misses, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\npage_cache_writebacks = "));
+        sprintf_dec(page_cache_stats.writebacks, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\npage_cache_evictions = "));
+        sprintf_dec(page_cache_stats.evictions, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\n"));
+    } else if (filp->inode == &sysfs_slabinfo_inode) {
+        uint8_t num_string_buffer[11];
+        // One line per slab cache
+        list_for_each(slab_allocators_le, slab_allocators_lh) {
+            struct slab_allocator *allocator = container_of(slab_allocators_le, struct slab_allocator, slab_allocators_le);
+            uint8_t *name = allocator->name;
+            if (strncmp(name, u8p("struct "), 7) == 0) {
+                name += 7;
+            }
+            safe_copy_string(&destination, &destination_length, name);
+            safe_copy_string(&destination, &destination_length, u8p(": object_size = "));
+            sprintf_dec(allocator->object_size, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" active_objects = "));
+            sprintf_dec(allocator->active_objects, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" magazine_objects = "));
+            sprintf_dec(slab_magazine_objects(allocator), num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" pages = "));
+            sprintf_dec(allocator->total_pages, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" empty_pages = "));
+            sprintf_dec(allocator->empty_count, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("\n"));
+        }
+        // kmalloc allocations too large for any size class get a whole page each
+        safe_copy_string(&destination, &destination_length, u8p("kmalloc_page_allocations = "));
+        sprintf_dec(kmalloc_page_allocations, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\n"));
+    } else if (filp->inode == &sysfs_schedstat_inode) {
+        uint8_t num_string_buffer[11];
+        safe_copy_string(&destination, &destination_length, u8p("pcid_enabled = "));
+        sprintf_dec(pcid_enabled, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\ninvpcid_supported = "));
+        sprintf_dec(invpcid_supported, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\naddress_space_switches = "));
+        sprintf_dec(sched_stats.address_space_switches, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\naddress_space_switch_avg_cycles = "));
+        sprintf_dec(
+            sched_stats.address_space_switches ? sched_stats.address_space_switch_cycles / sched_stats.address_space_switches : 0,
+            num_string_buffer, 0, 0
+        );
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\naddress_space_switch_flushes = "));
+        sprintf_dec(sched_stats.address_space_switch_flushes, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\ntlb_flushes = "));
+        sprintf_dec(sched_stats.tlb_flushes, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\ntlb_shootdowns = "));
+        sprintf_dec(sched_stats.tlb_shootdowns, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\npcid_generations = "));
+        sprintf_dec(sched_stats.pcid_generations, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\n"));
+        // One line per CPU
+        for (uint32_t i = 0; i < num_cpus; i++) {
+            safe_copy_string(&destination, &destination_length, u8p("cpu"));
+            sprintf_dec(i, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(": online = "));
+            sprintf_dec(cpus[i].online, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" current = "));
+            sprintf_dec(cpus[i].current_task ? cpus[i].current_task->pid : 0, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" context_switches = "));
+            sprintf_dec(cpus[i].context_switches, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" migrations = "));
+            sprintf_dec(cpus[i].migrations, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" preemptions = "));
+            sprintf_dec(cpus[i].preemptions, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("\n"));
+        }
+    } else if (filp->inode == &sysfs_sched_time_slice_inode) {
+        uint8_t num_string_buffer[11];
+        sprintf_dec(sched_time_slice_ticks, num_string_buffer, 0, 0);
+        safe_copy_string(&destination, &destination_length, num_string_buffer);
+        safe_copy_string(&destination, &destination_length, u8p("\n"));
+    } else if (filp->inode == &sysfs_lockstat_inode) {
+        uint8_t num_string_buffer[11];
+        // One line per registered lock
+        list_for_each(lock_stats_le, lock_stats_lh) {
+            struct lock_stats *stats = container_of(lock_stats_le, struct lock_stats, lock_stats_le);
+            uint8_t *name = stats->name;
+            if (strncmp(name, u8p("struct "), 7) == 0) {
+                name += 7;
+            }
+            safe_copy_string(&destination, &destination_length, name);
+            safe_copy_string(&destination, &destination_length, u8p(": acquisitions = "));
+            sprintf_dec(stats->acquisitions, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" contended = "));
+            sprintf_dec(stats->contended, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" spins = "));
+            sprintf_dec(stats->spins, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p(" max_hold_cycles = "));
+            sprintf_dec(stats->max_hold_cycles, num_string_buffer, 0, 0);
+            safe_copy_string(&destination, &destination_length, num_string_buffer);
+            safe_copy_string(&destination, &destination_length, u8p("\n"));
+        }
     } else {
         panic(u8p("Unknown sysfs inode"));
     }
@@ -255,16 +553,30 @@ ssize_t sysfs_read(struct file *filp, void *buffer, size_t length) {
     return filp->offset;
 }
 
+// Only sched_time_slice is writable. It takes a decimal number of timer ticks
 ssize_t sysfs_write(struct file *filp, void *buf, size_t length) {
-    (void) filp;
-    (void) buf;
-    (void) length;
-    return -1;
+    if (filp->inode != &sysfs_sched_time_slice_inode) {
+        return -1;
+    }
+    uint8_t *digits = buf; // Unsafe
+    uint64_t ticks = 0;
+    size_t i = 0;
+    while (i < length && digits[i] >= '0' && digits[i] <= '9' && ticks < TIMER_TICKS_PER_SECOND) {
+        ticks = ticks * 10 + (digits[i] - '0');
+        i++;
+    }
+    if (ticks == 0) {
+        return -1;
+    }
+    sched_time_slice_ticks = ticks < TIMER_TICKS_PER_SECOND ? ticks : TIMER_TICKS_PER_SECOND;
+    return length;
 }
 
 ssize_t sysfs_set_size(struct file *filp, size_t size) {
-    (void) filp;
-    (void) size;
+    // Opening sched_time_slice for writing truncates it
+    if (filp->inode == &sysfs_sched_time_slice_inode && size == 0) {
+        return 0;
+    }
     return -1;
 }
 
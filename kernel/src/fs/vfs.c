@@ -1,9 +1,13 @@
 #include "arch/asm.h"
 #include "drivers/tty.h"
+#include "fs/elf.h"
 #include "fs/ramfs.h"
 #include "fs/vfs.h"
 #include "kernel/scheduler.h"
 #include "lib/cstd.h"
+#include "mm/kmem.h"
+#include "mm/page.h"
+#include "mm/pagecache.h"
 #include "mm/slab.h"
 
 struct slab_allocator inode_allocator = SLAB_OF(struct inode);
@@ -15,11 +19,14 @@ struct inode *vfs_dev_dir_inode;
 struct inode *vfs_sys_dir_inode;
 struct superblock vfs_root_superblock;
 struct ramfs_superblock ramfs_root_superblock;
+struct rwlock dentry_lock; // Protects the dentry lists of all directories
 
 void vfs_init() {
+    file_allocator.magazine_size = 16; // Allocated and freed by every open and close
     slab_allocator_init(&inode_allocator);
     slab_allocator_init(&dentry_allocator);
     slab_allocator_init(&file_allocator);
+    rwlock_init(&dentry_lock, u8p("dentry"));
 
     vfs_root_inode.type = INODE_DIRECTORY;
     init_list(&vfs_root_inode.dentry_lh); // Empty list of dentries
@@ -108,6 +115,7 @@ void vfs_resolve(uint8_t *path, struct vfs_lookup_result *lookup_result) {
 
         // Search directory for matching dentry
         bool found_match = false;
+        read_lock(&dentry_lock);
         for (
             struct list_head *dentry_le = inode->dentry_lh.next;
             dentry_le != &inode->dentry_lh;
@@ -124,12 +132,14 @@ void vfs_resolve(uint8_t *path, struct vfs_lookup_result *lookup_result) {
                 } else {
                     inode = dentry->inode;
                 }
-                
-                // For disk based filesystems
-                inode->superblock->ops->lookup(inode, dentry /* sus */ );
                 break;
             }
         }
+        read_unlock(&dentry_lock);
+        if (found_match) {
+            // For disk based filesystems. May read the disk, so runs without dentry_lock
+            inode->superblock->ops->lookup(inode, cur_dentry /* sus */ );
+        }
         if (!found_match) {
             if (*buf == 0) {
                 // This is the last fragment
@@ -152,6 +162,13 @@ void vfs_resolve(uint8_t *path, struct vfs_lookup_result *lookup_result) {
     return;
 }
 
+// Link a new dentry into dir. Called by filesystems when creating or discovering a file
+void vfs_dentry_add(struct inode *dir, struct dentry *dentry) {
+    write_lock(&dentry_lock);
+    list_add_tail(&dentry->dentry_le, &dir->dentry_lh);
+    write_unlock(&dentry_lock);
+}
+
 ssize_t vfs_write(struct file *filp, void *buffer, size_t length) {
     if (filp->inode->type == INODE_DEVICE) {
         ssize_t bytes_written = filp->inode->device_fops->write(
@@ -168,9 +185,14 @@ ssize_t vfs_write(struct file *filp, void *buffer, size_t length) {
         if (!filp->inode->superblock) {
             panic(u8p("vfs_write: no supernode\n")); // Should not happen
         }
+        uint64_t write_start_offset = filp->offset;
+        elf_image_invalidate(filp->inode);
         ssize_t bytes_written = filp->inode->superblock->ops->write(filp, buffer, length);
         if (bytes_written != -1) {
             filp->offset += bytes_written;
+            if (filp->inode->page_cache_tree.node != NULL) {
+                page_cache_update(filp->inode, write_start_offset, buffer, bytes_written);
+            }
         }
         return bytes_written;
     } else if (filp->inode->type == INODE_DIRECTORY) {
@@ -181,6 +203,34 @@ ssize_t vfs_write(struct file *filp, void *buffer, size_t length) {
     return -1;
 }
 
+// Read a regular file that has cached pages. Cached pages may hold changes made through shared mappings
+// that are not written back yet, so they are copied from the cache. The rest is read from the filesystem
+static ssize_t vfs_read_cached(struct file *filp, void *buffer, size_t length) {
+    struct inode *inode = filp->inode;
+    uint64_t end = filp->offset + length < inode->file_length ? filp->offset + length : inode->file_length;
+    size_t total_bytes_read = 0;
+    while (filp->offset < end) {
+        uint64_t page_offset = filp->offset & PAGE_OFFSET_MASK;
+        size_t chunk_length = end - filp->offset < PAGE_SIZE - page_offset ? end - filp->offset : PAGE_SIZE - page_offset;
+        void *page = page_cache_find(inode, filp->offset / PAGE_SIZE);
+        if (page != NULL) {
+            // Faulting in the user buffer may allocate, which could otherwise evict the page
+            kpage_get(page);
+            memcpy(buffer + total_bytes_read, page + page_offset, chunk_length);
+            kpage_put(page, 1);
+            filp->offset += chunk_length;
+            total_bytes_read += chunk_length;
+            continue;
+        }
+        ssize_t bytes_read = inode->superblock->ops->read(filp, buffer + total_bytes_read, chunk_length);
+        if (bytes_read <= 0) {
+            break;
+        }
+        total_bytes_read += bytes_read;
+    }
+    return total_bytes_read;
+}
+
 ssize_t vfs_read(struct file *filp, void *buffer, size_t length) {
     if (filp->inode->type == INODE_DEVICE) {
         ssize_t bytes_read = filp->inode->device_fops->read(
@@ -196,6 +246,9 @@ ssize_t vfs_read(struct file *filp, void *buffer, size_t length) {
             // printk("vfs_read: no supernode\n"); // Should not happen
             return -1;
         }
+        if (filp->inode->page_cache_tree.node != NULL) {
+            return vfs_read_cached(filp, buffer, length);
+        }
         return filp->inode->superblock->ops->read(filp, buffer, length);
     } else if (filp->inode->type == INODE_DIRECTORY) {
         // printk("vfs_read: not implemented for directories\n");
@@ -213,7 +266,12 @@ ssize_t vfs_ftruncate(struct file *filp, size_t size) {
         if (!filp->inode->superblock) {
             return -1;
         }
-        return filp->inode->superblock->ops->set_size(filp, size);
+        elf_image_invalidate(filp->inode);
+        ssize_t set_size_result = filp->inode->superblock->ops->set_size(filp, size);
+        if (set_size_result == 0 && filp->inode->page_cache_tree.node != NULL) {
+            page_cache_truncate(filp->inode, size);
+        }
+        return set_size_result;
     } else if (filp->inode->type == INODE_DIRECTORY) {
         return -1;
     } else {
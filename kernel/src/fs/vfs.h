@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include "lib/cstd.h"
 #include "lib/list.h"
+#include "lib/rbtree.h"
+#include "lib/spinlock.h"
 
 #define INODE_DIRECTORY 0x61
 #define INODE_DEVICE 0x62
@@ -47,6 +49,8 @@ struct filesystem_ops {
     ssize_t (*read)(struct file *filp, void *buffer, size_t length);
     ssize_t (*write)(struct file *filp, void *buffer, size_t length);
     ssize_t (*set_size)(struct file *filp, size_t length);
+
+    bool supports_mmap; // Regular files can be mapped through the page cache
 };
 
 struct superblock {
@@ -78,6 +82,8 @@ struct inode {
         // INODE_REGULAR_FILE
         struct {
             size_t file_length;
+            struct rb_root page_cache_tree; // struct page_cache_entry, ordered by index
+            struct elf_image *elf_image; // Cached by the ELF loader. NULL if not parsed yet
         };
     };
 };
@@ -91,6 +97,7 @@ struct dentry {
 
 extern struct inode vfs_root_inode;
 extern struct inode *vfs_dev_dir_inode;
+extern struct rwlock dentry_lock;
 
 struct vfs_lookup_result {
     uint8_t status;
@@ -150,6 +157,7 @@ struct inode *vfs_mkdir(
 );
 struct inode *vfs_create(struct inode *parent_dir, uint8_t *name);
 void vfs_resolve(uint8_t *path, struct vfs_lookup_result *result);
+void vfs_dentry_add(struct inode *dir, struct dentry *dentry);
 ssize_t vfs_read(struct file *filp, void *buffer, size_t length);
 ssize_t vfs_write(struct file *filp, void *buffer, size_t length);
 ssize_t vfs_ftruncate(struct file *filp, size_t size);
@@ -38,6 +38,13 @@ volatile struct limine_module_request module_request = {
     .revision = 0,
 };
 
+__attribute__((used, section(".requests")))
+volatile struct limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST,
+    .revision = 0,
+    .flags = 0, // Keep xAPIC mode unless the firmware already enabled x2APIC
+};
+
 // Finally, define the start and end markers for the Limine requests.
 // These can also be moved anywhere, to any .c file, as seen fit.
 
@@ -2,7 +2,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "arch/asm.h"
-#include "arch/gdt.h"
+#include "arch/cpu.h"
 #include "arch/idt.h"
 #include "drivers/font.h"
 #include "drivers/pci.h"
@@ -17,12 +17,16 @@
 #include "fs/vfs.h"
 #include "kernel/limine-requests.h"
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
 #include "lib/cstd.h"
 #include "lib/limine.h"
 #include "lib/list.h"
+#include "mm/kmalloc.h"
 #include "mm/kmem.h"
+#include "mm/pagecache.h"
 #include "mm/slab.h"
 #include "mm/userspace.h"
+#include "mm/vmalloc.h"
 
 struct task_struct dummy_task_struct;
 
@@ -30,9 +34,10 @@ void kt_hw_init_main() {
     for (int i = 0; i < num_nvme_devices; i++) {
         nvme_probe_2(&nvme_devices[i]);
     }
-    while (true) {
-        task_yield();
-    }
+    // Nothing left to do. Wait for good, so that the task no longer takes CPU time
+    current_task_ts->task_state = TS_WAITING;
+    task_yield();
+    halt_forever();
 }
 
 void kmain(void) {
@@ -41,11 +46,18 @@ void kmain(void) {
         halt_forever();
     }
 
+    cpu_init(&cpus[0]);
+    kernel_lock(); // Held until the first task leaves the kernel
+
     terminal_init_1();
     idt_init();
     kmem_init();
+    vmalloc_init();
+    kmalloc_init();
     scheduler_init_1();
+    pcid_init();
     vfs_init();
+    page_cache_init();
     ramfs_init();
     sysfs_init();
     exfat_init();
@@ -63,11 +75,6 @@ void kmain(void) {
 
     extract_tar_files(module_request.response->modules[0]->address);
 
-    add_usermode_gdt_entries();
-    add_tss_gdt_entry(&tss);
-    memset(&tss, 0, sizeof(tss64_t));
-    tss.iomap = 0xdfff; // For now, point beyond the TSS limit (no iomap)
-
     struct task_struct *init_process = task_struct_alloc();
     init_process->pid = pid_counter++;
     init_process->task_state = TS_RUNNING;
@@ -76,9 +83,24 @@ void kmain(void) {
     init_process->kernel_stack_pages = NULL;
     init_process->pml4_page = NULL;
     init_process->kernel_entry_rsp = 0;
-    init_list(&init_process->memory_ranges_lh);
-    list_add_tail(&init_process->task_struct_le, &task_struct_lh);
+    init_process->memory_ranges_tree.node = NULL;
+    init_process->heap_range = NULL;
+    task_list_add(init_process);
     init_list(&init_process->files_lh);
+    init_process->minor_faults = 0;
+    init_process->major_faults = 0;
+    init_process->spawn_request = NULL;
+    init_process->running_on = NULL;
+    init_process->pinned = false;
+    init_process->kernel_lock_depth = 1;
+    init_process->wait_queue = NULL;
+    init_process->kill_disable_depth = 0;
+    init_process->kill_pending = false;
+    task_set_nice(init_process, 0);
+    init_process->queued = false;
+    init_process->vruntime = 0;
+    init_process->sum_exec_runtime = 0;
+    run_queue_add(&cpus[0], init_process);
 
     setup_kernelspace_memory(init_process);
     load_cr3_from(init_process);
@@ -93,8 +115,13 @@ void kmain(void) {
         .inode = init_lookup_result.inode,
         .offset = 0,
     };
+    struct elf_image *init_elf_image = elf_image_get(&init_file);
+    if (init_elf_image == NULL) {
+        panic(u8p("init binary has too many program headers"));
+    }
     struct loader_result init_load_result;
-    load_elf64(&init_file, &init_load_result);
+    load_elf64(&init_file, init_elf_image, &init_load_result);
+    elf_image_put(init_elf_image);
     uint64_t *init_first_entry_rsp = (uint64_t*)(init_process->kernel_entry_rsp);
     // userspace stack
     *((void**)(init_load_result.user_entry_rsp - 16)) = (void*)(init_load_result.user_entry_rsp - 8);
@@ -133,9 +160,24 @@ void kmain(void) {
     kt_hw_init->kernel_stack_pages = NULL;
     kt_hw_init->pml4_page = NULL;
     kt_hw_init->kernel_entry_rsp = 0;
-    init_list(&kt_hw_init->memory_ranges_lh);
-    list_add_tail(&kt_hw_init->task_struct_le, &task_struct_lh);
+    kt_hw_init->memory_ranges_tree.node = NULL;
+    kt_hw_init->heap_range = NULL;
+    task_list_add(kt_hw_init);
     init_list(&kt_hw_init->files_lh);
+    kt_hw_init->minor_faults = 0;
+    kt_hw_init->major_faults = 0;
+    kt_hw_init->spawn_request = NULL;
+    kt_hw_init->running_on = NULL;
+    kt_hw_init->pinned = true; // Probes devices whose interrupts only reach the bootstrap processor
+    kt_hw_init->kernel_lock_depth = 1;
+    kt_hw_init->wait_queue = NULL;
+    kt_hw_init->kill_disable_depth = 0;
+    kt_hw_init->kill_pending = false;
+    task_set_nice(kt_hw_init, 0);
+    kt_hw_init->queued = false;
+    kt_hw_init->vruntime = 0;
+    kt_hw_init->sum_exec_runtime = 0;
+    run_queue_add(&cpus[0], kt_hw_init);
     setup_kernelspace_memory(kt_hw_init);
     
     uint64_t *kt_hw_init_first_entry_rsp = (uint64_t*)(kt_hw_init->kernel_entry_rsp);
@@ -151,11 +193,12 @@ void kmain(void) {
     *--kt_hw_init_first_entry_rsp = 0;
     *--kt_hw_init_first_entry_rsp = 0;
     kt_hw_init->kernel_rsp = (uint64_t)kt_hw_init_first_entry_rsp;
-    
-    
-    current_task_ts = &dummy_task_struct;
+
+    cpus[0].idle_task = idle_task_create();
+    smp_init();
+
     set_segment_registers_for_userspace();
 
-    switch_to_task(init_process); // Never returns
+    scheduler_start(&dummy_task_struct, init_process); // Never returns
     halt_forever();
 }
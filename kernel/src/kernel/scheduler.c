@@ -1,66 +1,454 @@
 #include <stddef.h>
+#include <stdbool.h>
 #include "arch/asm.h"
+#include "arch/idt.h"
+#include "arch/lapic.h"
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/waitqueue.h"
 #include "mm/kmem.h"
 #include "mm/page.h"
 #include "mm/slab.h"
 #include "mm/userspace.h"
 
-struct task_struct *current_task_ts = NULL;
 struct list_head task_struct_lh; // List of task_struct sorted by pid
-tss64_t tss;
+struct rwlock task_list_lock; // Protects task_struct_lh
+struct wait_queue task_exit_wait_queue; // Woken when a task becomes a zombie, and when a zombie is switched out
 
 uint32_t pid_counter = 1;
+uint32_t sched_time_slice_ticks = SCHED_DEFAULT_TIME_SLICE_TICKS;
+uint64_t sched_tsc_cycles_per_tick = 0; // Measured by scheduler_tick. 0 until the second tick
+static uint64_t sched_last_tick_tsc = 0;
+
+// Weight of each nice value, from SCHED_NICE_MIN. Each step changes the share of the CPU by about 10%
+static const uint32_t sched_nice_to_weight[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+struct sched_stats sched_stats;
+bool pcid_enabled = false;
+bool invpcid_supported = false;
+uint64_t kernel_tlb_generation = 0; // Bumped when a kernel mapping is removed
 
 struct slab_allocator task_struct_allocator = SLAB_OF(struct task_struct);
 
 void scheduler_init_1() {
     init_list(&task_struct_lh);
+    rwlock_init(&task_list_lock, u8p("task_list"));
+    wait_queue_init(&task_exit_wait_queue, u8p("task_exit"));
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].id = i;
+        cpus[i].run_queue_tree.node = NULL;
+        cpus[i].pcid_generation = 1; // Tasks start with pcid_generation 0, so they get a PCID on first switch
+        cpus[i].pcid_next = 1; // PCID 0 belongs to the boot page tables
+    }
+    task_struct_allocator.magazine_size = 16; // Allocated and freed by every fork and exit
     slab_allocator_init(&task_struct_allocator);
 }
 
 void set_tss_for(struct task_struct *process) {
-    tss.rsp0_low = process->kernel_entry_rsp;
-    tss.rsp0_high = process->kernel_entry_rsp >> 32;
+    tss64_t *tss = &this_cpu()->tss;
+    tss->rsp0_low = process->kernel_entry_rsp;
+    tss->rsp0_high = process->kernel_entry_rsp >> 32;
 }
 
-// Get the next task_struct after ts. Wraps around
-struct task_struct *next_task_struct(struct task_struct* ts) {
-	struct list_head *task_struct_le;
-	task_struct_le = ts->task_struct_le.next;
-	if (task_struct_le == &task_struct_lh) {
-		// Wrap around
-		task_struct_le = task_struct_le->next;
-	}
-    struct task_struct *result = container_of(task_struct_le, struct task_struct, task_struct_le);
-    return result;
+// Run queues are only changed under the kernel lock, but wake_up may also run in an interrupt
+// handler that nested in kernel code on the same CPU. Interrupts are disabled around each update
+
+static void run_queue_enqueue(struct cpu *cpu, struct task_struct *task) {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    struct rb_node **link = &cpu->run_queue_tree.node;
+    struct rb_node *parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        struct task_struct *candidate = rb_entry(parent, struct task_struct, run_queue_node);
+        // Equal keys go right, so tasks with the same vruntime run in the order they were queued
+        link = (int64_t)(task->vruntime - candidate->vruntime) < 0 ? &parent->left : &parent->right;
+    }
+    rb_link_node(&task->run_queue_node, parent, link);
+    rb_insert_color(&task->run_queue_node, &cpu->run_queue_tree);
+    task->queued = true;
+    cpu->nr_queued++;
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+static void run_queue_dequeue(struct task_struct *task) {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    rb_erase(&task->run_queue_node, &task->cpu->run_queue_tree);
+    task->queued = false;
+    task->cpu->nr_queued--;
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+// Make cpu the owner of a task that is on no run queue, and queue it if it is runnable
+// Its vruntime is relative to min_vruntime until then
+void run_queue_add(struct cpu *cpu, struct task_struct *task) {
+    task->cpu = cpu;
+    task->vruntime += cpu->min_vruntime;
+    if (task->task_state == TS_RUNNING) {
+        run_queue_enqueue(cpu, task);
+    }
+}
+
+static void run_queue_remove(struct task_struct *task) {
+    if (task->queued) {
+        run_queue_dequeue(task);
+    }
+    task->vruntime -= task->cpu->min_vruntime;
+    task->cpu = NULL;
+}
+
+// Advance min_vruntime to the lowest vruntime of the runnable tasks of cpu, if that is higher
+static void update_min_vruntime(struct cpu *cpu) {
+    struct task_struct *current = cpu->current_task;
+    bool found = false;
+    uint64_t vruntime = 0;
+    if (current != cpu->idle_task && current->cpu == cpu && current->task_state == TS_RUNNING) {
+        vruntime = current->vruntime;
+        found = true;
+    }
+    struct rb_node *leftmost = rb_first(&cpu->run_queue_tree);
+    if (leftmost != NULL) {
+        struct task_struct *first = rb_entry(leftmost, struct task_struct, run_queue_node);
+        if (!found || (int64_t)(first->vruntime - vruntime) < 0) {
+            vruntime = first->vruntime;
+            found = true;
+        }
+    }
+    if (found && (int64_t)(vruntime - cpu->min_vruntime) > 0) {
+        cpu->min_vruntime = vruntime;
+    }
+}
+
+// Charge the current task of the executing CPU for the time since it was last charged
+static void update_current_runtime(struct cpu *cpu) {
+    uint64_t now = read_tsc();
+    uint64_t cycles = now - cpu->exec_start_tsc;
+    cpu->exec_start_tsc = now;
+    struct task_struct *current = cpu->current_task;
+    current->sum_exec_runtime += cycles;
+    if (current == cpu->idle_task || current->cpu != cpu) {
+        // Idle and boot tasks take no part in fairness
+        return;
+    }
+    current->vruntime += cycles * SCHED_NICE_0_WEIGHT / current->weight;
+    update_min_vruntime(cpu);
+}
+
+// The task cpu runs next: the runnable task with the lowest vruntime, or the idle task if there is none
+// The idle task also gets every other turn while the zero pool is low
+static struct task_struct *pick_next_task(struct cpu *cpu) {
+    if (cpu->current_task != cpu->idle_task && kmem_zero_pool_count < KMEM_ZERO_POOL_LOW_WATERMARK) {
+        return cpu->idle_task;
+    }
+    struct rb_node *leftmost;
+    while ((leftmost = rb_first(&cpu->run_queue_tree)) != NULL) {
+        struct task_struct *task = rb_entry(leftmost, struct task_struct, run_queue_node);
+        run_queue_dequeue(task);
+        if (task->task_state == TS_RUNNING) {
+            return task;
+        }
+        // Killed while queued. Left for waitpid to free
+    }
+    return cpu->idle_task;
+}
+
+// Number of runnable tasks in the run queue of cpu, including the one it is running
+static uint32_t run_queue_load(struct cpu *cpu) {
+    struct task_struct *current = cpu->current_task;
+    bool current_runnable = current != cpu->idle_task && current->cpu == cpu && current->task_state == TS_RUNNING;
+    return cpu->nr_queued + current_runnable;
 }
 
+// Put a new task on the run queue of the least loaded CPU
+void scheduler_add_task(struct task_struct *task) {
+    struct cpu *target = this_cpu();
+    uint32_t target_load = run_queue_load(target);
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        uint32_t load = run_queue_load(&cpus[i]);
+        if (load < target_load) {
+            target = &cpus[i];
+            target_load = load;
+        }
+    }
+    run_queue_add(target, task);
+    if (target != this_cpu()) {
+        lapic_send_ipi(target->lapic_id, LAPIC_RESCHEDULE_VECTOR);
+    }
+}
+
+// Move a task that is waiting for its turn on the busiest other CPU to cpu
+// Returns true if one was moved
+static bool scheduler_pull_task(struct cpu *cpu) {
+    struct task_struct *pulled_task = NULL;
+    uint32_t busiest_load = 1; // A CPU with a single runnable task is not waiting on anything
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        struct cpu *candidate_cpu = &cpus[i];
+        if (candidate_cpu == cpu || !candidate_cpu->online) {
+            continue;
+        }
+        uint32_t load = run_queue_load(candidate_cpu);
+        if (load <= busiest_load) {
+            continue;
+        }
+        // Queued tasks are not running. Take the one that has waited longest for the CPU
+        struct rb_node *node = rb_first(&candidate_cpu->run_queue_tree);
+        for (; node != NULL; node = rb_next(node)) {
+            struct task_struct *task = rb_entry(node, struct task_struct, run_queue_node);
+            if (task->task_state == TS_RUNNING && !task->pinned) {
+                pulled_task = task;
+                busiest_load = load;
+                break;
+            }
+        }
+    }
+    if (pulled_task == NULL) {
+        return false;
+    }
+    run_queue_remove(pulled_task); // Keeps its lag behind min_vruntime on the new CPU
+    run_queue_add(cpu, pulled_task);
+    cpu->migrations++;
+    return true;
+}
+
+// Hand waiting tasks to idle CPUs. Called on timer ticks that did not interrupt kernel code
+void scheduler_balance() {
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (cpu == this_cpu() || !cpu->online || cpu->current_task != cpu->idle_task) {
+            continue;
+        }
+        if (run_queue_load(cpu) == 0 && scheduler_pull_task(cpu)) {
+            lapic_send_ipi(cpu->lapic_id, LAPIC_RESCHEDULE_VECTOR);
+        }
+    }
+}
+
+// Queue a task that wake_up made runnable again. A task that is still running, because it has not
+// yielded since prepare_to_wait, is queued by task_yield instead
+void scheduler_wake_task(struct task_struct *task) {
+    struct cpu *cpu = task->cpu;
+    if (cpu == NULL || task->queued || task->running_on != NULL) {
+        return;
+    }
+    // A task that slept keeps up to one time slice of credit over those that kept running,
+    // so that interactive tasks get the CPU ahead of CPU bound ones
+    uint64_t credit = sched_time_slice_ticks * sched_tsc_cycles_per_tick;
+    uint64_t min_vruntime = cpu->min_vruntime - credit;
+    if ((int64_t)(task->vruntime - min_vruntime) < 0) {
+        task->vruntime = min_vruntime;
+    }
+    run_queue_enqueue(cpu, task);
+    struct task_struct *current = cpu->current_task;
+    if (current == cpu->idle_task || (int64_t)(task->vruntime - current->vruntime) < 0) {
+        // Compared with the vruntime of current as of its last switch
+        cpu->need_resched = true;
+        if (cpu != this_cpu()) {
+            // Its CPU may be halted in the idle task
+            lapic_send_ipi(cpu->lapic_id, LAPIC_RESCHEDULE_VECTOR);
+        }
+    }
+}
+
+void task_set_nice(struct task_struct *task, int8_t nice) {
+    task->nice = nice;
+    task->weight = sched_nice_to_weight[nice - SCHED_NICE_MIN];
+}
+
+// Convert TSC cycles to milliseconds, using the TSC rate measured on timer ticks
+uint64_t sched_cycles_to_millis(uint64_t cycles) {
+    if (sched_tsc_cycles_per_tick == 0) {
+        return 0;
+    }
+    return cycles / (sched_tsc_cycles_per_tick * TIMER_TICKS_PER_SECOND / 1000);
+}
+
+// Ask CPUs whose current task used up its time slice to switch. Called on every timer tick
+// Only reads per-CPU fields, so it is safe even if the tick interrupted kernel code
+void scheduler_tick() {
+    uint64_t now = read_tsc();
+    if (sched_last_tick_tsc != 0) {
+        // Average over recent ticks, since a tick delayed while interrupts were disabled arrives late
+        uint64_t cycles = now - sched_last_tick_tsc;
+        if (sched_tsc_cycles_per_tick == 0) {
+            sched_tsc_cycles_per_tick = cycles;
+        } else {
+            sched_tsc_cycles_per_tick = (sched_tsc_cycles_per_tick * 7 + cycles) / 8;
+        }
+    }
+    sched_last_tick_tsc = now;
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (!cpu->online || cpu->current_task == cpu->idle_task || cpu->need_resched) {
+            continue;
+        }
+        if (timer_ticks - cpu->slice_start_ticks < sched_time_slice_ticks) {
+            continue;
+        }
+        cpu->need_resched = true;
+        if (cpu != this_cpu()) {
+            // Makes it return to user mode through hw_interrupt_handler, which switches
+            lapic_send_ipi(cpu->lapic_id, LAPIC_RESCHEDULE_VECTOR);
+        }
+    }
+}
+
+// Called by switch_to_task on the stack of new_task
+void finish_task_switch(struct task_struct *new_task, struct task_struct *old_task) {
+    struct cpu *cpu = this_cpu();
+    cpu->current_task = new_task;
+    cpu->context_switches++;
+    cpu->slice_start_ticks = timer_ticks;
+    cpu->exec_start_tsc = read_tsc();
+    old_task->running_on = NULL;
+    new_task->running_on = cpu;
+    if (old_task->task_state == TS_ZOMBIE) {
+        // waitpid frees the task once it is switched out
+        wake_up(&task_exit_wait_queue);
+    }
+    switch_address_space(new_task);
+    set_tss_for(new_task);
+}
+
+static void switch_from_current_to(struct task_struct *t) {
+    struct cpu *cpu = this_cpu();
+    struct task_struct *old_task = cpu->current_task;
+    // The kernel lock stays with this CPU, at the nesting depth new_task had when it was switched out
+    old_task->kernel_lock_depth = cpu->kernel_lock_depth;
+    cpu->kernel_lock_depth = t->kernel_lock_depth;
+    asm volatile ("cli"); // current_task must not be seen half switched
+    switch_to_task(t, old_task);
+}
+
+// Switch from boot code to the first task of the executing CPU. Never returns
+void scheduler_start(struct task_struct *boot_task, struct task_struct *first_task) {
+    this_cpu()->current_task = boot_task;
+    if (first_task->queued) {
+        run_queue_dequeue(first_task);
+    }
+    switch_from_current_to(first_task);
+}
+
+// Returns with interrupts enabled, even if the caller had them disabled, so that the events
+// a polling caller waits for can arrive
 void task_yield() {
+	asm volatile ("cli");
+	kernel_lock_relax();
 	// Find next runnable task
-	struct task_struct *t = current_task_ts;
-	do {
-		t = next_task_struct(t);
+	struct cpu *cpu = this_cpu();
+	bool preempted = cpu->need_resched;
+	cpu->need_resched = false;
+	struct task_struct *current = cpu->current_task;
+	update_current_runtime(cpu);
+	if (current != cpu->idle_task && current->cpu == cpu && current->task_state == TS_RUNNING) {
+		// Back in line behind tasks that have run less
+		run_queue_enqueue(cpu, current);
+	}
+	struct task_struct *t = pick_next_task(cpu);
+	if (t == current) {
+		// Nothing else to run, or the others have all run more. Start a new slice rather than being
+		// asked again on every tick
+		cpu->slice_start_ticks = timer_ticks;
+	} else {
+		if (preempted) {
+			cpu->preemptions++;
+		}
+		switch_from_current_to(t);
+	}
+	asm volatile ("sti");
+}
+
+// Preemption point for long running kernel code. Kernel code is only preempted where it calls this
+void task_preempt_point() {
+	if (this_cpu()->need_resched) {
+		task_yield();
+	}
+}
 
-		if (t == current_task_ts) {
-			// There are no running tasks. Idle the CPU until the next interrupt.
-			halt_until_any_interrupt();
+void idle_task_main() {
+	while (true) {
+		kmem_zero_pool_refill();
+		struct cpu *cpu = this_cpu();
+		if (run_queue_load(cpu) == 0 && !scheduler_pull_task(cpu)) {
+			// Nothing else to do. Idle the CPU until the next interrupt.
+			kernel_unlocked_halt();
 		}
-	} while (t->task_state != TS_RUNNING);
-	switch_to_task(t);
+		task_yield();
+	}
+}
+
+// Create the idle task of a CPU. Runs in kernel mode only
+struct task_struct *idle_task_create() {
+    struct task_struct *kt_idle = task_struct_alloc();
+    kt_idle->pid = pid_counter++;
+    kt_idle->task_state = TS_RUNNING;
+    kt_idle->exit_code = 0;
+    strcpy(kt_idle->name, u8p("kt-idle"));
+    kt_idle->kernel_stack_pages = NULL;
+    kt_idle->pml4_page = NULL;
+    kt_idle->kernel_entry_rsp = 0;
+    kt_idle->memory_ranges_tree.node = NULL;
+    kt_idle->heap_range = NULL;
+    task_list_add(kt_idle);
+    init_list(&kt_idle->files_lh);
+    kt_idle->minor_faults = 0;
+    kt_idle->major_faults = 0;
+    kt_idle->spawn_request = NULL;
+    kt_idle->cpu = NULL;
+    kt_idle->running_on = NULL;
+    kt_idle->pinned = true;
+    kt_idle->kernel_lock_depth = 1;
+    kt_idle->wait_queue = NULL;
+    kt_idle->kill_disable_depth = 0;
+    kt_idle->kill_pending = false;
+    task_set_nice(kt_idle, 0);
+    kt_idle->queued = false;
+    kt_idle->vruntime = 0;
+    kt_idle->sum_exec_runtime = 0;
+    setup_kernelspace_memory(kt_idle);
+
+    uint64_t *kt_idle_first_entry_rsp = (uint64_t*)(kt_idle->kernel_entry_rsp);
+
+    // return address for switch_to_task
+    *--kt_idle_first_entry_rsp = (uint64_t)idle_task_main;
+
+    // stack for switch_to_task
+    *--kt_idle_first_entry_rsp = 0;
+    *--kt_idle_first_entry_rsp = 0;
+    *--kt_idle_first_entry_rsp = 0;
+    *--kt_idle_first_entry_rsp = 0;
+    *--kt_idle_first_entry_rsp = 0;
+    *--kt_idle_first_entry_rsp = 0;
+    kt_idle->kernel_rsp = (uint64_t)kt_idle_first_entry_rsp;
+    return kt_idle;
 }
 
 // Setup kernelspace memory and PML4. Switch to the new PML4.
-// Must be called before setup_userspace_memory
+// Must be called before load_elf64
 void setup_kernelspace_memory(struct task_struct *task) {
     void* kernel_stack_pages = kpage_alloc(KERNEL_STACK_PAGES);
     task->kernel_stack_pages = kernel_stack_pages;
     task->kernel_entry_rsp = (uint64_t)kernel_stack_pages + PAGE_SIZE * KERNEL_STACK_PAGES;
 
-    uint64_t cr3 = read_cr3();
+    uint64_t cr3 = read_cr3() & PAGE_ADDRESS_MASK;
     uint64_t *old_pml4_entries = (void*)(cr3 + hhdm_offset);
-    uint64_t *new_pml4_entries = kpage_alloc(1);
-    memset(new_pml4_entries, 0, PAGE_SIZE);
+    uint64_t *new_pml4_entries = kpage_alloc_zeroed();
 
     // Copy pml4 entries for upper half
     for (uint16_t i = 256; i < 512; i++) {
@@ -68,6 +456,9 @@ void setup_kernelspace_memory(struct task_struct *task) {
     }
 
     task->pml4_page = new_pml4_entries;
+    task->pcid = 0;
+    task->pcid_cpu = 0;
+    task->pcid_generation = 0;
 }
 
 void free_kernelspace_memory(struct task_struct *task) {
@@ -76,31 +467,155 @@ void free_kernelspace_memory(struct task_struct *task) {
 }
 
 // Perform final cleanup for a task after kernelspace memory and userspace memory has been freed
+// The reaper has already taken it off the task list with task_list_remove
 void free_task(struct task_struct *task) {
-	// Free structs tracking memory ranges
-	for (
-		struct list_head *memory_ranges_le = task->memory_ranges_lh.next;
-		memory_ranges_le != &task->memory_ranges_lh;
-	) {
-		struct list_head *next_memory_ranges_le = memory_ranges_le->next;
-		struct userspace_memory_range *range = container_of(
-			memory_ranges_le,
-			struct userspace_memory_range,
-			memory_ranges_le
-		);
-		userspace_memory_range_free(range);
-		memory_ranges_le = next_memory_ranges_le;
+	if (task->cpu != NULL) {
+		run_queue_remove(task);
 	}
-	list_del(&task->task_struct_le);
+	wait_queue_cancel(task); // Killed while waiting
+	// Free structs tracking memory ranges
+	free_userspace_memory_ranges(task);
 	task_struct_free(task);
 }
 
+// Tag address spaces with PCIDs if the CPU supports it, so task switches keep TLB entries
+void pcid_init() {
+    struct cpuid_result result;
+    cpuid(1, 0, &result);
+    if (!(result.ecx & CPUID_1_ECX_PCID)) {
+        return;
+    }
+    if (read_cr3() & CR3_PCID_MASK) {
+        // CR4.PCIDE can only be set while the PCID in CR3 is 0
+        return;
+    }
+    cpuid(0, 0, &result);
+    if (result.eax >= 7) {
+        cpuid(7, 0, &result);
+        invpcid_supported = result.ebx & CPUID_7_EBX_INVPCID;
+    }
+    pcid_enabled = true;
+    pcid_init_cpu();
+}
+
+// Enable PCIDs on the executing CPU if pcid_init found them supported
+void pcid_init_cpu() {
+    if (pcid_enabled) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+    }
+}
+
+// Give process a PCID of the executing CPU in its current generation if it has none
+// Returns true if the PCID is new. It may have been used by an earlier generation, so must be flushed
+static bool pcid_assign(struct task_struct *process) {
+    struct cpu *cpu = this_cpu();
+    if (process->pcid_cpu == cpu->id && process->pcid_generation == cpu->pcid_generation) {
+        return false;
+    }
+    if (cpu->pcid_next == PCID_COUNT) {
+        cpu->pcid_generation++;
+        cpu->pcid_next = 1;
+        sched_stats.pcid_generations++;
+    }
+    process->pcid = cpu->pcid_next++;
+    process->pcid_cpu = cpu->id;
+    process->pcid_generation = cpu->pcid_generation;
+    return true;
+}
+
+// Switch to the PML4 of process, flushing its TLB entries
+// Called after changing the mappings of the current process
 void load_cr3_from(struct task_struct *process) {
-    // Switch to new PML4
-    asm volatile ("mov %0, %%cr3" :: "a" (process->pml4_page - hhdm_offset));
+    uint64_t cr3 = (uint64_t)process->pml4_page - hhdm_offset;
+    if (pcid_enabled) {
+        pcid_assign(process);
+        cr3 |= process->pcid;
+    }
+    write_cr3(cr3);
+    sched_stats.tlb_flushes++;
+}
+
+// Switch to the PML4 of process on task switch. With PCIDs, entries of process cached since it last ran are kept
+void switch_address_space(struct task_struct *process) {
+    uint64_t start_tsc = read_tsc();
+    uint64_t cr3 = (uint64_t)process->pml4_page - hhdm_offset;
+    if (!pcid_enabled) {
+        write_cr3(cr3);
+        sched_stats.address_space_switch_flushes++;
+    } else if (pcid_assign(process)) {
+        write_cr3(cr3 | process->pcid);
+        sched_stats.address_space_switch_flushes++;
+    } else {
+        write_cr3(cr3 | process->pcid | CR3_NO_FLUSH);
+    }
+    sched_stats.address_space_switches++;
+    sched_stats.address_space_switch_cycles += read_tsc() - start_tsc;
+}
+
+// Drop stale kernel translations from every address space after a kernel mapping was removed
+// The caller has already invalidated them in the current address space. Other CPUs catch up
+// when they next take the kernel lock, since they cannot touch kernel mappings without it
+void flush_tlb_all_address_spaces() {
+    kernel_tlb_generation++;
+    tlb_sync_kernel_mappings();
+}
+
+// Flush every address space on the executing CPU if a kernel mapping was removed since it last did
+void tlb_sync_kernel_mappings() {
+    struct cpu *cpu = this_cpu();
+    if (cpu->kernel_tlb_generation == kernel_tlb_generation) {
+        return;
+    }
+    cpu->kernel_tlb_generation = kernel_tlb_generation;
+    sched_stats.tlb_shootdowns++;
+    if (pcid_enabled && invpcid_supported) {
+        invpcid(INVPCID_ALL_CONTEXTS, 0, NULL);
+        return;
+    }
+    if (pcid_enabled) {
+        // Start a new generation, so that each PCID is flushed when it is next used
+        cpu->pcid_generation++;
+        cpu->pcid_next = 1;
+        sched_stats.pcid_generations++;
+    }
+    write_cr3(read_cr3()); // Flushes the current PCID
+}
+
+// Append a new task to task_struct_lh. Pids are handed out in increasing order, so it stays sorted
+void task_list_add(struct task_struct *task) {
+    write_lock(&task_list_lock);
+    list_add_tail(&task->task_struct_le, &task_struct_lh);
+    write_unlock(&task_list_lock);
+}
+
+// Unlink a task, so that task_struct_find no longer returns it. A reaper calls this before tearing
+// a zombie down, since teardown has preemption points where another waitpid or kill could run
+void task_list_remove(struct task_struct *task) {
+    write_lock(&task_list_lock);
+    list_del(&task->task_struct_le);
+    write_unlock(&task_list_lock);
+}
+
+// Make kill of the current task wait until the matching task_enable_kill. Brackets work that has
+// preemption points but must not be abandoned halfway, such as building a child in fork
+void task_disable_kill() {
+    current_task_ts->kill_disable_depth++;
+}
+
+void task_enable_kill() {
+    struct task_struct *task = current_task_ts;
+    task->kill_disable_depth--;
+    if (task->kill_disable_depth == 0 && task->kill_pending) {
+        // Switched out for good before returning to user mode
+        task->task_state = TS_ZOMBIE;
+        task->exit_code = -1;
+        wake_up(&task_exit_wait_queue);
+    }
 }
 
 struct task_struct *task_struct_find(uint32_t pid) {
+    struct task_struct *found_task_struct = NULL;
+    read_lock(&task_list_lock);
     list_for_each(task_struct_le, task_struct_lh) {
         struct task_struct *candidate_task_struct = container_of(
 			task_struct_le,
@@ -108,8 +623,10 @@ struct task_struct *task_struct_find(uint32_t pid) {
 			task_struct_le
 		);
         if (candidate_task_struct->pid == pid) {
-            return candidate_task_struct;
+            found_task_struct = candidate_task_struct;
+            break;
         }
     }
-    return NULL;
+    read_unlock(&task_list_lock);
+    return found_task_struct;
 }
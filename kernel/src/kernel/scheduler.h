@@ -5,22 +5,17 @@
 #define TS_WAITING 0x92
 #define TS_ZOMBIE 0x93
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "arch/cpu.h"
 #include "lib/cstd.h"
 #include "lib/list.h"
+#include "lib/rbtree.h"
+#include "lib/spinlock.h"
 #include "mm/slab.h"
 
-typedef struct {
-    uint32_t reserved0;
-    uint32_t rsp0_low;
-    uint32_t rsp0_high;
-    uint32_t reserved1[22];
-    uint16_t reserved2;
-    uint16_t iomap;
-} __attribute__((packed)) tss64_t;
-
-extern tss64_t tss;
 extern uint32_t pid_counter;
+struct wait_queue;
 
 #define TASK_NAME_MAXLEN 256
 
@@ -33,32 +28,103 @@ struct task_struct {
     void *kernel_stack_pages;
     void *pml4_page;
     uint8_t name[TASK_NAME_MAXLEN];
-    struct list_head memory_ranges_lh;
+    struct rb_root memory_ranges_tree; // struct userspace_memory_range, ordered by start
+    struct userspace_memory_range *heap_range; // The range grown by brk
     struct list_head task_struct_le;
-    // struct list_head termination_wait_queue_head;
     struct list_head files_lh; // List of struct file for this task
+    uint64_t minor_faults; // Page faults resolved without I/O (demand zero, copy-on-write)
+    uint64_t major_faults; // Page faults that had to read from a backing file
+    struct spawn_request *spawn_request; // Program to load when a spawned task first runs. NULL otherwise
+    uint16_t pcid; // Tags the TLB entries of this address space on pcid_cpu
+    uint32_t pcid_cpu;
+    uint64_t pcid_generation; // Valid while it equals the pcid_generation of pcid_cpu
+    struct cpu *cpu; // Owner of the run queue this task is on. NULL for idle tasks and reaped tasks
+    struct rb_node run_queue_node; // In cpu->run_queue_tree while queued
+    bool queued;
+    int8_t nice; // SCHED_NICE_MIN to SCHED_NICE_MAX. Lower values get more CPU time
+    uint32_t weight; // Share of the CPU, from nice
+    uint64_t vruntime; // TSC cycles run, scaled by SCHED_NICE_0_WEIGHT / weight. Relative to min_vruntime while on no run queue
+    uint64_t sum_exec_runtime; // TSC cycles run
+    struct cpu *running_on; // CPU executing this task, in user or kernel mode. NULL if switched out
+    bool pinned; // Never moved to another CPU by load balancing
+    uint32_t kernel_lock_depth; // Saved kernel_lock nesting while switched out. 1 for new tasks
+    struct wait_queue *wait_queue; // Queue this task is on. NULL if not waiting
+    struct list_head wait_queue_le;
+    uint32_t kill_disable_depth; // Nesting of task_disable_kill. kill only marks the task while it is nonzero
+    bool kill_pending; // Killed while kill was disabled. Becomes a zombie in task_enable_kill
 };
 
 ct_assert(offsetof(struct task_struct, kernel_rsp) == 8); // Update scheduler.s if this changes
 
-extern struct task_struct *current_task_ts;
+// Each CPU hands out its PCIDs in order and never frees them. When they run out, a new generation
+// starts and every task gets a new PCID, flushed on first use. Tasks moved to another CPU get a new one
+#define PCID_COUNT 4096
+
+struct sched_stats {
+    uint64_t address_space_switches;
+    uint64_t address_space_switch_cycles; // Total TSC cycles spent loading CR3 on task switch
+    uint64_t address_space_switch_flushes; // Switches that flushed the TLB. All of them without PCID
+    uint64_t tlb_flushes; // Flushes of the current address space after its mappings changed
+    uint64_t tlb_shootdowns; // Flushes of every address space on a CPU after a kernel mapping was removed
+    uint64_t pcid_generations;
+};
+
+extern struct sched_stats sched_stats;
+extern bool pcid_enabled;
+extern bool invpcid_supported;
+extern uint64_t kernel_tlb_generation;
+#define current_task_ts (this_cpu()->current_task)
 extern struct list_head task_struct_lh;
+extern struct rwlock task_list_lock;
+extern struct wait_queue task_exit_wait_queue;
 extern struct slab_allocator task_struct_allocator;
 #define task_struct_alloc() slab_alloc(&task_struct_allocator)
 #define task_struct_free(x) slab_free(&task_struct_allocator, x)
 
 #define KERNEL_STACK_PAGES 2
 
+// Runnable tasks share a CPU in proportion to their weights. The task with the lowest vruntime runs next
+#define SCHED_NICE_MIN (-20)
+#define SCHED_NICE_MAX 19
+#define SCHED_NICE_0_WEIGHT 1024
+
+// Timer ticks a task may run before it is preempted, if another task is runnable on its CPU
+#define SCHED_DEFAULT_TIME_SLICE_TICKS 5
+extern uint32_t sched_time_slice_ticks;
+extern uint64_t sched_tsc_cycles_per_tick;
+
 void scheduler_init_1();
 void set_segment_registers_for_userspace();
+void run_queue_add(struct cpu *cpu, struct task_struct *task);
+void scheduler_add_task(struct task_struct *task);
+void scheduler_wake_task(struct task_struct *task);
+void task_set_nice(struct task_struct *task, int8_t nice);
+uint64_t sched_cycles_to_millis(uint64_t cycles);
+void scheduler_balance();
+void scheduler_tick();
+void scheduler_start(struct task_struct *boot_task, struct task_struct *first_task);
 void task_yield();
+void task_preempt_point();
+void idle_task_main();
+struct task_struct *idle_task_create();
 void setup_kernelspace_memory(struct task_struct *process);
 void free_kernelspace_memory(struct task_struct *task);
 void free_task(struct task_struct *task);
+void pcid_init();
+void pcid_init_cpu();
 void load_cr3_from(struct task_struct *process);
+void switch_address_space(struct task_struct *process);
+void flush_tlb_all_address_spaces();
+void tlb_sync_kernel_mappings();
+void task_list_add(struct task_struct *task);
+void task_list_remove(struct task_struct *task);
+void task_disable_kill();
+void task_enable_kill();
 struct task_struct *task_struct_find(uint32_t pid);
 
 // In assembly
-void switch_to_task(struct task_struct *new_task);
+void switch_to_task(struct task_struct *new_task, struct task_struct *old_task);
+// Called from switch_to_task
+void finish_task_switch(struct task_struct *new_task, struct task_struct *old_task);
 
 #endif
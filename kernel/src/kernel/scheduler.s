@@ -16,7 +16,7 @@ set_segment_registers_for_userspace:
 
 .set TASK_STRUCT_KERNEL_RSP_OFFSET, 8
 
-// switch_to_task(struct task_struct *new_task)
+// switch_to_task(struct task_struct *new_task, struct task_struct *old_task)
 .global switch_to_task
 switch_to_task:
 	// Save previous task's state
@@ -28,15 +28,10 @@ switch_to_task:
 	pushq %r14
 	pushq %r15
 
-	mov %rdi, %r12
-	mov current_task_ts, %rbx
-	mov %rsp, TASK_STRUCT_KERNEL_RSP_OFFSET(%rbx)
-	mov %rdi, current_task_ts						// current_task_ts = new_task
+	mov %rsp, TASK_STRUCT_KERNEL_RSP_OFFSET(%rsi)
 	mov TASK_STRUCT_KERNEL_RSP_OFFSET(%rdi), %rsp
 
-	call load_cr3_from
-	mov %r12, %rdi
-	call set_tss_for
+	call finish_task_switch							// finish_task_switch(new_task, old_task)
 
 	popq %r15
 	popq %r14
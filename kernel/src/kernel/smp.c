@@ -0,0 +1,123 @@
+// Multiprocessor support. Application processors (APs) are started through the Limine SMP request
+// All kernel code runs under one lock, so CPUs only run user mode code in parallel
+#include <stdbool.h>
+#include <stdint.h>
+#include "arch/asm.h"
+#include "arch/cpu.h"
+#include "arch/idt.h"
+#include "arch/lapic.h"
+#include "kernel/limine-requests.h"
+#include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "lib/cstd.h"
+#include "lib/spinlock.h"
+
+#define KERNEL_LOCK_NO_OWNER 0xFFFFFFFF
+
+// Ticket lock, so that a CPU that only lets go briefly in kernel_lock_relax cannot starve the others
+// Taken on every entry from user mode and by interrupt handlers, which may nest on the owning CPU
+static struct spinlock kernel_spinlock;
+static volatile uint32_t kernel_lock_owner = KERNEL_LOCK_NO_OWNER;
+
+static struct task_struct ap_boot_tasks[MAX_CPUS]; // current_task of each AP until it switches to its idle task
+
+void kernel_lock() {
+    // Interrupts stay off until the ownership is recorded. A nested interrupt taking a second
+    // ticket on this CPU would wait for the first forever
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    struct cpu *cpu = this_cpu();
+    if (kernel_lock_owner == cpu->id) {
+        cpu->kernel_lock_depth++;
+    } else {
+        spin_lock(&kernel_spinlock);
+        kernel_lock_owner = cpu->id;
+        cpu->kernel_lock_depth = 1;
+        tlb_sync_kernel_mappings();
+    }
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+void kernel_unlock() {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    struct cpu *cpu = this_cpu();
+    cpu->kernel_lock_depth--;
+    if (cpu->kernel_lock_depth == 0) {
+        kernel_lock_owner = KERNEL_LOCK_NO_OWNER;
+        spin_unlock(&kernel_spinlock);
+    }
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+// Let CPUs that are waiting for the kernel lock take a turn. Called by task_yield, since tasks
+// poll for events by yielding, and the events may need another CPU in the kernel
+void kernel_lock_relax() {
+    if (!spin_is_contended(&kernel_spinlock)) {
+        return;
+    }
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    struct cpu *cpu = this_cpu();
+    uint32_t depth = cpu->kernel_lock_depth;
+    cpu->kernel_lock_depth = 1;
+    kernel_unlock();
+    kernel_lock();
+    cpu->kernel_lock_depth = depth;
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+// Halt until an interrupt arrives, letting other CPUs into the kernel meanwhile
+void kernel_unlocked_halt() {
+    asm volatile ("cli"); // An interrupt between unlocking and hlt would not wake the hlt
+    struct cpu *cpu = this_cpu();
+    uint32_t depth = cpu->kernel_lock_depth;
+    cpu->kernel_lock_depth = 1;
+    kernel_unlock();
+    halt_until_any_interrupt();
+    kernel_lock();
+    cpu->kernel_lock_depth = depth;
+}
+
+static void ap_main(struct limine_smp_info *info) {
+    struct cpu *cpu = &cpus[info->extra_argument];
+    cpu_init(cpu);
+    idt_load();
+    lapic_enable();
+    pcid_init_cpu();
+    set_segment_registers_for_userspace();
+    cpu->online = true; // Tasks may be queued from now on. The APIC accepts the IPI that announces them
+    kernel_lock();
+    scheduler_start(&ap_boot_tasks[cpu->id], cpu->idle_task); // Never returns
+}
+
+// Start the APs. Each runs its idle task until load balancing gives it work
+void smp_init() {
+    spin_lock_init(&kernel_spinlock, u8p("kernel"));
+    cpus[0].online = true;
+    struct limine_smp_response *response = smp_request.response;
+    if (response == NULL) {
+        return;
+    }
+    lapic_init(response->flags & LIMINE_SMP_X2APIC);
+    lapic_enable();
+    cpus[0].lapic_id = response->bsp_lapic_id;
+    for (uint64_t i = 0; i < response->cpu_count && num_cpus < MAX_CPUS; i++) {
+        struct limine_smp_info *info = response->cpus[i];
+        if (info->lapic_id == response->bsp_lapic_id) {
+            continue;
+        }
+        struct cpu *cpu = &cpus[num_cpus];
+        cpu->lapic_id = info->lapic_id;
+        cpu->idle_task = idle_task_create();
+        info->extra_argument = num_cpus;
+        num_cpus++;
+        __atomic_store_n(&info->goto_address, ap_main, __ATOMIC_SEQ_CST); // Starts the AP
+    }
+}
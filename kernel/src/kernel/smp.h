@@ -0,0 +1,10 @@
+#ifndef SMP_H
+#define SMP_H
+
+void smp_init();
+void kernel_lock();
+void kernel_unlock();
+void kernel_lock_relax();
+void kernel_unlocked_halt();
+
+#endif
@@ -3,12 +3,16 @@
 #include "syscall.h"
 #include "arch/asm.h"
 #include "arch/idt.h"
+#include "arch/lapic.h"
+#include "fs/elf.h"
 #include "fs/tar.h"
 #include "fs/vfs.h"
 #include "fs/exfat.h"
 #include "lib/list.h"
 #include "kernel/scheduler.h"
 #include "kernel/limine-requests.h"
+#include "kernel/waitqueue.h"
+#include "mm/kmalloc.h"
 #include "mm/page.h"
 #include "mm/userspace.h"
 #include "mm/kmem.h"
@@ -34,6 +38,133 @@
 #define SYSCALL_KILL 18
 #define SYSCALL_SLEEP 19
 #define SYSCALL_MOUNT 20
+#define SYSCALL_MMAP 21
+#define SYSCALL_MUNMAP 22
+#define SYSCALL_SPAWN 23
+#define SYSCALL_SETNICE 24
+
+// Copy argv into a kernel page laid out as the top of the initial user stack
+// Pointers are relative to the page until user_stack_install moves it
+static void user_stack_build(struct user_stack_image *stack, uint8_t **argv_arg) {
+    stack->buffer = kpage_alloc_zeroed(); // TODO: what if we need more than 1 page?
+
+    stack->argc = 0;
+    while (argv_arg[stack->argc] != NULL) {
+        stack->argc++;
+    }
+
+    void *stack_end = stack->buffer + PAGE_SIZE;
+    void *stack_top = stack_end;
+
+    stack->arg_pointers = stack_top - (stack->argc + 1) * sizeof(uint8_t*);
+    stack_top = stack->arg_pointers;
+
+    for (size_t i = 0; i < stack->argc; i++) {
+        size_t arg_strlen = strlen(argv_arg[i]);
+        uint8_t *relocated_arg = stack_top - arg_strlen - 1;
+        memcpy(relocated_arg, argv_arg[i], arg_strlen + 1);
+        stack_top = relocated_arg;
+        stack->arg_pointers[i] = relocated_arg;
+    }
+    stack->arg_pointers[stack->argc] = NULL;
+
+    // arg pointer pointer (aligned to 8 bytes)
+    stack->arg_pointers_pointer = (uint8_t***)((uint64_t)(stack_top - 8) & 0xFFFFFFFFFFFFFFF8);
+    *stack->arg_pointers_pointer = stack->arg_pointers;
+    stack->start = stack->arg_pointers_pointer;
+}
+
+// Copy the stack image below user_entry_rsp of the current process and free its page
+// Returns the user mode rsp to enter the program with
+static uint64_t user_stack_install(struct user_stack_image *stack, uint64_t user_entry_rsp) {
+    void *stack_end = stack->buffer + PAGE_SIZE;
+    size_t stack_length = stack_end - stack->start;
+
+    // Apply address delta in the stack buffer
+    size_t user_address_delta = (void*)user_entry_rsp - stack_end;
+    for (size_t i = 0; i < stack->argc; i++) {
+        stack->arg_pointers[i] = (void*)stack->arg_pointers[i] + user_address_delta;
+    }
+    *stack->arg_pointers_pointer = (void*)(*stack->arg_pointers_pointer) + user_address_delta;
+
+    // Copy stack buffer to user stack
+    memcpy((void*)(user_entry_rsp - stack_length), stack->start, stack_length);
+    kpage_free(stack->buffer, 1);
+    return user_entry_rsp - stack_length;
+}
+
+// Give child a copy of every file descriptor of parent
+static void clone_files(struct task_struct *parent, struct task_struct *child) {
+    list_for_each(files_le, parent->files_lh) {
+        struct file *file = container_of(files_le, struct file, files_le);
+        struct file *new_file = file_alloc();
+        new_file->fd = file->fd;
+        list_add_tail(&new_file->files_le, &child->files_lh);
+        new_file->inode = file->inode;
+        new_file->offset = file->offset;
+    }
+}
+
+// Make fd of process a copy of old_filp, closing whatever fd referred to before
+static struct file *install_file_copy(struct task_struct *process, struct file *old_filp, uint32_t fd) {
+    struct file *filp_to_close = filp_find(process, fd);
+    if (filp_to_close) {
+        list_del(&filp_to_close->files_le);
+        file_free(filp_to_close);
+    }
+    struct file *next_filp = filp_insert_point_find(process, fd);
+    struct list_head *next_filp_le = next_filp == NULL ?
+        &process->files_lh :
+        &next_filp->files_le;
+    struct file *new_filp = file_alloc();
+    new_filp->fd = fd;
+    new_filp->inode = old_filp->inode;
+    new_filp->offset = old_filp->offset;
+    list_add_tail(&new_filp->files_le, next_filp_le);
+    return new_filp;
+}
+
+// Fault in every page of a user output buffer, so that it can be filled under a spinlock
+// without blocking in the page fault handler
+static void user_buffer_prefault(uint8_t *buffer, size_t length) {
+    uint8_t *end_of_buffer = buffer + length;
+    while (buffer < end_of_buffer) {
+        *(volatile uint8_t*)buffer = 0;
+        buffer = (uint8_t*)(((uint64_t)buffer | PAGE_OFFSET_MASK) + 1);
+    }
+}
+
+// First code run by a spawned task. Loads the program into the task's own address space,
+// then returns into zero_rax_and_iret, which enters it
+static void spawn_task_main() {
+    struct task_struct *task = current_task_ts;
+    struct spawn_request *request = task->spawn_request;
+    task->spawn_request = NULL;
+
+    struct file program_file = {
+        .inode = request->inode,
+        .offset = 0,
+    };
+    struct elf_image *elf_image = elf_image_get(&program_file); // Cached unless the binary changed since spawn
+    if (elf_image == NULL) {
+        kpage_free(request->stack.buffer, 1);
+        kfree(request);
+        task->task_state = TS_ZOMBIE;
+        task->exit_code = -1;
+        task_yield();
+        // No return
+    }
+    struct loader_result loader_result;
+    load_elf64(&program_file, elf_image, &loader_result);
+    elf_image_put(elf_image);
+    uint64_t user_rsp = user_stack_install(&request->stack, loader_result.user_entry_rsp);
+    kfree(request);
+
+    // Fill in the iret frame at the top of the kernel stack
+    uint64_t *iret_frame = (uint64_t*)task->kernel_entry_rsp - 5;
+    iret_frame[0] = loader_result.user_entry_rip;
+    iret_frame[3] = user_rsp;
+}
 
 uint64_t handle_syscall(
     uint64_t interrupt_rsp,
@@ -73,41 +204,40 @@ uint64_t handle_syscall(
             return 0;
         }
         case SYSCALL_FORK: {
+            uint64_t fork_start_tsc = read_tsc();
+            // Cloning memory has preemption points. The child is only published once it is complete,
+            // and the parent finishes building it even if it is killed meanwhile
+            task_disable_kill();
             struct task_struct *new_process = task_struct_alloc();
-            new_process->pid = pid_counter++;
             new_process->task_state = current_task_ts->task_state;
             strcpy(new_process->name, current_task_ts->name);
             new_process->kernel_stack_pages = NULL;
             new_process->pml4_page = NULL;
             new_process->kernel_entry_rsp = 0;
-            init_list(&new_process->memory_ranges_lh);
-            list_add_tail(&new_process->task_struct_le, &task_struct_lh);
+            new_process->memory_ranges_tree.node = NULL;
+            new_process->heap_range = NULL;
             setup_kernelspace_memory(new_process);
             init_list(&new_process->files_lh);
-            
-            // Clone memory ranges
-            list_for_each(memory_ranges_le, current_task_ts->memory_ranges_lh) {
-                struct userspace_memory_range *memory_range = container_of(memory_ranges_le, struct userspace_memory_range, memory_ranges_le);
-                struct userspace_memory_range *new_memory_range = userspace_memory_range_alloc();
-                new_memory_range->start = memory_range->start;
-                new_memory_range->end = memory_range->end;
-                new_memory_range->type = memory_range->type;
-                list_add_tail(&new_memory_range->memory_ranges_le, &new_process->memory_ranges_lh);
-                for (void *page = (void*)(memory_range->start); page < (void*)(memory_range->end); page += PAGE_SIZE) {
-                    void *new_kernel_space_address = map_user_page(new_process, page);
-                    memcpy(new_kernel_space_address, page, PAGE_SIZE);
-                }
-            }
+            new_process->minor_faults = 0;
+            new_process->major_faults = 0;
+            new_process->spawn_request = NULL;
+            new_process->cpu = NULL;
+            new_process->running_on = NULL;
+            new_process->pinned = false;
+            new_process->kernel_lock_depth = 1;
+            new_process->wait_queue = NULL;
+            new_process->kill_disable_depth = 0;
+            new_process->kill_pending = false;
+            task_set_nice(new_process, current_task_ts->nice);
+            new_process->queued = false;
+            new_process->vruntime = current_task_ts->vruntime - this_cpu()->min_vruntime; // Inherits the lag of the parent
+            new_process->sum_exec_runtime = 0;
 
-            // Clone file descriptors
-            list_for_each(files_le, current_task_ts->files_lh) {
-                struct file *file = container_of(files_le, struct file, files_le);
-                struct file *new_file = file_alloc();
-                new_file->fd = file->fd;
-                list_add_tail(&new_file->files_le, &new_process->files_lh);
-                new_file->inode = file->inode;
-                new_file->offset = file->offset;
-            }
+            // Clone memory ranges, sharing pages copy-on-write
+            clone_userspace_memory(current_task_ts, new_process);
+            load_cr3_from(current_task_ts); // Flush TLB entries for pages that became read-only
+
+            clone_files(current_task_ts, new_process);
 
             uint64_t *kernel_first_entry_rsp = (uint64_t*)(current_task_ts->kernel_entry_rsp);
             uint64_t *kernel_first_entry_rsp_2 = (uint64_t*)(new_process->kernel_entry_rsp);
@@ -137,96 +267,76 @@ uint64_t handle_syscall(
             *--kernel_first_entry_rsp_2 = *--kernel_first_entry_rsp;
             new_process->kernel_rsp = (uint64_t)kernel_first_entry_rsp_2;
 
+            // Pids are allocated and listed together, so task_struct_lh stays sorted
+            new_process->pid = pid_counter++;
+            task_list_add(new_process);
+            vmstat.fork_count++;
+            vmstat.fork_cycles += read_tsc() - fork_start_tsc;
+            scheduler_add_task(new_process);
+            task_enable_kill();
             return new_process->pid;
         }
         case SYSCALL_EXEC: {
+            uint64_t exec_start_tsc = read_tsc();
             void *path_arg = (void*)arg3;
             uint8_t **argv_arg = (void*)arg4;
 
-            void *path_buffer = kpage_alloc(1);
-            memset(path_buffer, 0, 4096);
-            strcpy(path_buffer, path_arg); // Unsafe
-
-            void *stack_buffer = kpage_alloc(1); // TODO: what if we need more than 1 page?
-            memset(stack_buffer, 0, 4096);
-
-            size_t argc = 0;
-            while (argv_arg[argc] != NULL) {
-                argc++;
-            }
-
-            void *stack_end = stack_buffer + 4096;
-            void *stack_top = stack_end;
-
-            uint8_t **relocated_arg_pointers = stack_top - (argc + 1) * sizeof(uint8_t*);
-            stack_top = relocated_arg_pointers;
-            
-            for (size_t i = 0; i < argc; i++) {
-                size_t arg_strlen = strlen(argv_arg[i]);
-                uint8_t *relocated_arg = stack_top - arg_strlen - 1;
-                memcpy(relocated_arg, argv_arg[i], arg_strlen + 1);
-                stack_top = relocated_arg;
-                relocated_arg_pointers[i] = relocated_arg;
+            size_t path_length = strlen(path_arg); // Unsafe
+            if (path_length >= PAGE_SIZE) {
+                return -1;
             }
-            relocated_arg_pointers[argc] = NULL;
+            void *path_buffer = kmalloc(path_length + 1);
+            strcpy(path_buffer, path_arg);
 
-            // arg pointer pointer (aligned to 8 bytes)
-            uint8_t ***relocated_arg_pointers_pointer = (uint8_t***)((uint64_t)(stack_top - 8) & 0xFFFFFFFFFFFFFFF8);
-            *relocated_arg_pointers_pointer = relocated_arg_pointers;
-            stack_top = relocated_arg_pointers_pointer;
-
-            void *stack_start = stack_top;
-            size_t stack_length = stack_end - stack_start;
+            struct user_stack_image stack;
+            user_stack_build(&stack, argv_arg);
 
             struct vfs_lookup_result lookup_result;
             vfs_resolve(path_buffer, &lookup_result);
             if (lookup_result.status != VFS_RESOLVE_SUCCESS_EXISTS) {
-                kpage_free(stack_buffer, 1);
-                kpage_free(path_buffer, 1);
+                kpage_free(stack.buffer, 1);
+                kfree(path_buffer);
                 return -1;
             }
-
-            free_userspace_memory(current_task_ts);
-            strcpy(current_task_ts->name, path_buffer);
-            
-            struct loader_result loader_result;
             struct file init_file = {
                 .inode = lookup_result.inode,
                 .offset = 0,
             };
-            load_elf64(&init_file, &loader_result); // Unsafe
-            load_cr3_from(current_task_ts);
-
-            // Apply address delta in stack_buffer
-            size_t user_address_delta = (void*)loader_result.user_entry_rsp - stack_end;
-            for (size_t i = 0; i < argc; i++) {
-                relocated_arg_pointers[i] = (void*)relocated_arg_pointers[i] + user_address_delta;
+            // Parsed before the old image is torn down. Cached on the inode for later execs
+            // Tearing down a dirty shared mapping of the binary invalidates the cached image, so a
+            // reference is held until it is loaded
+            struct elf_image *elf_image = elf_image_get(&init_file); // Unsafe
+            if (elf_image == NULL) {
+                kpage_free(stack.buffer, 1);
+                kfree(path_buffer);
+                return -1;
             }
-            *relocated_arg_pointers_pointer = (void*)(*relocated_arg_pointers_pointer) + user_address_delta;
 
-            // Copy stack_buffer to user stack
-            memcpy((void*)(loader_result.user_entry_rsp - stack_length), stack_start, stack_length);
+            // Page tables are kept until the new image is in place, so that it can reuse them
+            struct rb_root old_memory_ranges;
+            unmap_userspace_memory_for_exec(current_task_ts, &old_memory_ranges);
+            load_cr3_from(current_task_ts); // Flush TLB entries for the freed pages
+            strcpy(current_task_ts->name, path_buffer);
+            
+            struct loader_result loader_result;
+            load_elf64(&init_file, elf_image, &loader_result); // Unsafe
+            elf_image_put(elf_image);
+            load_cr3_from(current_task_ts);
+
+            uint64_t user_rsp = user_stack_install(&stack, loader_result.user_entry_rsp);
+            free_unused_page_tables(current_task_ts, &old_memory_ranges);
+            load_cr3_from(current_task_ts); // Flush cached paging structure entries for the freed page tables
 
             *((uint64_t*)interrupt_rsp + IDT_SYSCALL_NUM_SAVED_REGISTERS) = loader_result.user_entry_rip;
-            *((uint64_t*)interrupt_rsp + IDT_SYSCALL_NUM_SAVED_REGISTERS + 3) = loader_result.user_entry_rsp - stack_length;
+            *((uint64_t*)interrupt_rsp + IDT_SYSCALL_NUM_SAVED_REGISTERS + 3) = user_rsp;
 
-            kpage_free(stack_buffer, 1);
-            kpage_free(path_buffer, 1);
+            kfree(path_buffer);
+            vmstat.exec_count++;
+            vmstat.exec_cycles += read_tsc() - exec_start_tsc;
             return 0;
         }
         case SYSCALL_BRK: {
-            struct userspace_memory_range *heap_range = NULL;
-            for (
-                struct list_head *memory_ranges_le = current_task_ts->memory_ranges_lh.next;
-                memory_ranges_le != &current_task_ts->memory_ranges_lh;
-                memory_ranges_le = memory_ranges_le->next
-            ) {
-                struct userspace_memory_range *range = container_of(memory_ranges_le, struct userspace_memory_range, memory_ranges_le);
-                if (range->type == USERSPACE_MEMRANGE_HEAP) {
-                    heap_range = range;
-                    break;
-                }
-            }
+            struct userspace_memory_range *heap_range = current_task_ts->heap_range;
             if (heap_range == NULL) {
                 printk(u8p("No heap range found!\n"));
                 return 0;
@@ -234,33 +344,39 @@ uint64_t handle_syscall(
             if (arg3 == 0) {
                 return heap_range->end;
             }
-            while (heap_range->end < arg3) {
-                map_user_page(current_task_ts, (void*)heap_range->end);
-                heap_range->end += PAGE_SIZE;
+            if (heap_range->end < arg3) {
+                // Pages are mapped on first touch
+                heap_range->end = (arg3 & PAGE_OFFSET_MASK) ? ((arg3 | PAGE_OFFSET_MASK) + 1) : arg3;
             }
             return heap_range->end;
         }
         case SYSCALL_WAITPID: {
-            for (
-                struct list_head *task_struct_le = task_struct_lh.next;
-                task_struct_le != &task_struct_lh;
-                task_struct_le = task_struct_le->next
-            ) {
-                struct task_struct *process = container_of(task_struct_le, struct task_struct, task_struct_le);
-                if (process->pid == arg3) {
-                    while (process->task_state != TS_ZOMBIE) {
-                        task_yield();
-                    }
-                    free_userspace_memory(process);
-                    free_kernelspace_memory(process);
-                    free_task(process);
-                    if (arg4) {
-                        *((uint64_t*)arg4) = process->exit_code;
-                    }
-                    return arg3;
-                }
+            // Looked up again on every wakeup, since another waitpid may have reaped the task meanwhile
+            // A task killed by another CPU may still be running until it sees the reschedule IPI
+            struct task_struct *process;
+            wait_event(
+                &task_exit_wait_queue,
+                (process = task_struct_find(arg3)) == NULL ||
+                    (process->task_state == TS_ZOMBIE && process->running_on == NULL)
+            );
+            if (process == NULL) {
+                return -1;
             }
-            return -1;
+            // Claim the zombie before teardown, which has preemption points. Finish it even if killed
+            task_list_remove(process);
+            task_disable_kill();
+            uint64_t exit_start_tsc = read_tsc();
+            uint8_t exit_code = process->exit_code;
+            free_userspace_memory(process);
+            free_kernelspace_memory(process);
+            free_task(process);
+            vmstat.exit_count++;
+            vmstat.exit_cycles += read_tsc() - exit_start_tsc;
+            if (arg4) {
+                *((uint64_t*)arg4) = exit_code;
+            }
+            task_enable_kill();
+            return arg3;
         }
         case SYSCALL_OPEN: {
             struct vfs_lookup_result lookup_result;
@@ -340,6 +456,8 @@ uint64_t handle_syscall(
             uint8_t *buf_start = (void*)arg4;
             uint8_t *buf = buf_start;
             uint8_t *end_of_buf = buf + arg5;
+            user_buffer_prefault(buf, arg5);
+            read_lock(&dentry_lock);
             list_for_each(dentry_le, filp->inode->dentry_lh) {
                 struct dentry *dentry = container_of(dentry_le, struct dentry, dentry_le);
                 uint16_t dentry_name_strlen = strlen(dentry->name);
@@ -353,6 +471,7 @@ uint64_t handle_syscall(
                     break;
                 }
             }
+            read_unlock(&dentry_lock);
             return buf - buf_start;
         }
         case SYSCALL_MKDIR: {
@@ -370,7 +489,7 @@ uint64_t handle_syscall(
             }
             if (lookup_result.status == VFS_RESOLVE_SUCCESS_DOESNT_EXIST) {
                 uint64_t return_value;
-                uint8_t *name_buffer = kpage_alloc(1);
+                uint8_t *name_buffer = kmalloc(lookup_result.name_length + 1);
                 memcpy(name_buffer, lookup_result.name_start, lookup_result.name_length);
                 memset(name_buffer + lookup_result.name_length, 0, 1);
                 struct inode *inode = vfs_mkdir(
@@ -378,7 +497,7 @@ uint64_t handle_syscall(
                     name_buffer
                 );
                 return_value = inode ? 0 : -1;
-                kpage_free(name_buffer, 1);
+                kfree(name_buffer);
                 return return_value;
             }
             return lookup_result.status;
@@ -388,7 +507,11 @@ uint64_t handle_syscall(
             if (!filp) {
                 return -1;
             }
-            // For now, only support SEEK_SET
+            // SEEK_SET, or SEEK_END for regular files
+            if (arg5 == 2 && filp->inode->type == INODE_REGULAR_FILE) {
+                filp->offset = filp->inode->file_length + arg4;
+                return filp->offset;
+            }
             if (arg5 != 0) {
                 return -1;
             }
@@ -407,26 +530,15 @@ uint64_t handle_syscall(
             if (!old_filp) {
                 return -1;
             }
-            struct file *filp_to_close = filp_find(current_task_ts, arg4);
-            if (filp_to_close) {
-                list_del(&filp_to_close->files_le);
-                file_free(filp_to_close);
-            }
-            struct file *next_filp = filp_insert_point_find(current_task_ts, arg4);
-            struct list_head *next_filp_le = next_filp == NULL ?
-                &current_task_ts->files_lh :
-                &next_filp->files_le;
-            struct file *new_filp = file_alloc();
-            new_filp->fd = arg4;
-            new_filp->inode = old_filp->inode;
-            new_filp->offset = old_filp->offset;
-            list_add_tail(&new_filp->files_le, next_filp_le);
+            struct file *new_filp = install_file_copy(current_task_ts, old_filp, arg4);
             return new_filp->fd;
         }
         case SYSCALL_GETTASKS: {
             uint8_t *buf_start = (void*)arg3;
             uint8_t *buf = buf_start;
             uint8_t *end_of_buf = buf + arg4;
+            user_buffer_prefault(buf, arg4);
+            read_lock(&task_list_lock);
             list_for_each(task_struct_le, task_struct_lh) {
                 struct task_struct *ts = container_of(
                     task_struct_le,
@@ -434,10 +546,20 @@ uint64_t handle_syscall(
                     task_struct_le
                 );
                 uint16_t ts_name_strlen = strlen(ts->name);
-                uint16_t len_required = sizeof(uint32_t) + sizeof(uint16_t) + ts_name_strlen + 1;
+                uint16_t len_required = 2 * sizeof(uint32_t) + sizeof(int8_t) + 3 * sizeof(uint64_t) + sizeof(uint16_t) + ts_name_strlen + 1;
                 if (buf + len_required <= end_of_buf) {
                     *((uint32_t*)buf) = ts->pid;
                     buf += sizeof(uint32_t);
+                    *((uint64_t*)buf) = ts->minor_faults;
+                    buf += sizeof(uint64_t);
+                    *((uint64_t*)buf) = ts->major_faults;
+                    buf += sizeof(uint64_t);
+                    *((int8_t*)buf) = ts->nice;
+                    buf += sizeof(int8_t);
+                    *((uint32_t*)buf) = ts->weight;
+                    buf += sizeof(uint32_t);
+                    *((uint64_t*)buf) = sched_cycles_to_millis(ts->sum_exec_runtime);
+                    buf += sizeof(uint64_t);
                     *((uint16_t*)buf) = ts_name_strlen;
                     buf += sizeof(uint16_t);
                     strcpy(buf, ts->name);
@@ -446,6 +568,7 @@ uint64_t handle_syscall(
                     break;
                 }
             }
+            read_unlock(&task_list_lock);
             return buf - buf_start;
         }
         case SYSCALL_KILL: {
@@ -454,8 +577,17 @@ uint64_t handle_syscall(
             if (!task) {
                 return -1;
             }
+            if (task->kill_disable_depth > 0) {
+                // Building a child in fork or reaping one. Dies once that is done
+                task->kill_pending = true;
+                return 0;
+            }
             task->task_state = TS_ZOMBIE;
             task->exit_code = -1;
+            if (task->running_on != NULL && task->running_on != this_cpu()) {
+                lapic_send_ipi(task->running_on->lapic_id, LAPIC_RESCHEDULE_VECTOR);
+            }
+            wake_up(&task_exit_wait_queue);
             // In case process is killing itself, make sure it doesn't return from this syscall
             task_yield();
             return 0;
@@ -463,9 +595,7 @@ uint64_t handle_syscall(
         case SYSCALL_SLEEP: {
             uint64_t start_ticks = timer_ticks;
             uint64_t end_ticks = start_ticks + 1 + (arg3 - 1) * TIMER_TICKS_PER_SECOND / 1000;
-            while (timer_ticks < end_ticks) {
-                task_yield();
-            }
+            timer_sleep_until(end_ticks);
             return 0;
         }
         case SYSCALL_MOUNT: {
@@ -495,6 +625,184 @@ uint64_t handle_syscall(
                 return -4;
             }
         }
+        case SYSCALL_MMAP: {
+            // Arguments 4 and 5 (fd and offset) are passed in r9 and r8
+            uint64_t fd = *((uint64_t*)interrupt_rsp + 6);
+            uint64_t file_offset = *((uint64_t*)interrupt_rsp + 7);
+            uint64_t length = (arg4 + PAGE_OFFSET_MASK) & PAGE_ADDRESS_MASK;
+            if (!(arg5 & MAP_PRIVATE) == !(arg5 & MAP_SHARED) || arg4 == 0) {
+                return -1;
+            }
+            uint64_t address;
+            if (arg5 & MAP_ANONYMOUS) {
+                if (arg5 & MAP_SHARED) {
+                    return -1;
+                }
+                address = map_userspace_memory(current_task_ts, arg3, length, arg5 & MAP_FIXED, USERSPACE_MEMRANGE_ANONYMOUS, NULL, 0);
+            } else {
+                struct file *filp = filp_find(current_task_ts, fd);
+                if (!filp) {
+                    return -3;
+                }
+                if (
+                    filp->inode->type != INODE_REGULAR_FILE ||
+                    !filp->inode->superblock->ops->supports_mmap ||
+                    (file_offset & PAGE_OFFSET_MASK)
+                ) {
+                    return -4;
+                }
+                uint8_t type = (arg5 & MAP_SHARED) ? USERSPACE_MEMRANGE_FILE_SHARED : USERSPACE_MEMRANGE_FILE_PRIVATE;
+                address = map_userspace_memory(current_task_ts, arg3, length, arg5 & MAP_FIXED, type, filp->inode, file_offset);
+            }
+            if (address == 0) {
+                return -2;
+            }
+            if (arg5 & MAP_FIXED) {
+                load_cr3_from(current_task_ts); // Flush TLB entries for memory that was replaced
+            }
+            return address;
+        }
+        case SYSCALL_MUNMAP: {
+            uint64_t length = (arg4 + PAGE_OFFSET_MASK) & PAGE_ADDRESS_MASK;
+            if ((arg3 & PAGE_OFFSET_MASK) || arg4 == 0) {
+                return -1;
+            }
+            // Only memory in the mmap region can be unmapped
+            if (arg3 < USERSPACE_MMAP_BASE || arg3 > USERSPACE_MMAP_END || length > USERSPACE_MMAP_END - arg3) {
+                return -2;
+            }
+            remove_userspace_memory(current_task_ts, arg3, arg3 + length);
+            load_cr3_from(current_task_ts); // Flush TLB entries for the unmapped pages
+            return 0;
+        }
+        case SYSCALL_SPAWN: {
+            // Create a process running the program at path, without cloning the memory of the caller
+            uint64_t spawn_start_tsc = read_tsc();
+            uint8_t *path_arg = (void*)arg3; // Unsafe
+            uint8_t **argv_arg = (void*)arg4; // Unsafe
+            struct spawn_fd_mapping *fd_map = (void*)arg5; // Unsafe. May be NULL
+
+            struct vfs_lookup_result lookup_result;
+            vfs_resolve(path_arg, &lookup_result);
+            if (lookup_result.status != VFS_RESOLVE_SUCCESS_EXISTS || lookup_result.inode->type != INODE_REGULAR_FILE) {
+                return -1;
+            }
+            struct file program_file = {
+                .inode = lookup_result.inode,
+                .offset = 0,
+            };
+            // Parse it now, so that a bad binary fails spawn rather than the new task
+            struct elf_image *elf_image = elf_image_get(&program_file);
+            if (elf_image == NULL) {
+                return -1;
+            }
+            elf_image_put(elf_image);
+            for (size_t i = 0; fd_map != NULL && fd_map[i].parent_fd != SPAWN_FD_MAP_END; i++) {
+                if (!filp_find(current_task_ts, fd_map[i].parent_fd)) {
+                    return -2;
+                }
+            }
+
+            struct task_struct *new_process = task_struct_alloc();
+            new_process->pid = pid_counter++;
+            new_process->task_state = TS_RUNNING;
+            new_process->exit_code = 0;
+            size_t name_length = strlen(path_arg);
+            if (name_length >= TASK_NAME_MAXLEN) {
+                name_length = TASK_NAME_MAXLEN - 1;
+            }
+            memcpy(new_process->name, path_arg, name_length);
+            new_process->name[name_length] = 0;
+            new_process->kernel_stack_pages = NULL;
+            new_process->pml4_page = NULL;
+            new_process->kernel_entry_rsp = 0;
+            new_process->memory_ranges_tree.node = NULL;
+            new_process->heap_range = NULL;
+            task_list_add(new_process);
+            setup_kernelspace_memory(new_process);
+            init_list(&new_process->files_lh);
+            new_process->minor_faults = 0;
+            new_process->major_faults = 0;
+            new_process->cpu = NULL;
+            new_process->running_on = NULL;
+            new_process->pinned = false;
+            new_process->kernel_lock_depth = 1;
+            new_process->wait_queue = NULL;
+            new_process->kill_disable_depth = 0;
+            new_process->kill_pending = false;
+            task_set_nice(new_process, current_task_ts->nice);
+            new_process->queued = false;
+            new_process->vruntime = 0;
+            new_process->sum_exec_runtime = 0;
+
+            clone_files(current_task_ts, new_process);
+            for (size_t i = 0; fd_map != NULL && fd_map[i].parent_fd != SPAWN_FD_MAP_END; i++) {
+                install_file_copy(new_process, filp_find(current_task_ts, fd_map[i].parent_fd), fd_map[i].child_fd);
+            }
+            // The sources of the mapping are only opened for the child to use under their new numbers,
+            // so the child does not keep them unless they are also the target of a mapping
+            for (size_t i = 0; fd_map != NULL && fd_map[i].parent_fd != SPAWN_FD_MAP_END; i++) {
+                bool is_target = false;
+                for (size_t j = 0; fd_map[j].parent_fd != SPAWN_FD_MAP_END; j++) {
+                    if (fd_map[j].child_fd == fd_map[i].parent_fd) {
+                        is_target = true;
+                    }
+                }
+                struct file *source_filp = filp_find(new_process, fd_map[i].parent_fd);
+                if (!is_target && source_filp != NULL) {
+                    list_del(&source_filp->files_le);
+                    file_free(source_filp);
+                }
+            }
+
+            struct spawn_request *request = kmalloc(sizeof(struct spawn_request));
+            request->inode = lookup_result.inode;
+            user_stack_build(&request->stack, argv_arg);
+            new_process->spawn_request = request;
+
+            uint64_t *kernel_first_entry_rsp = (uint64_t*)(new_process->kernel_entry_rsp);
+            // stack for iret. spawn_task_main fills in rip and rsp
+            *--kernel_first_entry_rsp = 0x43; // user mode data selector
+            *--kernel_first_entry_rsp = 0; // user mode rsp
+            *--kernel_first_entry_rsp = 0x202; // user mode rflags
+            *--kernel_first_entry_rsp = 0x3b; // user mode code selector (ring 3 code with bottom 2 bits set for ring 3)
+            *--kernel_first_entry_rsp = 0; // user mode rip
+
+            // stack for zero_rax_and_iret
+            for (uint8_t i = 0; i < IDT_SYSCALL_NUM_SAVED_REGISTERS; i++) {
+                // Enter the program with all registers set to zero
+                *--kernel_first_entry_rsp = 0;
+            }
+
+            // return address for spawn_task_main
+            *--kernel_first_entry_rsp = (uint64_t)zero_rax_and_iret;
+            // return address for switch_to_task
+            *--kernel_first_entry_rsp = (uint64_t)spawn_task_main;
+
+            // stack for switch_to_task
+            *--kernel_first_entry_rsp = 0;
+            *--kernel_first_entry_rsp = 0;
+            *--kernel_first_entry_rsp = 0;
+            *--kernel_first_entry_rsp = 0;
+            *--kernel_first_entry_rsp = 0;
+            *--kernel_first_entry_rsp = 0;
+            new_process->kernel_rsp = (uint64_t)kernel_first_entry_rsp;
+
+            vmstat.spawn_count++;
+            vmstat.spawn_cycles += read_tsc() - spawn_start_tsc;
+            scheduler_add_task(new_process);
+            return new_process->pid;
+        }
+        case SYSCALL_SETNICE: {
+            // Set the nice value of a task, or of the caller if pid is 0
+            struct task_struct *task = arg3 == 0 ? current_task_ts : task_struct_find(arg3);
+            int64_t nice = arg4;
+            if (!task || nice < SCHED_NICE_MIN || nice > SCHED_NICE_MAX) {
+                return -1;
+            }
+            task_set_nice(task, nice);
+            return 0;
+        }
         default: {
             printk(u8p("Unrecognized syscall: "));
             printk_uint64(syscall_number);
@@ -1,6 +1,34 @@
 #ifndef SYSCALL_H
 #define SYSCALL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Entry of the fd remapping list passed to spawn. The child gets a copy of parent_fd as child_fd
+// The list ends with an entry whose parent_fd is SPAWN_FD_MAP_END
+struct spawn_fd_mapping {
+    uint64_t child_fd;
+    uint64_t parent_fd;
+};
+#define SPAWN_FD_MAP_END ((uint64_t)-1)
+
+struct inode;
+
+// argv laid out as the initial user stack in a kernel page. Built before the old image is torn down
+struct user_stack_image {
+    void *buffer; // The kernel page
+    void *start; // Lowest used byte of buffer
+    size_t argc;
+    uint8_t **arg_pointers;
+    uint8_t ***arg_pointers_pointer;
+};
+
+// Handed from spawn to the new task, which loads the program in its own address space
+struct spawn_request {
+    struct inode *inode;
+    struct user_stack_image stack;
+};
+
 uint64_t handle_syscall(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5);
 
 #endif
@@ -0,0 +1,65 @@
+#include <stddef.h>
+#include "arch/cpu.h"
+#include "kernel/scheduler.h"
+#include "kernel/waitqueue.h"
+
+void wait_queue_init(struct wait_queue *wait_queue, uint8_t *name) {
+    init_list(&wait_queue->waiters_lh);
+    spin_lock_init(&wait_queue->lock, name);
+}
+
+// Put the current task on wait_queue in TS_WAITING. It keeps running until it yields,
+// so it can check its condition once more first
+void prepare_to_wait(struct wait_queue *wait_queue) {
+    struct task_struct *task = current_task_ts;
+    bool interrupts_enabled = spin_lock_irqsave(&wait_queue->lock);
+    if (task->wait_queue == NULL) {
+        list_add_tail(&task->wait_queue_le, &wait_queue->waiters_lh);
+        task->wait_queue = wait_queue;
+    }
+    task->task_state = TS_WAITING;
+    spin_unlock_irqrestore(&wait_queue->lock, interrupts_enabled);
+}
+
+// Take the current task off wait_queue, unless a wake_up already has, and make it runnable
+void finish_wait(struct wait_queue *wait_queue) {
+    struct task_struct *task = current_task_ts;
+    bool interrupts_enabled = spin_lock_irqsave(&wait_queue->lock);
+    if (task->wait_queue == wait_queue) {
+        list_del(&task->wait_queue_le);
+        task->wait_queue = NULL;
+    }
+    if (task->task_state == TS_WAITING) {
+        task->task_state = TS_RUNNING;
+    }
+    spin_unlock_irqrestore(&wait_queue->lock, interrupts_enabled);
+}
+
+// Make every task on wait_queue runnable. They recheck their conditions
+void wake_up(struct wait_queue *wait_queue) {
+    bool interrupts_enabled = spin_lock_irqsave(&wait_queue->lock);
+    while (wait_queue->waiters_lh.next != &wait_queue->waiters_lh) {
+        struct task_struct *task = container_of(wait_queue->waiters_lh.next, struct task_struct, wait_queue_le);
+        list_del(&task->wait_queue_le);
+        task->wait_queue = NULL;
+        if (task->task_state != TS_WAITING) {
+            // Killed while waiting
+            continue;
+        }
+        task->task_state = TS_RUNNING;
+        scheduler_wake_task(task);
+    }
+    spin_unlock_irqrestore(&wait_queue->lock, interrupts_enabled);
+}
+
+// Take a task that is being killed off the wait queue it is on, before it is freed
+void wait_queue_cancel(struct task_struct *task) {
+    struct wait_queue *wait_queue = task->wait_queue;
+    if (wait_queue == NULL) {
+        return;
+    }
+    bool interrupts_enabled = spin_lock_irqsave(&wait_queue->lock);
+    list_del(&task->wait_queue_le);
+    task->wait_queue = NULL;
+    spin_unlock_irqrestore(&wait_queue->lock, interrupts_enabled);
+}
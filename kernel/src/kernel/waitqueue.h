@@ -0,0 +1,35 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+#include <stdbool.h>
+#include "lib/list.h"
+#include "lib/spinlock.h"
+
+// Tasks in TS_WAITING until an event they wait for happens. The scheduler skips them
+struct wait_queue {
+    struct spinlock lock; // Taken with interrupts disabled, since interrupt handlers wake tasks
+    struct list_head waiters_lh; // struct task_struct
+};
+
+struct task_struct;
+
+void wait_queue_init(struct wait_queue *wait_queue, uint8_t *name);
+void prepare_to_wait(struct wait_queue *wait_queue);
+void finish_wait(struct wait_queue *wait_queue);
+void wake_up(struct wait_queue *wait_queue);
+void wait_queue_cancel(struct task_struct *task);
+
+// Block the current task until condition is true. The condition is checked after queueing,
+// so a wake_up between the check and the task switch is not lost
+#define wait_event(wait_queue, condition) \
+do { \
+    while (true) { \
+        prepare_to_wait(wait_queue); \
+        if (condition) { \
+            break; \
+        } \
+        task_yield(); \
+    } \
+    finish_wait(wait_queue); \
+} while (0)
+
+#endif
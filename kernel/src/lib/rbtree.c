@@ -0,0 +1,256 @@
+#include "lib/rbtree.h"
+
+// Attach node as a leaf below parent. link is &parent->left, &parent->right, or &root->node for an empty tree
+void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link) {
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+static bool rb_is_black(struct rb_node *node) {
+    return node == NULL || node->color == RB_BLACK;
+}
+
+static void rb_rotate_left(struct rb_node *x, struct rb_root *root) {
+    struct rb_node *y = x->right;
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        root->node = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(struct rb_node *x, struct rb_root *root) {
+    struct rb_node *y = x->left;
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        root->node = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+    y->right = x;
+    x->parent = y;
+}
+
+// Rebalance after rb_link_node
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *parent;
+    while ((parent = node->parent) != NULL && parent->color == RB_RED) {
+        struct rb_node *gparent = parent->parent; // Exists, because a red node is never the root
+        if (parent == gparent->left) {
+            struct rb_node *uncle = gparent->right;
+            if (!rb_is_black(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            struct rb_node *uncle = gparent->left;
+            if (!rb_is_black(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+// Replace the subtree rooted at u with the subtree rooted at v
+static void rb_transplant(struct rb_node *u, struct rb_node *v, struct rb_root *root) {
+    if (u->parent == NULL) {
+        root->node = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
+    } else {
+        u->parent->right = v;
+    }
+    if (v) {
+        v->parent = u->parent;
+    }
+}
+
+// x may be NULL, so its parent is passed separately
+static void rb_erase_color(struct rb_node *x, struct rb_node *parent, struct rb_root *root) {
+    while (x != root->node && rb_is_black(x)) {
+        if (x == parent->left) {
+            struct rb_node *sibling = parent->right;
+            if (!rb_is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (rb_is_black(sibling->right)) {
+                    sibling->left->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rb_rotate_right(sibling, root);
+                    sibling = parent->right;
+                }
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                sibling->right->color = RB_BLACK;
+                rb_rotate_left(parent, root);
+                x = root->node;
+            }
+        } else {
+            struct rb_node *sibling = parent->left;
+            if (!rb_is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (rb_is_black(sibling->left)) {
+                    sibling->right->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rb_rotate_left(sibling, root);
+                    sibling = parent->left;
+                }
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                sibling->left->color = RB_BLACK;
+                rb_rotate_right(parent, root);
+                x = root->node;
+            }
+        }
+    }
+    if (x) {
+        x->color = RB_BLACK;
+    }
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *x;
+    struct rb_node *x_parent;
+    uint8_t removed_color = node->color;
+    if (node->left == NULL) {
+        x = node->right;
+        x_parent = node->parent;
+        rb_transplant(node, node->right, root);
+    } else if (node->right == NULL) {
+        x = node->left;
+        x_parent = node->parent;
+        rb_transplant(node, node->left, root);
+    } else {
+        // Replace node with its successor
+        struct rb_node *successor = node->right;
+        while (successor->left) {
+            successor = successor->left;
+        }
+        removed_color = successor->color;
+        x = successor->right;
+        if (successor->parent == node) {
+            x_parent = successor;
+        } else {
+            x_parent = successor->parent;
+            rb_transplant(successor, successor->right, root);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+        rb_transplant(node, successor, root);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->color = node->color;
+    }
+    if (removed_color == RB_BLACK) {
+        rb_erase_color(x, x_parent, root);
+    }
+}
+
+struct rb_node *rb_first(struct rb_root *root) {
+    struct rb_node *node = root->node;
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+struct rb_node *rb_last(struct rb_root *root) {
+    struct rb_node *node = root->node;
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
+struct rb_node *rb_next(struct rb_node *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+struct rb_node *rb_prev(struct rb_node *node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return node;
+    }
+    while (node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
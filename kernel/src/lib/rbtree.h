@@ -0,0 +1,36 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "lib/list.h"
+
+// Intrusive red-black tree. Users embed struct rb_node and do their own ordered descent,
+// then call rb_link_node and rb_insert_color to insert
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    uint8_t color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+#define RB_ROOT { .node = NULL }
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link);
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+#endif
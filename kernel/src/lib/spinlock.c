@@ -0,0 +1,163 @@
+#include "arch/asm.h"
+#include "lib/spinlock.h"
+
+struct list_head lock_stats_lh = { .prev = &lock_stats_lh, .next = &lock_stats_lh };
+
+// Protects lock_stats_lh. Not registered itself
+static struct spinlock lock_stats_lock;
+
+static void lock_stats_register(struct lock_stats *stats, uint8_t *name) {
+    stats->name = name;
+    spin_lock(&lock_stats_lock);
+    list_add_tail(&stats->lock_stats_le, &lock_stats_lh);
+    spin_unlock(&lock_stats_lock);
+}
+
+// Name the lock and list its statistics in /sys/lockstat. Leaves the lock state alone,
+// so a lock that is already in use may be registered
+void spin_lock_init(struct spinlock *lock, uint8_t *name) {
+    lock_stats_register(&lock->stats, name);
+}
+
+void spin_lock(struct spinlock *lock) {
+    uint32_t ticket = __atomic_fetch_add(&lock->next_ticket, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+    while (__atomic_load_n(&lock->now_serving, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile ("pause");
+        spins++;
+    }
+    lock->acquire_tsc = read_tsc();
+    lock->stats.acquisitions++;
+    if (spins != 0) {
+        lock->stats.contended++;
+        lock->stats.spins += spins;
+    }
+}
+
+// Take the lock only if nobody holds it. Returns true if taken
+bool spin_trylock(struct spinlock *lock) {
+    uint32_t ticket = __atomic_load_n(&lock->now_serving, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(
+        &lock->next_ticket, &ticket, ticket + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+    )) {
+        return false;
+    }
+    lock->acquire_tsc = read_tsc();
+    lock->stats.acquisitions++;
+    return true;
+}
+
+void spin_unlock(struct spinlock *lock) {
+    uint64_t hold_cycles = read_tsc() - lock->acquire_tsc;
+    if (hold_cycles > lock->stats.max_hold_cycles) {
+        lock->stats.max_hold_cycles = hold_cycles;
+    }
+    __atomic_store_n(&lock->now_serving, lock->now_serving + 1, __ATOMIC_RELEASE);
+}
+
+// True if another CPU is waiting for the lock. Only meaningful while holding it
+bool spin_is_contended(struct spinlock *lock) {
+    return __atomic_load_n(&lock->next_ticket, __ATOMIC_RELAXED) != lock->now_serving + 1;
+}
+
+bool spin_lock_irqsave(struct spinlock *lock) {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    spin_lock(lock);
+    return interrupts_enabled;
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock, bool interrupts_enabled) {
+    spin_unlock(lock);
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+void rwlock_init(struct rwlock *lock, uint8_t *name) {
+    lock_stats_register(&lock->stats, name);
+}
+
+void read_lock(struct rwlock *lock) {
+    uint64_t spins = 0;
+    while (true) {
+        int32_t readers = __atomic_load_n(&lock->readers, __ATOMIC_RELAXED);
+        if (
+            readers != RWLOCK_WRITE_LOCKED &&
+            __atomic_load_n(&lock->writers_waiting, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&lock->readers, &readers, readers + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+        ) {
+            break;
+        }
+        asm volatile ("pause");
+        spins++;
+    }
+    // Readers may update the statistics concurrently
+    __atomic_fetch_add(&lock->stats.acquisitions, 1, __ATOMIC_RELAXED);
+    if (spins != 0) {
+        __atomic_fetch_add(&lock->stats.contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lock->stats.spins, spins, __ATOMIC_RELAXED);
+    }
+}
+
+void read_unlock(struct rwlock *lock) {
+    __atomic_fetch_sub(&lock->readers, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(struct rwlock *lock) {
+    __atomic_fetch_add(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+    while (true) {
+        int32_t readers = 0;
+        if (__atomic_compare_exchange_n(
+            &lock->readers, &readers, RWLOCK_WRITE_LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+        )) {
+            break;
+        }
+        asm volatile ("pause");
+        spins++;
+    }
+    __atomic_fetch_sub(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    lock->acquire_tsc = read_tsc();
+    __atomic_fetch_add(&lock->stats.acquisitions, 1, __ATOMIC_RELAXED);
+    if (spins != 0) {
+        __atomic_fetch_add(&lock->stats.contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lock->stats.spins, spins, __ATOMIC_RELAXED);
+    }
+}
+
+void write_unlock(struct rwlock *lock) {
+    uint64_t hold_cycles = read_tsc() - lock->acquire_tsc;
+    if (hold_cycles > lock->stats.max_hold_cycles) {
+        lock->stats.max_hold_cycles = hold_cycles;
+    }
+    __atomic_store_n(&lock->readers, 0, __ATOMIC_RELEASE);
+}
+
+bool read_lock_irqsave(struct rwlock *lock) {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    read_lock(lock);
+    return interrupts_enabled;
+}
+
+void read_unlock_irqrestore(struct rwlock *lock, bool interrupts_enabled) {
+    read_unlock(lock);
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+bool write_lock_irqsave(struct rwlock *lock) {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    write_lock(lock);
+    return interrupts_enabled;
+}
+
+void write_unlock_irqrestore(struct rwlock *lock, bool interrupts_enabled) {
+    write_unlock(lock);
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
@@ -1,8 +1,62 @@
-#include "arch/asm.h"
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "lib/list.h"
 
-// On a uniprocessor system, no spinning is needed in a spinlock
-#define spin_lock_irqsave(_spinlock, flags) \
-if (are_interrupts_enabled()) { flags = 1; asm volatile ("cli"); } else { flags = 0; }
+// Contention statistics of one lock, shown in /sys/lockstat once registered
+struct lock_stats {
+    uint8_t *name;
+    uint64_t acquisitions;
+    uint64_t contended; // Acquisitions that had to wait for another holder
+    uint64_t spins; // Iterations of the wait loops
+    uint64_t max_hold_cycles; // Longest time held exclusively, in TSC cycles
+    struct list_head lock_stats_le; // Entry in lock_stats_lh
+};
 
-#define spin_lock_irqrestore(_spinlock, flags) \
-if (flags == 1) { asm volatile ("sti"); }
+// Ticket lock. Waiters are served in the order they arrived
+// A zeroed lock is unlocked, so locks in static storage may be used before spin_lock_init
+struct spinlock {
+    volatile uint32_t next_ticket;
+    volatile uint32_t now_serving;
+    uint64_t acquire_tsc;
+    struct lock_stats stats;
+};
+
+// Reader-writer lock. New readers hold back while a writer waits, so writers cannot starve
+// As with struct spinlock, a zeroed lock is unlocked
+struct rwlock {
+    volatile int32_t readers; // Number of readers holding the lock, or RWLOCK_WRITE_LOCKED
+    volatile uint32_t writers_waiting;
+    uint64_t acquire_tsc; // Of the writer
+    struct lock_stats stats;
+};
+
+#define RWLOCK_WRITE_LOCKED (-1)
+
+extern struct list_head lock_stats_lh;
+
+void spin_lock_init(struct spinlock *lock, uint8_t *name);
+void spin_lock(struct spinlock *lock);
+bool spin_trylock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+bool spin_is_contended(struct spinlock *lock);
+
+// Also disable interrupts, for locks taken by interrupt handlers
+// Returns whether interrupts were enabled, to be passed to spin_unlock_irqrestore
+bool spin_lock_irqsave(struct spinlock *lock);
+void spin_unlock_irqrestore(struct spinlock *lock, bool interrupts_enabled);
+
+void rwlock_init(struct rwlock *lock, uint8_t *name);
+void read_lock(struct rwlock *lock);
+void read_unlock(struct rwlock *lock);
+void write_lock(struct rwlock *lock);
+void write_unlock(struct rwlock *lock);
+
+// As spin_lock_irqsave and spin_unlock_irqrestore
+bool read_lock_irqsave(struct rwlock *lock);
+void read_unlock_irqrestore(struct rwlock *lock, bool interrupts_enabled);
+bool write_lock_irqsave(struct rwlock *lock);
+void write_unlock_irqrestore(struct rwlock *lock, bool interrupts_enabled);
+
+#endif
@@ -0,0 +1,63 @@
+#include "drivers/tty.h"
+#include "mm/kmalloc.h"
+#include "mm/kmem.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "lib/cstd.h"
+
+struct slab_allocator kmalloc_allocators[KMALLOC_NUM_CLASSES];
+uint64_t kmalloc_page_allocations = 0;
+
+static uint8_t *kmalloc_class_names[KMALLOC_NUM_CLASSES] = {
+    u8p("kmalloc-16"),
+    u8p("kmalloc-32"),
+    u8p("kmalloc-64"),
+    u8p("kmalloc-128"),
+    u8p("kmalloc-256"),
+    u8p("kmalloc-512"),
+    u8p("kmalloc-1024"),
+    u8p("kmalloc-2048"),
+};
+
+void kmalloc_init() {
+    for (uint8_t i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        struct slab_allocator *allocator = &kmalloc_allocators[i];
+        allocator->name = kmalloc_class_names[i];
+        allocator->object_size = 1 << (KMALLOC_MIN_SHIFT + i);
+        allocator->objects_per_page = SLAB_AVAILABLE_PAGESIZE / allocator->object_size;
+        allocator->empty_reserve = SLAB_DEFAULT_EMPTY_RESERVE;
+        allocator->magazine_size = SLAB_DEFAULT_MAGAZINE_SIZE;
+        slab_allocator_init(allocator);
+    }
+}
+
+// Allocate a buffer of at least size bytes. Contents are not zeroed
+// Sizes above KMALLOC_MAX_SIZE and up to PAGE_SIZE get a whole page
+void *kmalloc(size_t size) {
+    if (size > KMALLOC_MAX_SIZE) {
+        if (size > PAGE_SIZE) {
+            panic(u8p("kmalloc: allocation too large\n"));
+        }
+        kmalloc_page_allocations++;
+        return kpage_alloc(1);
+    }
+    uint8_t class_index = 0;
+    while ((1ULL << (KMALLOC_MIN_SHIFT + class_index)) < size) {
+        class_index++;
+    }
+    return slab_alloc(&kmalloc_allocators[class_index]);
+}
+
+void kfree(void *address) {
+    if (address == NULL) {
+        return;
+    }
+    if (((uint64_t)address & (PAGE_SIZE - 1)) == 0) {
+        // Slab objects never start at a page boundary, because the page header comes first
+        kmalloc_page_allocations--;
+        kpage_free(address, 1);
+        return;
+    }
+    struct slab_page_header *header = (void*)((uint64_t)address & PAGE_ADDRESS_MASK);
+    slab_free(header->allocator, address);
+}
@@ -0,0 +1,20 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+#include <stdint.h>
+#include <stddef.h>
+#include "mm/slab.h"
+
+// Size classes are powers of two from 2^KMALLOC_MIN_SHIFT to 2^KMALLOC_MAX_SHIFT bytes
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_NUM_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define KMALLOC_MAX_SIZE (1 << KMALLOC_MAX_SHIFT)
+
+extern struct slab_allocator kmalloc_allocators[KMALLOC_NUM_CLASSES];
+extern uint64_t kmalloc_page_allocations; // Live allocations larger than KMALLOC_MAX_SIZE
+
+void kmalloc_init();
+void *kmalloc(size_t size);
+void kfree(void *address);
+
+#endif
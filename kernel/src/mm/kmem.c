@@ -1,21 +1,51 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "arch/asm.h"
 #include "kernel/limine-requests.h"
 #include "drivers/tty.h"
+#include "lib/cstd.h"
+#include "lib/list.h"
 #include "mm/kmem.h"
 #include "mm/page.h"
+#include "mm/pagecache.h"
+#include "mm/slab.h"
 
 uint64_t hhdm_offset;
-uint64_t kmem_start;
-uint64_t kmem_length;
-uint64_t kmem_total_pages; // Total RAM-resident pages (not counting MMIO pages)
-struct page *kmem_page_array;
+uint64_t kmem_total_pages = 0; // Total RAM-resident pages in all zones (not counting MMIO pages)
 uint64_t kmem_used_pages = 0;
-uint64_t dmem_start = 0xffffc00000000000; // Address that Limine doesn't map
-uint64_t dmem_used_pages = 0;
+struct kmem_zone kmem_zones[KMEM_MAX_ZONES];
+uint32_t kmem_num_zones = 0;
+void *kmem_zero_pool[KMEM_ZERO_POOL_PAGES];
+uint64_t kmem_zero_pool_count = 0;
+uint64_t kmem_zero_pool_hits = 0;
+uint64_t kmem_zero_pool_misses = 0;
 
-#define DMEM_MAX_PAGES 1000
+// The zero pool is not refilled when fewer pages than this are free
+#define KMEM_ZERO_POOL_MIN_FREE_PAGES 1024
+
+void kmem_free_range(struct kmem_zone *zone, size_t index, size_t num_pages);
+
+void kmem_zone_init(struct kmem_zone *zone, uint64_t base, uint64_t length) {
+    zone->start = base + hhdm_offset;
+    zone->start_pfn = base >> 12;
+    zone->total_pages = length >> 12; // 4096 bytes per page
+    zone->used_pages = 0;
+    zone->page_array = (void*)zone->start;
+    size_t page_array_pages = (zone->total_pages * sizeof(struct page) >> 12) + 1; // 4096 bytes per page
+
+    for (uint8_t order = 0; order <= KMEM_MAX_ORDER; order++) {
+        init_list(&zone->free_lh[order]);
+        zone->free_blocks[order] = 0;
+    }
+
+    // Initialize page map
+    for (size_t i = 0; i < page_array_pages; i++) {
+        zone->page_array[i].status = KPAGE_PAGE_ARRAY;
+        zone->page_array[i].order = KPAGE_NO_ORDER;
+    }
+    kmem_free_range(zone, page_array_pages, zone->total_pages - page_array_pages);
+}
 
 void kmem_init() {
     if (hhdm_request.response == NULL) {
@@ -27,74 +57,232 @@ void kmem_init() {
         panic(u8p("No memmap response\n"));
     }
 
-    // Choose the largest region for kmem
-    uint64_t largest_region_bytes = 0;
-    struct limine_memmap_entry *largest_region_entry = NULL;
+    // Turn every usable region into a zone
     for (uint32_t i = 0; i < memmap_request.response->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap_request.response->entries[i];
         // if (entry->type != 0 && entry->type != 6 && entry->type != 7) continue;
         if (entry->type != 0) continue;
-        if (entry->length > largest_region_bytes) {
-            largest_region_bytes = entry->length;
-            largest_region_entry = entry;
+        if (kmem_num_zones == KMEM_MAX_ZONES) {
+            printk(u8p("kmem_init: too many usable regions, ignoring the rest\n"));
+            break;
+        }
+        uint64_t num_pages = entry->length >> 12;
+        if (num_pages < 2) {
+            // Not enough room for a page array and at least one usable page
+            continue;
         }
+        kmem_zone_init(&kmem_zones[kmem_num_zones], entry->base, entry->length);
+        kmem_total_pages += num_pages;
+        kmem_num_zones++;
     }
-    if (largest_region_entry == NULL) {
+    if (kmem_num_zones == 0) {
         panic(u8p("No usable memory regions found"));
     }
-    kmem_start = largest_region_entry->base + hhdm_offset;
-    kmem_length = largest_region_entry->length;
-    kmem_total_pages = kmem_length >> 12; // 4096 bytes per page
-    size_t page_array_pages = (kmem_total_pages * sizeof(struct page) >> 12) + 1; // 4096 bytes per page
-    kmem_page_array = (void*)kmem_start;
+}
 
-    // Initialize page map
-    for (size_t i = 0; i < kmem_total_pages; i++) {
-        if (i < page_array_pages) {
-            kmem_page_array[i].status = KPAGE_PAGE_ARRAY;
-        } else {
-            kmem_page_array[i].status = KPAGE_FREE;
+// Find the zone that contains a page, given its HHDM address
+struct kmem_zone *kmem_zone_of(void *page) {
+    uint64_t address = (uint64_t)page;
+    for (uint32_t i = 0; i < kmem_num_zones; i++) {
+        struct kmem_zone *zone = &kmem_zones[i];
+        if (address >= zone->start && address < zone->start + (zone->total_pages << 12)) {
+            return zone;
         }
     }
+    return NULL;
 }
 
-void *kpage_alloc(size_t num_pages) {
-    size_t i = 0;
-    size_t consecutive_free = 0;
-    size_t first_page_index = 0;
-    while (true) {
-        if (i >= kmem_total_pages) {
-            panic(u8p("Out of physical memory\n"));
+void kmem_free_block_add(struct kmem_zone *zone, size_t index, uint8_t order) {
+    zone->page_array[index].order = order;
+    list_add(&zone->page_array[index].free_le, &zone->free_lh[order]);
+    zone->free_blocks[order]++;
+}
+
+void kmem_free_block_del(struct kmem_zone *zone, size_t index) {
+    uint8_t order = zone->page_array[index].order;
+    list_del(&zone->page_array[index].free_le);
+    zone->page_array[index].order = KPAGE_NO_ORDER;
+    zone->free_blocks[order]--;
+}
+
+// Put a naturally aligned block of 2^order pages on the free lists, coalescing it with its buddy as long as possible
+void kmem_free_block(struct kmem_zone *zone, size_t index, uint8_t order) {
+    while (order < KMEM_MAX_ORDER) {
+        uint64_t buddy_pfn = (zone->start_pfn + index) ^ (1ULL << order);
+        if (buddy_pfn < zone->start_pfn || buddy_pfn - zone->start_pfn >= zone->total_pages) {
+            break;
         }
-        if (kmem_page_array[i].status == KPAGE_FREE) {
-            consecutive_free++;
-            if (consecutive_free == num_pages) {
-                first_page_index = i - num_pages + 1;
-                break;
-            }
-        } else {
-            consecutive_free = 0;
+        size_t buddy_index = buddy_pfn - zone->start_pfn;
+        struct page *buddy = &zone->page_array[buddy_index];
+        if (buddy->status != KPAGE_FREE || buddy->order != order) {
+            // Buddy is in use, or is split into smaller free blocks
+            break;
+        }
+        kmem_free_block_del(zone, buddy_index);
+        if (buddy_index < index) {
+            index = buddy_index;
+        }
+        order++;
+    }
+    kmem_free_block_add(zone, index, order);
+}
+
+// Free an arbitrary run of pages by splitting it into naturally aligned power-of-two blocks
+void kmem_free_range(struct kmem_zone *zone, size_t index, size_t num_pages) {
+    for (size_t j = index; j < index + num_pages; j++) {
+        zone->page_array[j].status = KPAGE_FREE;
+        zone->page_array[j].order = KPAGE_NO_ORDER;
+    }
+    while (num_pages > 0) {
+        uint64_t pfn = zone->start_pfn + index;
+        uint8_t order = 0;
+        while (
+            order < KMEM_MAX_ORDER &&
+            !(pfn & (1ULL << order)) &&
+            (2ULL << order) <= num_pages
+        ) {
+            order++;
         }
-        i++;
+        kmem_free_block(zone, index, order);
+        index += 1ULL << order;
+        num_pages -= 1ULL << order;
+    }
+}
+
+// Allocate from a single zone. Returns NULL if the zone has no large enough free block
+void *kmem_zone_alloc(struct kmem_zone *zone, size_t num_pages, uint8_t order) {
+    // Find the smallest free block that is large enough
+    uint8_t block_order = order;
+    while (block_order <= KMEM_MAX_ORDER && zone->free_lh[block_order].next == &zone->free_lh[block_order]) {
+        block_order++;
+    }
+    if (block_order > KMEM_MAX_ORDER) {
+        return NULL;
+    }
+    struct page *block_page = container_of(zone->free_lh[block_order].next, struct page, free_le);
+    size_t first_page_index = block_page - zone->page_array;
+    kmem_free_block_del(zone, first_page_index);
+
+    // Split the block, returning upper halves to the free lists
+    while (block_order > order) {
+        block_order--;
+        kmem_free_block_add(zone, first_page_index + (1ULL << block_order), block_order);
     }
 
     for (size_t j = first_page_index; j < first_page_index + num_pages; j++) {
-        kmem_page_array[j].status = KPAGE_USED;
+        zone->page_array[j].status = KPAGE_USED;
+        zone->page_array[j].refcount = 1;
+    }
+    // Give back the tail of the block when num_pages is not a power of two
+    if (num_pages < (1ULL << order)) {
+        kmem_free_range(zone, first_page_index + num_pages, (1ULL << order) - num_pages);
     }
+    zone->used_pages += num_pages;
     kmem_used_pages += num_pages;
-    return (void*)kmem_start + (first_page_index << 12);
+    return (void*)zone->start + (first_page_index << 12);
 }
 
-void kpage_free(void *page, size_t num_pages) {
-    size_t first_page_index = (((uint64_t)page) - kmem_start) >> 12;
-    for (size_t j = first_page_index; j < first_page_index + num_pages; j++) {
-        kmem_page_array[j].status = KPAGE_FREE;
+// Like kpage_alloc, but returns NULL instead of panicking when no large enough block is free
+// Blocks of 2^n pages are aligned to 2^n pages in physical memory
+void *kpage_try_alloc(size_t num_pages) {
+    uint8_t order = 0;
+    while ((1ULL << order) < num_pages) {
+        order++;
     }
-    kmem_used_pages -= num_pages;
+    if (order > KMEM_MAX_ORDER) {
+        panic(u8p("kpage_alloc: allocation too large\n"));
+    }
+
+    while (true) {
+        // Fall back across zones in memmap order
+        for (uint32_t i = 0; i < kmem_num_zones; i++) {
+            void *result = kmem_zone_alloc(&kmem_zones[i], num_pages, order);
+            if (result != NULL) {
+                return result;
+            }
+        }
+        // Under memory pressure, give back the pre-zeroed pages, empty slab pages and clean cached file pages,
+        // and try again
+        uint64_t pages_reclaimed = kmem_zero_pool_count;
+        while (kmem_zero_pool_count > 0) {
+            kpage_free(kmem_zero_pool[--kmem_zero_pool_count], 1);
+        }
+        pages_reclaimed += slab_shrink_all();
+        pages_reclaimed += page_cache_shrink();
+        if (pages_reclaimed == 0) {
+            return NULL;
+        }
+    }
+}
+
+void *kpage_alloc(size_t num_pages) {
+    void *result = kpage_try_alloc(num_pages);
+    if (result == NULL) {
+        panic(u8p("Out of physical memory\n"));
+    }
+    return result;
+}
+
+// Allocate a single zeroed page. Takes a page from the zero pool if possible
+void *kpage_alloc_zeroed() {
+    if (kmem_zero_pool_count > 0) {
+        kmem_zero_pool_hits++;
+        return kmem_zero_pool[--kmem_zero_pool_count];
+    }
+    kmem_zero_pool_misses++;
+    void *page = kpage_alloc(1);
+    memset(page, 0, PAGE_SIZE);
+    return page;
 }
 
-void *dpage_alloc(size_t num_pages) {
-    uint64_t mem = dmem_start + dmem_used_pages * PAGE_SIZE;
-    dmem_used_pages += num_pages;
-    return (void*)mem;
+// Fill the zero pool. Called by the idle task
+void kmem_zero_pool_refill() {
+    while (
+        kmem_zero_pool_count < KMEM_ZERO_POOL_PAGES &&
+        kmem_total_pages - kmem_used_pages > KMEM_ZERO_POOL_MIN_FREE_PAGES
+    ) {
+        void *page = kpage_alloc(1);
+        zero_page_nontemporal(page);
+        kmem_zero_pool[kmem_zero_pool_count++] = page;
+    }
+}
+
+// Get the struct page for a page, given its HHDM address
+struct page *kmem_page_of(void *page) {
+    struct kmem_zone *zone = kmem_zone_of(page);
+    if (zone == NULL) {
+        panic(u8p("kmem_page_of: page is not in any zone\n"));
+    }
+    return &zone->page_array[(((uint64_t)page) - zone->start) >> 12];
+}
+
+// Take an additional reference to an allocation. The count is kept on its first page
+void kpage_get(void *page) {
+    kmem_page_of(page)->refcount++;
+}
+
+// Drop a reference to an allocation of num_pages pages, freeing it when the last reference is gone
+void kpage_put(void *page, size_t num_pages) {
+    struct page *p = kmem_page_of(page);
+    if (p->refcount == 0) {
+        panic(u8p("kpage_put: page has no references\n"));
+    }
+    p->refcount--;
+    if (p->refcount == 0) {
+        kpage_free(page, num_pages);
+    }
+}
+
+void kpage_free(void *page, size_t num_pages) {
+    struct kmem_zone *zone = kmem_zone_of(page);
+    if (zone == NULL) {
+        panic(u8p("kpage_free: page is not in any zone\n"));
+    }
+    size_t first_page_index = (((uint64_t)page) - zone->start) >> 12;
+    if (zone->page_array[first_page_index].status != KPAGE_USED) {
+        panic(u8p("kpage_free: page is not in use\n"));
+    }
+    kmem_free_range(zone, first_page_index, num_pages);
+    zone->used_pages -= num_pages;
+    kmem_used_pages -= num_pages;
 }
@@ -2,10 +2,9 @@
 #define KMEM_H
 #include <stdint.h>
 #include <stddef.h>
+#include "lib/list.h"
 
 extern uint64_t hhdm_offset;
-extern uint64_t kmem_start;
-extern uint64_t kmem_length;
 extern uint64_t kmem_total_pages;
 extern uint64_t kmem_used_pages;
 
@@ -18,13 +17,53 @@ extern uint64_t kmem_used_pages;
 // Device memory
 #define KPAGE_DEVICE 0x84
 
+// Largest block handed out by the buddy allocator is 2^KMEM_MAX_ORDER pages
+#define KMEM_MAX_ORDER 10
+// Order of a page that does not head a free block
+#define KPAGE_NO_ORDER 0xFF
+
 struct page {
     uint8_t status;
+    uint8_t order; // For the first page of a free block: order of the block. Otherwise KPAGE_NO_ORDER
+    uint32_t refcount; // Number of page table entries referencing this page. 1 when allocated
+    struct list_head free_le; // Entry in kmem_free_lh[order] (first page of a free block only)
+};
+
+// Maximum number of usable memmap regions that are turned into zones
+#define KMEM_MAX_ZONES 64
+
+// A physically contiguous region of normal memory, managed by its own buddy allocator
+struct kmem_zone {
+    uint64_t start; // HHDM address of the first page
+    uint64_t start_pfn; // Physical frame number of the first page
+    uint64_t total_pages; // Including the pages used for the page array
+    uint64_t used_pages;
+    struct page *page_array;
+    struct list_head free_lh[KMEM_MAX_ORDER + 1]; // Free blocks of each order, linked through struct page
+    uint64_t free_blocks[KMEM_MAX_ORDER + 1]; // Number of free blocks of each order
 };
 
+extern struct kmem_zone kmem_zones[KMEM_MAX_ZONES];
+extern uint32_t kmem_num_zones;
+
+// Pages zeroed ahead of time by the idle task
+#define KMEM_ZERO_POOL_PAGES 64
+// Below this many pages, the idle task is scheduled even if other tasks are runnable
+#define KMEM_ZERO_POOL_LOW_WATERMARK 16
+
+extern uint64_t kmem_zero_pool_count;
+extern uint64_t kmem_zero_pool_hits;
+extern uint64_t kmem_zero_pool_misses;
+
 void kmem_init();
+struct kmem_zone *kmem_zone_of(void *page);
+struct page *kmem_page_of(void *page);
 void *kpage_alloc(size_t num_pages);
+void *kpage_try_alloc(size_t num_pages);
 void kpage_free(void *page, size_t num_pages);
-void *dpage_alloc(size_t num_pages);
+void *kpage_alloc_zeroed();
+void kmem_zero_pool_refill();
+void kpage_get(void *page);
+void kpage_put(void *page, size_t num_pages);
 
 #endif
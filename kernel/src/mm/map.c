@@ -6,38 +6,127 @@
 #include "mm/page.h"
 
 #define PAGE_DIRECTORY_ATTRIBUTES 0x27
-#define PAGE_TABLE_ATTRIBUTES 0xE7
-#define PAGE_TABLE_MMIO_ATTRIBUTES 0xFF
+// Leaf attributes. Bit 7 is left clear: in a 4 KiB PTE it is the PAT bit, and in a PD entry it is the PS bit,
+// which set_huge_page_mapping adds. With the default PAT, PCD and PWT select UC for MMIO
+#define PAGE_TABLE_ATTRIBUTES 0x67
+#define PAGE_TABLE_MMIO_ATTRIBUTES 0x7F
 
-// Must not be used for memory mapped by Limine, because Limine uses 2MB pages which we don't want to deal with
-void set_page_mapping(void *pml4_page, void* virt_address, void* phys_address, bool is_mmio) {
-    if ((uint64_t)phys_address & 4095) {
-        panic(u8p("phys_address must be page-aligned"));
-    }
+// Find the PD entry for virt_address, allocating intermediate page tables as needed
+uint64_t *get_or_create_pde(void *pml4_page, void* virt_address) {
     uint64_t *pml4_entries = pml4_page;
     
     uint64_t *ptpd_entries = (void*)((pml4_entries[((uint64_t)virt_address >> 39) & 0x1FF] & PAGE_ADDRESS_MASK) + hhdm_offset);
     if (ptpd_entries == (void*)hhdm_offset) {
-        ptpd_entries = kpage_alloc(1);
-        memset(ptpd_entries, 0, PAGE_SIZE);
+        ptpd_entries = kpage_alloc_zeroed();
         pml4_entries[((uint64_t)virt_address >> 39) & 0x1FF] = ((uint64_t)ptpd_entries - hhdm_offset) | PAGE_DIRECTORY_ATTRIBUTES;
     }
 
     uint64_t *pd_entries = (void*)((ptpd_entries[((uint64_t)virt_address >> 30) & 0x1FF] & PAGE_ADDRESS_MASK) + hhdm_offset);
     if (pd_entries == (void*)hhdm_offset) {
-        pd_entries = kpage_alloc(1);
-        memset(pd_entries, 0, PAGE_SIZE);
+        pd_entries = kpage_alloc_zeroed();
         ptpd_entries[((uint64_t)virt_address >> 30) & 0x1FF] = ((uint64_t)pd_entries - hhdm_offset) | PAGE_DIRECTORY_ATTRIBUTES;
     }
 
-    uint64_t *pt_entries = (uint64_t*)((pd_entries[((uint64_t)virt_address >> 21) & 0x1FF] & PAGE_ADDRESS_MASK) + hhdm_offset);
+    return &pd_entries[((uint64_t)virt_address >> 21) & 0x1FF];
+}
+
+// Find the page table entry for virt_address, allocating intermediate page tables as needed
+// Must not be used for memory mapped with 2 MiB pages (such as memory mapped by Limine)
+uint64_t *get_or_create_pte(void *pml4_page, void* virt_address) {
+    uint64_t *pd_entry = get_or_create_pde(pml4_page, virt_address);
+    if (*pd_entry & PAGE_HUGE) {
+        panic(u8p("get_or_create_pte: address is mapped with a huge page\n"));
+    }
+
+    uint64_t *pt_entries = (uint64_t*)((*pd_entry & PAGE_ADDRESS_MASK) + hhdm_offset);
     if (pt_entries == (void*)hhdm_offset) {
-        pt_entries = kpage_alloc(1);
-        memset(pt_entries, 0, PAGE_SIZE);
-        pd_entries[((uint64_t)virt_address >> 21) & 0x1FF] = ((uint64_t)pt_entries - hhdm_offset) | PAGE_DIRECTORY_ATTRIBUTES;
+        pt_entries = kpage_alloc_zeroed();
+        *pd_entry = ((uint64_t)pt_entries - hhdm_offset) | PAGE_DIRECTORY_ATTRIBUTES;
+    }
+
+    return &pt_entries[((uint64_t)virt_address >> 12) & 0x1FF];
+}
+
+// Find the page table entry for virt_address without allocating anything
+// If virt_address is mapped with a huge page, returns the PD entry and sets *level_out to 1.
+// Otherwise returns the PT entry and sets *level_out to 0. Bit 7 only means PS at level 1
+// Returns NULL if there is no page table covering virt_address
+uint64_t *find_pte_level(void *pml4_page, void* virt_address, uint8_t *level_out) {
+    uint64_t *pml4_entries = pml4_page;
+    uint64_t pml4_entry = pml4_entries[((uint64_t)virt_address >> 39) & 0x1FF];
+    if ((pml4_entry & PAGE_ADDRESS_MASK) == 0) {
+        return NULL;
+    }
+    uint64_t *ptpd_entries = (void*)((pml4_entry & PAGE_ADDRESS_MASK) + hhdm_offset);
+    uint64_t ptpd_entry = ptpd_entries[((uint64_t)virt_address >> 30) & 0x1FF];
+    if ((ptpd_entry & PAGE_ADDRESS_MASK) == 0) {
+        return NULL;
+    }
+    uint64_t *pd_entries = (void*)((ptpd_entry & PAGE_ADDRESS_MASK) + hhdm_offset);
+    uint64_t *pd_entry = &pd_entries[((uint64_t)virt_address >> 21) & 0x1FF];
+    if (*pd_entry & PAGE_HUGE) {
+        *level_out = 1;
+        return pd_entry;
+    }
+    if ((*pd_entry & PAGE_ADDRESS_MASK) == 0) {
+        return NULL;
+    }
+    uint64_t *pt_entries = (void*)((*pd_entry & PAGE_ADDRESS_MASK) + hhdm_offset);
+    *level_out = 0;
+    return &pt_entries[((uint64_t)virt_address >> 12) & 0x1FF];
+}
+
+// As find_pte_level, for callers that do not need the level
+uint64_t *find_pte(void *pml4_page, void* virt_address) {
+    uint8_t level;
+    return find_pte_level(pml4_page, virt_address, &level);
+}
+
+// Must not be used for memory mapped with 2 MiB pages (such as memory mapped by Limine)
+void set_page_mapping(void *pml4_page, void* virt_address, void* phys_address, bool is_mmio) {
+    if ((uint64_t)phys_address & 4095) {
+        panic(u8p("phys_address must be page-aligned"));
     }
+    uint64_t *pte = get_or_create_pte(pml4_page, virt_address);
+    *pte = ((uint64_t)phys_address) | (
+        is_mmio ? PAGE_TABLE_MMIO_ATTRIBUTES : PAGE_TABLE_ATTRIBUTES
+    );
+}
 
-    pt_entries[((uint64_t)virt_address >> 12) & 0x1FF] = ((uint64_t)phys_address) | (
+// Map a 2 MiB page. The PD entry for virt_address must not point to a page table
+void set_huge_page_mapping(void *pml4_page, void* virt_address, void* phys_address, bool is_mmio) {
+    if (((uint64_t)phys_address | (uint64_t)virt_address) & (HUGE_PAGE_SIZE - 1)) {
+        panic(u8p("huge page mapping must be 2 MiB aligned"));
+    }
+    uint64_t *pd_entry = get_or_create_pde(pml4_page, virt_address);
+    if ((*pd_entry & PAGE_PRESENT) && !(*pd_entry & PAGE_HUGE)) {
+        panic(u8p("set_huge_page_mapping: address is already mapped with a page table\n"));
+    }
+    *pd_entry = ((uint64_t)phys_address) | PAGE_HUGE | (
         is_mmio ? PAGE_TABLE_MMIO_ATTRIBUTES : PAGE_TABLE_ATTRIBUTES
     );
 }
+
+// Point a PD entry at a page table, replacing whatever it mapped
+void set_page_table_mapping(uint64_t *pd_entry, uint64_t *pt_entries) {
+    *pd_entry = ((uint64_t)pt_entries - hhdm_offset) | PAGE_DIRECTORY_ATTRIBUTES;
+}
+
+// Map a device memory range, using 2 MiB pages wherever virtual and physical addresses are both aligned
+void map_mmio_range(void *pml4_page, void* virt_address, void* phys_address, size_t length) {
+    void *virt_end = virt_address + length;
+    while (virt_address < virt_end) {
+        if (
+            !(((uint64_t)virt_address | (uint64_t)phys_address) & (HUGE_PAGE_SIZE - 1)) &&
+            virt_end - virt_address >= HUGE_PAGE_SIZE
+        ) {
+            set_huge_page_mapping(pml4_page, virt_address, phys_address, true);
+            virt_address += HUGE_PAGE_SIZE;
+            phys_address += HUGE_PAGE_SIZE;
+        } else {
+            set_page_mapping(pml4_page, virt_address, phys_address, true);
+            virt_address += PAGE_SIZE;
+            phys_address += PAGE_SIZE;
+        }
+    }
+}
@@ -1,6 +1,15 @@
 #ifndef MAP_H
 #define MAP_H
+#include <stdint.h>
+#include <stddef.h>
 
 void set_page_mapping(void *pml4_page, void* virt_address, void* phys_address, bool is_mmio);
+void set_huge_page_mapping(void *pml4_page, void* virt_address, void* phys_address, bool is_mmio);
+void set_page_table_mapping(uint64_t *pd_entry, uint64_t *pt_entries);
+void map_mmio_range(void *pml4_page, void* virt_address, void* phys_address, size_t length);
+uint64_t *get_or_create_pde(void *pml4_page, void* virt_address);
+uint64_t *get_or_create_pte(void *pml4_page, void* virt_address);
+uint64_t *find_pte_level(void *pml4_page, void* virt_address, uint8_t *level_out);
+uint64_t *find_pte(void *pml4_page, void* virt_address);
 
 #endif
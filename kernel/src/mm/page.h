@@ -4,5 +4,15 @@
 #define PAGE_ADDRESS_MASK 0xFFFFFFFFFFFFF000
 #define PAGE_OFFSET_MASK 0xFFF
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE 0x200000
+#define HUGE_PAGE_PAGES 512
+
+// Page table entry bits
+#define PAGE_PRESENT 0x1
+#define PAGE_WRITABLE 0x2
+#define PAGE_USER 0x4
+#define PAGE_DIRTY 0x40 // Set by the CPU on the first write through the entry
+#define PAGE_HUGE 0x80 // PS bit in a PD entry: the entry maps a 2 MiB page instead of pointing to a PT
+#define PAGE_COW 0x200 // Available to software. Set on read-only PTEs that must be copied on write
 
 #endif
@@ -0,0 +1,192 @@
+#include "drivers/tty.h"
+#include "fs/elf.h"
+#include "fs/vfs.h"
+#include "lib/cstd.h"
+#include "mm/kmem.h"
+#include "mm/page.h"
+#include "mm/pagecache.h"
+#include "mm/slab.h"
+
+struct slab_allocator page_cache_entry_allocator = SLAB_OF(struct page_cache_entry);
+struct page_cache_stats page_cache_stats;
+static struct list_head page_cache_lru;
+
+void page_cache_init() {
+    slab_allocator_init(&page_cache_entry_allocator);
+    init_list(&page_cache_lru);
+}
+
+static void page_cache_remove_entry(struct page_cache_entry *entry) {
+    rb_erase(&entry->page_cache_node, &entry->inode->page_cache_tree);
+    list_del(&entry->lru_node);
+    kpage_put(entry->page, 1);
+    page_cache_entry_free(entry);
+    page_cache_stats.pages--;
+}
+
+static struct page_cache_entry *page_cache_find_entry(struct inode *inode, uint64_t index) {
+    struct rb_node *node = inode->page_cache_tree.node;
+    while (node != NULL) {
+        struct page_cache_entry *entry = rb_entry(node, struct page_cache_entry, page_cache_node);
+        if (index == entry->index) {
+            return entry;
+        }
+        node = index < entry->index ? node->left : node->right;
+    }
+    return NULL;
+}
+
+// Returns the cached page at index of inode, or NULL if it is not cached
+void *page_cache_find(struct inode *inode, uint64_t index) {
+    struct page_cache_entry *entry = page_cache_find_entry(inode, index);
+    return entry ? entry->page : NULL;
+}
+
+// Returns the page at index of inode, reading it from the filesystem if it is not cached yet
+// The page stays owned by the cache and may be evicted by any allocation once it is clean and unmapped,
+// so callers take their own reference before allocating
+// Returns NULL if index is past the end of the file or the filesystem read fails
+void *page_cache_get(struct inode *inode, uint64_t index, bool *read_from_file_out) {
+    *read_from_file_out = false;
+    struct page_cache_entry *entry = page_cache_find_entry(inode, index);
+    if (entry != NULL) {
+        list_del(&entry->lru_node);
+        list_add_tail(&entry->lru_node, &page_cache_lru);
+        page_cache_stats.hits++;
+        return entry->page;
+    }
+    if (index * PAGE_SIZE >= inode->file_length) {
+        return NULL;
+    }
+
+    // Read straight into the page that gets mapped. exFAT reads of aligned clusters go directly from NVMe into it
+    void *page = kpage_alloc_zeroed();
+    struct file page_file = {
+        .inode = inode,
+        .offset = index * PAGE_SIZE,
+    };
+    size_t length = inode->file_length - page_file.offset < PAGE_SIZE ? inode->file_length - page_file.offset : PAGE_SIZE;
+    ssize_t bytes_read = inode->superblock->ops->read(&page_file, page, length);
+    if (bytes_read < 0) {
+        kpage_free(page, 1);
+        return NULL;
+    }
+    entry = page_cache_entry_alloc();
+
+    // The allocations and the read above may have evicted or inserted pages, so look up the link afterwards
+    struct rb_node **link = &inode->page_cache_tree.node;
+    struct rb_node *parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        struct page_cache_entry *other = rb_entry(parent, struct page_cache_entry, page_cache_node);
+        if (index == other->index) {
+            // Read in meanwhile by another task
+            page_cache_entry_free(entry);
+            kpage_free(page, 1);
+            page_cache_stats.hits++;
+            return other->page;
+        }
+        link = index < other->index ? &parent->left : &parent->right;
+    }
+    entry->index = index;
+    entry->page = page;
+    entry->dirty = false;
+    entry->inode = inode;
+    rb_link_node(&entry->page_cache_node, parent, link);
+    rb_insert_color(&entry->page_cache_node, &inode->page_cache_tree);
+    list_add_tail(&entry->lru_node, &page_cache_lru);
+    page_cache_stats.pages++;
+    page_cache_stats.misses++;
+    *read_from_file_out = true;
+    return page;
+}
+
+void page_cache_mark_dirty(struct inode *inode, uint64_t index) {
+    struct page_cache_entry *entry = page_cache_find_entry(inode, index);
+    if (entry != NULL) {
+        entry->dirty = true;
+    }
+}
+
+// Write the dirty pages of inode back to its filesystem. Pages are never written past the end of the file
+void page_cache_writeback(struct inode *inode) {
+    for (struct rb_node *node = rb_first(&inode->page_cache_tree); node != NULL; node = rb_next(node)) {
+        struct page_cache_entry *entry = rb_entry(node, struct page_cache_entry, page_cache_node);
+        if (!entry->dirty) {
+            continue;
+        }
+        entry->dirty = false;
+        struct file page_file = {
+            .inode = inode,
+            .offset = entry->index * PAGE_SIZE,
+        };
+        if (page_file.offset >= inode->file_length) {
+            continue;
+        }
+        size_t length = inode->file_length - page_file.offset < PAGE_SIZE ? inode->file_length - page_file.offset : PAGE_SIZE;
+        kpage_get(entry->page); // Now clean, so keep it from being evicted by allocations during the write
+        inode->superblock->ops->write(&page_file, entry->page, length);
+        kpage_put(entry->page, 1);
+        elf_image_invalidate(inode);
+        page_cache_stats.writebacks++;
+    }
+}
+
+// Copy data written through write() into the cached pages it overlaps, so that mappings see it
+void page_cache_update(struct inode *inode, uint64_t offset, void *buffer, size_t length) {
+    uint64_t end = offset + length;
+    while (offset < end) {
+        uint64_t page_offset = offset & PAGE_OFFSET_MASK;
+        size_t chunk_length = end - offset < PAGE_SIZE - page_offset ? end - offset : PAGE_SIZE - page_offset;
+        void *page = page_cache_find(inode, offset / PAGE_SIZE);
+        if (page != NULL) {
+            kpage_get(page); // Faulting in the user buffer may allocate, which could otherwise evict the page
+            memcpy(page + page_offset, buffer, chunk_length);
+            kpage_put(page, 1);
+        }
+        buffer += chunk_length;
+        offset += chunk_length;
+    }
+}
+
+// The file was resized to size bytes. Cached bytes past the end are zeroed, and pages past the end
+// that are not mapped anywhere are dropped
+void page_cache_truncate(struct inode *inode, size_t size) {
+    struct rb_node *node = rb_first(&inode->page_cache_tree);
+    while (node != NULL) {
+        struct page_cache_entry *entry = rb_entry(node, struct page_cache_entry, page_cache_node);
+        node = rb_next(node);
+        uint64_t page_start = entry->index * PAGE_SIZE;
+        if (page_start + PAGE_SIZE <= size) {
+            continue;
+        }
+        if (page_start >= size && kmem_page_of(entry->page)->refcount == 1) {
+            page_cache_remove_entry(entry);
+            continue;
+        }
+        size_t zero_start = size > page_start ? size - page_start : 0;
+        memset(entry->page + zero_start, 0, PAGE_SIZE - zero_start);
+        if (page_start >= size) {
+            // Nothing of it is written back anymore. A partially kept page keeps its dirty bytes
+            entry->dirty = false;
+        }
+    }
+}
+
+// Drop clean cached pages that are not mapped anywhere, least recently used first
+// Called under memory pressure. Returns the number of pages freed
+uint64_t page_cache_shrink() {
+    uint64_t pages_freed = 0;
+    struct list_head *node = page_cache_lru.next;
+    while (node != &page_cache_lru) {
+        struct page_cache_entry *entry = container_of(node, struct page_cache_entry, lru_node);
+        node = node->next;
+        if (entry->dirty || kmem_page_of(entry->page)->refcount != 1) {
+            continue;
+        }
+        page_cache_remove_entry(entry);
+        page_cache_stats.evictions++;
+        pages_freed++;
+    }
+    return pages_freed;
+}
@@ -0,0 +1,45 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "lib/list.h"
+#include "lib/rbtree.h"
+#include "mm/slab.h"
+
+struct inode;
+
+// A page of a regular file, shared by every mapping of that page. The cache holds one reference to the page
+struct page_cache_entry {
+    uint64_t index; // Page index in the file
+    void *page; // HHDM address. Bytes past the end of the file are zero
+    bool dirty; // Modified through a shared mapping and not yet written back
+    struct rb_node page_cache_node; // In inode.page_cache_tree, ordered by index
+    struct inode *inode;
+    struct list_head lru_node; // In page_cache_lru, least recently used first
+};
+
+extern struct slab_allocator page_cache_entry_allocator;
+#define page_cache_entry_alloc() slab_alloc(&page_cache_entry_allocator)
+#define page_cache_entry_free(x) slab_free(&page_cache_entry_allocator, x)
+
+// Counters exposed in /sys/vmstat
+struct page_cache_stats {
+    uint64_t pages; // Pages currently cached
+    uint64_t hits;
+    uint64_t misses; // Pages read from the filesystem
+    uint64_t writebacks; // Dirty pages written back to the filesystem
+    uint64_t evictions; // Clean, unmapped pages dropped under memory pressure
+};
+extern struct page_cache_stats page_cache_stats;
+
+void page_cache_init();
+void *page_cache_find(struct inode *inode, uint64_t index);
+void *page_cache_get(struct inode *inode, uint64_t index, bool *read_from_file_out);
+void page_cache_mark_dirty(struct inode *inode, uint64_t index);
+void page_cache_writeback(struct inode *inode);
+void page_cache_update(struct inode *inode, uint64_t offset, void *buffer, size_t length);
+void page_cache_truncate(struct inode *inode, size_t size);
+uint64_t page_cache_shrink();
+
+#endif
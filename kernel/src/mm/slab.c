@@ -7,71 +7,78 @@
 #include "lib/cstd.h"
 #include "lib/list.h"
 
-// Try allocating on existing page, return NULL if failed
-void *slab_try_alloc(struct slab_allocator *allocator) {
-    for (
-        struct list_head *page_le = allocator->slab_page_lh.next;
-        page_le != &allocator->slab_page_lh;
-        page_le = page_le->next
-    ) {
-        struct slab_page_header *header = container_of(page_le, struct slab_page_header, slab_page_le);
-        // Performance optimization: quickly detect completely full pages
-        if (
-            header->free_bitmaps[0] == 0 &&
-            header->free_bitmaps[1] == 0 &&
-            header->free_bitmaps[2] == 0 &&
-            header->free_bitmaps[3] == 0
-        ) {
-            continue;
-        }
-        for (uint8_t i = 0; i < 4; i++) {
-            for (uint8_t j = 0; j < 64; j++) {
-                if ((header->free_bitmaps[i] >> j) & 0x1) {
-                    uint8_t slot_number = ((i << 6) + j);
-                    header->free_bitmaps[i] ^= (1LL << j);
-                    return (void*)header + sizeof(struct slab_page_header) + slot_number * allocator->object_size;
-                }
-            }
+#define SLAB_BITMAP_WORDS 4
+#define SLAB_MAX_OBJECTS_PER_PAGE (SLAB_BITMAP_WORDS * 64)
+
+ct_assert(sizeof(struct slab_magazine) * MAX_CPUS <= PAGE_SIZE);
+
+struct list_head slab_allocators_lh = { .prev = &slab_allocators_lh, .next = &slab_allocators_lh };
+
+static bool slab_list_empty(struct list_head *lh) {
+    return lh->next == lh;
+}
+
+static void slab_page_move(struct slab_page_header *header, struct list_head *lh) {
+    list_del(&header->slab_page_le);
+    list_add(&header->slab_page_le, lh);
+}
+
+// Take a free slot from a page that has at least one
+static void *slab_page_take_slot(struct slab_allocator *allocator, struct slab_page_header *header) {
+    for (uint8_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        if (header->free_bitmaps[i] != 0) {
+            uint8_t j = __builtin_ctzll(header->free_bitmaps[i]); // Lowest free slot in this word
+            uint16_t slot_number = (i << 6) + j;
+            header->free_bitmaps[i] &= ~(1ULL << j);
+            header->free_count--;
+            return (void*)header + sizeof(struct slab_page_header) + slot_number * allocator->object_size;
         }
     }
+    panic(u8p("Slab page has no free slot"));
     return NULL;
 }
 
-void* slab_alloc(struct slab_allocator *allocator) {
-    void* address = slab_try_alloc(allocator);
-    if (address){
-        goto finalize;
-    }
-    // No free slots found on any page, time to allocate a new page
-    struct slab_page_header *new_header = kpage_alloc(1);
-    memset(new_header, 0, PAGE_SIZE);
-    list_add(&new_header->slab_page_le, &allocator->slab_page_lh);
-    for (uint8_t i = 0; i < 4; i++) {
-        for (uint8_t j = 0; j < 64; j++) {
-            uint8_t slot_number = ((i << 6) + j);
-            if (slot_number >= allocator->objects_per_page) {
-                goto no_more_slots;
-            }
-            new_header->free_bitmaps[i] |= (1LL << j);
-        }
+static struct slab_page_header *slab_page_new(struct slab_allocator *allocator) {
+    struct slab_page_header *new_header = kpage_alloc_zeroed();
+    new_header->allocator = allocator;
+    for (uint16_t slot_number = 0; slot_number < allocator->objects_per_page; slot_number++) {
+        new_header->free_bitmaps[slot_number >> 6] |= (1ULL << (slot_number & 63));
     }
-    
-    no_more_slots:
-    // Allocation will now surely succeed
-    address = slab_try_alloc(allocator);
-    if (!address) {
-        panic(u8p("Slab allocation unexpectedly failed"));
+    new_header->free_count = allocator->objects_per_page;
+    list_add(&new_header->slab_page_le, &allocator->empty_lh);
+    allocator->empty_count++;
+    allocator->total_pages++;
+    return new_header;
+}
+
+// Take an object from the page lists, bypassing the magazines
+static void *slab_alloc_from_pages(struct slab_allocator *allocator) {
+    struct slab_page_header *header;
+    if (!slab_list_empty(&allocator->partial_lh)) {
+        header = container_of(allocator->partial_lh.next, struct slab_page_header, slab_page_le);
+    } else {
+        if (slab_list_empty(&allocator->empty_lh)) {
+            // No free slots on any page, time to allocate a new page
+            slab_page_new(allocator);
+        }
+        header = container_of(allocator->empty_lh.next, struct slab_page_header, slab_page_le);
+        slab_page_move(header, &allocator->partial_lh);
+        allocator->empty_count--;
     }
 
-    finalize:
+    void *address = slab_page_take_slot(allocator, header);
+    if (header->free_count == 0) {
+        slab_page_move(header, &allocator->full_lh);
+    }
+    allocator->active_objects++;
     // allocator->allocated_objects++; // For debugging
     // memset(address, 0x11, allocator->object_size); // For debugging
     return address;
 }
 
-void slab_free(struct slab_allocator *allocator, void* address) {
-    // allocator->freed_objects++; // For debugging
-    // memset(address, 0x50, allocator->object_size); // For debugging
+// Panic if address is not an object slot, or if its slot is already free in the page
+// Returns the slot number
+static uint16_t slab_check_free(struct slab_allocator *allocator, void* address) {
     struct slab_page_header *page_header = (void*)((uint64_t)address & 0xFFFFFFFFFFFFF000);
     uint16_t page_offset = (address - sizeof(struct slab_page_header) - (void*)page_header);
     uint16_t slot_number =  page_offset / allocator->object_size;
@@ -79,11 +86,185 @@ void slab_free(struct slab_allocator *allocator, void* address) {
     if (slot_offset != 0) {
         panic(u8p("invalid slab free"));
     }
+    if ((page_header->free_bitmaps[slot_number >> 6] >> (slot_number % 64)) & 0x1) {
+        panic(u8p("double slab free"));
+    }
+    return slot_number;
+}
+
+// Return an object to the page lists, bypassing the magazines
+static void slab_free_to_pages(struct slab_allocator *allocator, void* address) {
+    struct slab_page_header *page_header = (void*)((uint64_t)address & 0xFFFFFFFFFFFFF000);
+    uint16_t slot_number = slab_check_free(allocator, address);
     uint8_t slot_number_div64 = slot_number >> 6;
     uint8_t slot_number_mod64 = slot_number % 64;
-    page_header->free_bitmaps[slot_number_div64] |= (1LL << slot_number_mod64);
+    page_header->free_bitmaps[slot_number_div64] |= (1ULL << slot_number_mod64);
+    page_header->free_count++;
+    allocator->active_objects--;
+
+    if (page_header->free_count == allocator->objects_per_page) {
+        if (allocator->empty_count >= allocator->empty_reserve) {
+            // Reserve is full. Give the page back
+            list_del(&page_header->slab_page_le);
+            allocator->total_pages--;
+            kpage_free(page_header, 1);
+        } else {
+            slab_page_move(page_header, &allocator->empty_lh);
+            allocator->empty_count++;
+        }
+    } else if (page_header->free_count == 1) {
+        // Page was full
+        slab_page_move(page_header, &allocator->partial_lh);
+    }
+}
+
+void* slab_alloc(struct slab_allocator *allocator) {
+    // The magazine of this CPU needs no lock, only protection from interrupt handlers and migration
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    void *address;
+    if (allocator->magazine_size == 0) {
+        spin_lock(&allocator->lock);
+        address = slab_alloc_from_pages(allocator);
+        spin_unlock(&allocator->lock);
+    } else {
+        struct slab_magazine *magazine = &allocator->magazines[cpu_id()];
+        if (magazine->count == 0) {
+            // Refill half of the magazine in one go
+            spin_lock(&allocator->lock);
+            while (magazine->count < (uint64_t)(allocator->magazine_size + 1) / 2) {
+                magazine->objects[magazine->count++] = slab_alloc_from_pages(allocator);
+            }
+            spin_unlock(&allocator->lock);
+        }
+        address = magazine->objects[--magazine->count];
+    }
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+    // allocator->allocated_objects++; // For debugging
+    // memset(address, 0x11, allocator->object_size); // For debugging
+    return address;
+}
+
+void slab_free(struct slab_allocator *allocator, void* address) {
+    // allocator->freed_objects++; // For debugging
+    // memset(address, 0x50, allocator->object_size); // For debugging
+    struct slab_page_header *page_header = (void*)((uint64_t)address & 0xFFFFFFFFFFFFF000);
+    if (page_header->allocator != allocator) {
+        panic(u8p("slab free to wrong allocator"));
+    }
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    if (allocator->magazine_size == 0) {
+        spin_lock(&allocator->lock);
+        slab_free_to_pages(allocator, address);
+        spin_unlock(&allocator->lock);
+    } else {
+        struct slab_magazine *magazine = &allocator->magazines[cpu_id()];
+        // Objects in a magazine still look allocated in their page, so also look for them in this magazine.
+        // A double free across CPUs is caught once the first copy is flushed to the pages
+        slab_check_free(allocator, address);
+        for (uint64_t i = 0; i < magazine->count; i++) {
+            if (magazine->objects[i] == address) {
+                panic(u8p("double slab free"));
+            }
+        }
+        if (magazine->count == allocator->magazine_size) {
+            // Flush the older half of the magazine in one go
+            uint64_t flush_count = (allocator->magazine_size + 1) / 2;
+            spin_lock(&allocator->lock);
+            for (uint64_t i = 0; i < flush_count; i++) {
+                slab_free_to_pages(allocator, magazine->objects[i]);
+            }
+            spin_unlock(&allocator->lock);
+            magazine->count -= flush_count;
+            memmove(magazine->objects, magazine->objects + flush_count, magazine->count * sizeof(void*));
+        }
+        magazine->objects[magazine->count++] = address;
+    }
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+}
+
+// Number of free objects held in the magazines of all CPUs
+uint64_t slab_magazine_objects(struct slab_allocator *allocator) {
+    uint64_t objects = 0;
+    if (allocator->magazine_size != 0) {
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            objects += allocator->magazines[cpu].count;
+        }
+    }
+    return objects;
+}
+
+// Return all empty pages of a cache, including its reserve, to the page allocator
+// Returns the number of pages freed. Skips the cache if its lock is taken, which happens when
+// the page allocator reclaims memory for a page that the cache itself is allocating
+uint64_t slab_shrink(struct slab_allocator *allocator) {
+    bool interrupts_enabled = are_interrupts_enabled();
+    asm volatile ("cli");
+    if (!spin_trylock(&allocator->lock)) {
+        if (interrupts_enabled) {
+            asm volatile ("sti");
+        }
+        return 0;
+    }
+    if (allocator->magazine_size != 0) {
+        // Empty the magazines first, so that their objects can free up pages. The magazines of other CPUs
+        // are not in use meanwhile, since kernel code runs under the big kernel lock
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            struct slab_magazine *magazine = &allocator->magazines[cpu];
+            while (magazine->count > 0) {
+                slab_free_to_pages(allocator, magazine->objects[--magazine->count]);
+            }
+        }
+    }
+    uint64_t pages_freed = 0;
+    while (!slab_list_empty(&allocator->empty_lh)) {
+        struct slab_page_header *header = container_of(allocator->empty_lh.next, struct slab_page_header, slab_page_le);
+        list_del(&header->slab_page_le);
+        kpage_free(header, 1);
+        pages_freed++;
+    }
+    allocator->empty_count = 0;
+    allocator->total_pages -= pages_freed;
+    spin_unlock(&allocator->lock);
+    if (interrupts_enabled) {
+        asm volatile ("sti");
+    }
+    return pages_freed;
+}
+
+// Shrink every cache. Called by the page allocator under memory pressure. Must not allocate
+uint64_t slab_shrink_all() {
+    uint64_t pages_freed = 0;
+    list_for_each(slab_allocators_le, slab_allocators_lh) {
+        struct slab_allocator *allocator = container_of(slab_allocators_le, struct slab_allocator, slab_allocators_le);
+        pages_freed += slab_shrink(allocator);
+    }
+    return pages_freed;
 }
 
 void slab_allocator_init(struct slab_allocator *allocator) {
-    init_list(&allocator->slab_page_lh);
+    if (allocator->objects_per_page > SLAB_MAX_OBJECTS_PER_PAGE) {
+        // Limited by the size of the free bitmap
+        allocator->objects_per_page = SLAB_MAX_OBJECTS_PER_PAGE;
+    }
+    if (allocator->magazine_size > SLAB_MAGAZINE_MAX_SIZE) {
+        allocator->magazine_size = SLAB_MAGAZINE_MAX_SIZE;
+    }
+    allocator->magazines = NULL;
+    if (allocator->magazine_size != 0) {
+        allocator->magazines = kpage_alloc_zeroed();
+    }
+    init_list(&allocator->partial_lh);
+    init_list(&allocator->full_lh);
+    init_list(&allocator->empty_lh);
+    allocator->empty_count = 0;
+    allocator->total_pages = 0;
+    allocator->active_objects = 0;
+    spin_lock_init(&allocator->lock, allocator->name);
+    list_add_tail(&allocator->slab_allocators_le, &slab_allocators_lh);
 }
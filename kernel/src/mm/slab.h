@@ -1,27 +1,62 @@
 #ifndef SLAB_H
 #define SLAB_H
 #include <stdint.h>
+#include "arch/cpu.h"
 #include "lib/list.h"
+#include "lib/spinlock.h"
+
+// Largest magazine. Sized so that the magazines of all CPUs fit in one page
+#define SLAB_MAGAZINE_MAX_SIZE 31
+
+// Per-CPU stack of free objects in front of the page lists
+struct slab_magazine {
+    uint64_t count;
+    void *objects[SLAB_MAGAZINE_MAX_SIZE];
+};
 
 struct slab_allocator {
+    uint8_t *name;
     uint16_t object_size;
     uint16_t objects_per_page;
-    struct list_head slab_page_lh;
+    uint16_t empty_reserve; // Empty pages kept for reuse. Further empty pages are returned to kpage_free
+    uint16_t empty_count;
+    uint16_t magazine_size; // Objects cached per CPU. 0 disables magazines
+    struct slab_magazine *magazines; // One per CPU. Accessed with interrupts disabled
+    struct spinlock lock; // Protects the page lists and counters below. Taken with interrupts disabled
+    uint64_t total_pages;
+    uint64_t active_objects;
+    struct list_head slab_allocators_le; // Entry in slab_allocators_lh
+    struct list_head partial_lh; // Pages with both free and used slots
+    struct list_head full_lh; // Pages with no free slots
+    struct list_head empty_lh; // Pages with no used slots
 };
 
 struct slab_page_header {
+    struct slab_allocator *allocator; // Owner of this page
     uint64_t free_bitmaps[4]; // 1 for free
-    struct list_head slab_page_le;
+    struct list_head slab_page_le; // Entry in one of the page lists of the allocator
+    uint16_t free_count;
 };
 
+extern struct list_head slab_allocators_lh;
+
 void* slab_alloc(struct slab_allocator *allocator);
 void slab_free(struct slab_allocator *allocator, void* address);
+uint64_t slab_shrink(struct slab_allocator *allocator);
+uint64_t slab_shrink_all();
+uint64_t slab_magazine_objects(struct slab_allocator *allocator);
 
 #define SLAB_AVAILABLE_PAGESIZE (4096 - sizeof(struct slab_page_header))
 
+#define SLAB_DEFAULT_EMPTY_RESERVE 1
+#define SLAB_DEFAULT_MAGAZINE_SIZE 8
+
 #define SLAB_OF(t) { \
+    .name = (uint8_t*)#t, \
     .object_size = sizeof(t), \
     .objects_per_page = SLAB_AVAILABLE_PAGESIZE / sizeof(t), \
+    .empty_reserve = SLAB_DEFAULT_EMPTY_RESERVE, \
+    .magazine_size = SLAB_DEFAULT_MAGAZINE_SIZE, \
 };
 
 void slab_allocator_init(struct slab_allocator *allocator);
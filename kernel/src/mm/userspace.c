@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include "arch/asm.h"
 #include "arch/gdt.h"
+#include "drivers/tty.h"
 #include "fs/elf.h"
 #include "fs/tar.h"
 #include "fs/vfs.h"
@@ -11,127 +12,642 @@
 #include "mm/kmem.h"
 #include "mm/map.h"
 #include "mm/page.h"
+#include "mm/pagecache.h"
 #include "mm/slab.h"
 #include "mm/userspace.h"
 
 
 struct slab_allocator userspace_memory_range_allocator = SLAB_OF(struct userspace_memory_range);
+struct vmstat vmstat;
+void *zero_page; // Always zero. Mapped read-only wherever untouched anonymous memory is read
 
 void userspace_init() {
     slab_allocator_init(&userspace_memory_range_allocator);
+    zero_page = kpage_alloc(1);
+    memset(zero_page, 0, PAGE_SIZE);
 }
 
 // Given process->pml4_page is already set up, map a userspace page
 void* map_user_page(struct task_struct *process, void* user_space_address) {
-    void *kernel_space_address = kpage_alloc(1);
-    memset(kernel_space_address, 0, PAGE_SIZE);
+    void *kernel_space_address = kpage_alloc_zeroed();
     set_page_mapping(process->pml4_page, user_space_address, kernel_space_address - hhdm_offset, false);
     return kernel_space_address;
 }
 
-// Must be called after setup_kernelspace_memory
-void setup_userspace_memory(struct task_struct *process) {
-    struct list_head *memory_ranges_lh = &process->memory_ranges_lh;
-    for (
-        struct list_head *memory_ranges_le = memory_ranges_lh->next;
-        memory_ranges_le != memory_ranges_lh;
-        memory_ranges_le = memory_ranges_le->next
-    ) {
-        struct userspace_memory_range *range = container_of(memory_ranges_le, struct userspace_memory_range, memory_ranges_le);
-        for (void* page_address = (void*)(range->start & PAGE_ADDRESS_MASK); page_address < (void*)range->end; page_address += 0x1000) {
-            map_user_page(process, page_address);
+// Map a zeroed 2 MiB page around fault_address if the aligned 2 MiB block lies entirely inside a heap range
+// and nothing in it is mapped yet. Returns false if a 4 KiB page should be mapped instead
+bool try_map_user_huge_page(struct task_struct *process, struct userspace_memory_range *range, uint64_t fault_address) {
+    uint64_t block_start = fault_address & ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+    if (range->type != USERSPACE_MEMRANGE_HEAP && range->type != USERSPACE_MEMRANGE_ANONYMOUS) {
+        return false;
+    }
+    if (block_start < range->start || block_start + HUGE_PAGE_SIZE > range->end) {
+        return false;
+    }
+    uint64_t *pd_entry = get_or_create_pde(process->pml4_page, (void*)block_start);
+    if (*pd_entry & PAGE_PRESENT) {
+        // Already covered by a page table
+        return false;
+    }
+    void *huge_page = kpage_try_alloc(HUGE_PAGE_PAGES); // 2 MiB aligned because the buddy allocator aligns blocks
+    if (huge_page == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+        zero_page_nontemporal(huge_page + i * PAGE_SIZE);
+    }
+    set_huge_page_mapping(process->pml4_page, (void*)block_start, huge_page - hhdm_offset, false);
+    return true;
+}
+
+// Insert range into the tree of process. The range must not overlap existing ranges
+void insert_userspace_memory_range(struct task_struct *process, struct userspace_memory_range *range) {
+    struct rb_node **link = &process->memory_ranges_tree.node;
+    struct rb_node *parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        struct userspace_memory_range *candidate = rb_entry(parent, struct userspace_memory_range, memory_ranges_node);
+        link = range->start < candidate->start ? &parent->left : &parent->right;
+    }
+    rb_link_node(&range->memory_ranges_node, parent, link);
+    rb_insert_color(&range->memory_ranges_node, &process->memory_ranges_tree);
+}
+
+// Find the first range of process that ends after address. Returns NULL if there is none
+static struct userspace_memory_range *find_userspace_memory_range_ending_after(struct task_struct *process, uint64_t address) {
+    struct rb_node *node = process->memory_ranges_tree.node;
+    struct userspace_memory_range *result = NULL;
+    while (node != NULL) {
+        struct userspace_memory_range *candidate = rb_entry(node, struct userspace_memory_range, memory_ranges_node);
+        if (candidate->end > address) {
+            result = candidate;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return result;
+}
+
+// Find the memory range of process that contains address. Returns NULL if there is none
+struct userspace_memory_range *find_userspace_memory_range(struct task_struct *process, uint64_t address) {
+    struct userspace_memory_range *range = find_userspace_memory_range_ending_after(process, address);
+    if (range == NULL || address < (range->start & PAGE_ADDRESS_MASK)) {
+        return NULL;
+    }
+    return range;
+}
+
+// Split range at a page aligned address strictly inside it. Returns the new range covering [address, end)
+struct userspace_memory_range *userspace_memory_range_split(struct task_struct *process, struct userspace_memory_range *range, uint64_t address) {
+    if ((address & PAGE_OFFSET_MASK) || address <= range->start || address >= range->end) {
+        panic(u8p("userspace_memory_range_split: bad address\n"));
+    }
+    struct userspace_memory_range *upper = userspace_memory_range_alloc();
+    upper->start = address;
+    upper->end = range->end;
+    upper->type = range->type;
+    upper->inode = range->inode;
+    upper->file_offset = range->file_offset + (address - (range->start & PAGE_ADDRESS_MASK));
+    range->end = address;
+    insert_userspace_memory_range(process, upper);
+    return upper;
+}
+
+// Adjacent ranges can be merged if they are equivalent except for their bounds
+// The heap and the stack each have a single range
+static bool userspace_memory_ranges_mergeable(struct userspace_memory_range *lower, struct userspace_memory_range *upper) {
+    return lower->end == upper->start &&
+        lower->type == upper->type &&
+        lower->inode == upper->inode &&
+        (lower->inode == NULL || lower->file_offset + (lower->end - (lower->start & PAGE_ADDRESS_MASK)) == upper->file_offset) &&
+        lower->type != USERSPACE_MEMRANGE_HEAP &&
+        lower->type != USERSPACE_MEMRANGE_STACK;
+}
+
+// Merge range with its neighbours where possible. Returns the range that now covers range
+struct userspace_memory_range *userspace_memory_range_merge(struct task_struct *process, struct userspace_memory_range *range) {
+    struct rb_node *next_node = rb_next(&range->memory_ranges_node);
+    if (next_node != NULL) {
+        struct userspace_memory_range *next = rb_entry(next_node, struct userspace_memory_range, memory_ranges_node);
+        if (userspace_memory_ranges_mergeable(range, next)) {
+            range->end = next->end;
+            rb_erase(next_node, &process->memory_ranges_tree);
+            userspace_memory_range_free(next);
+        }
+    }
+    struct rb_node *prev_node = rb_prev(&range->memory_ranges_node);
+    if (prev_node != NULL) {
+        struct userspace_memory_range *prev = rb_entry(prev_node, struct userspace_memory_range, memory_ranges_node);
+        if (userspace_memory_ranges_mergeable(prev, range)) {
+            prev->end = range->end;
+            rb_erase(&range->memory_ranges_node, &process->memory_ranges_tree);
+            userspace_memory_range_free(range);
+            return prev;
+        }
+    }
+    return range;
+}
+
+static bool page_table_is_empty(uint64_t *entries) {
+    for (uint16_t i = 0; i < 512; i++) {
+        if (entries[i] != 0) {
+            return false;
         }
     }
+    return true;
 }
 
-// Frees userspace pages and PT, PD and PTPD pages
+// Replace the 2 MiB page mapped by pd_entry with a page table of 4 KiB pages, so that part of it can be unmapped
+// A page that only this process maps is split in place: kpage_alloc gave every page of the block refcount 1,
+// so its pages can be released one by one. A page still shared copy-on-write after fork is copied instead
+static void split_user_huge_page(uint64_t *pd_entry) {
+    void *huge_page = (void*)(*pd_entry & PAGE_ADDRESS_MASK) + hhdm_offset;
+    uint64_t attributes = *pd_entry & ~PAGE_ADDRESS_MASK & ~(uint64_t)PAGE_HUGE;
+    uint64_t *pt_entries = kpage_alloc_zeroed();
+    if (kmem_page_of(huge_page)->refcount == 1) {
+        for (size_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+            pt_entries[i] = ((uint64_t)huge_page - hhdm_offset + i * PAGE_SIZE) | attributes;
+        }
+    } else {
+        // Huge pages only back anonymous and heap ranges, which are writable
+        attributes = (attributes & ~(uint64_t)PAGE_COW) | PAGE_WRITABLE;
+        for (size_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+            void *new_page = kpage_alloc(1);
+            memcpy(new_page, huge_page + i * PAGE_SIZE, PAGE_SIZE);
+            pt_entries[i] = ((uint64_t)new_page - hhdm_offset) | attributes;
+        }
+        kpage_put(huge_page, HUGE_PAGE_PAGES);
+        vmstat.cow_pages_copied += HUGE_PAGE_PAGES;
+    }
+    set_page_table_mapping(pd_entry, pt_entries);
+    vmstat.huge_page_splits++;
+}
+
+// Clear the entries covering [start, end) in a page table at the given level (3 for the PML4, 0 for a PT)
+// and drop the references to the mapped pages. If free_tables is set, lower level tables that become empty are freed
+static void unmap_page_table_range(uint64_t *entries, uint8_t level, uint64_t start, uint64_t end, bool free_tables) {
+    uint8_t shift = 12 + 9 * level;
+    uint64_t address = start;
+    while (address < end) {
+        uint64_t *entry = &entries[(address >> shift) & 0x1FF];
+        uint64_t entry_start = address & ~((1ULL << shift) - 1);
+        uint64_t entry_end = entry_start + (1ULL << shift);
+        uint64_t sub_end = end < entry_end ? end : entry_end;
+        if ((*entry & PAGE_ADDRESS_MASK) == 0) {
+            // Nothing mapped
+        } else if (level == 0) {
+            kpage_put((void*)(*entry & PAGE_ADDRESS_MASK) + hhdm_offset, 1); // Page may still be shared copy-on-write with another process
+            *entry = 0;
+        } else if (level == 1 && (*entry & PAGE_HUGE) && address == entry_start && sub_end == entry_end) {
+            kpage_put((void*)(*entry & PAGE_ADDRESS_MASK) + hhdm_offset, HUGE_PAGE_PAGES);
+            *entry = 0;
+        } else {
+            if (level == 1 && (*entry & PAGE_HUGE)) {
+                // Only part of the 2 MiB page is unmapped
+                split_user_huge_page(entry);
+            }
+            uint64_t *child_entries = (void*)(*entry & PAGE_ADDRESS_MASK) + hhdm_offset;
+            unmap_page_table_range(child_entries, level - 1, address, sub_end, free_tables);
+            if (free_tables && page_table_is_empty(child_entries)) {
+                kpage_free(child_entries, 1);
+                *entry = 0;
+            }
+        }
+        address = entry_end;
+    }
+}
+
+// Free the lower level tables covering [start, end) that have no entries left. Mappings are not touched
+// Returns the number of freed tables
+static uint64_t free_empty_page_tables(uint64_t *entries, uint8_t level, uint64_t start, uint64_t end) {
+    uint8_t shift = 12 + 9 * level;
+    uint64_t freed = 0;
+    uint64_t address = start;
+    while (address < end) {
+        uint64_t *entry = &entries[(address >> shift) & 0x1FF];
+        uint64_t entry_end = (address & ~((1ULL << shift) - 1)) + (1ULL << shift);
+        uint64_t sub_end = end < entry_end ? end : entry_end;
+        if (level > 0 && (*entry & PAGE_ADDRESS_MASK) != 0 && !(level == 1 && (*entry & PAGE_HUGE))) {
+            uint64_t *child_entries = (void*)(*entry & PAGE_ADDRESS_MASK) + hhdm_offset;
+            freed += free_empty_page_tables(child_entries, level - 1, address, sub_end);
+            if (page_table_is_empty(child_entries)) {
+                kpage_free(child_entries, 1);
+                *entry = 0;
+                freed++;
+            }
+        }
+        address = entry_end;
+    }
+    return freed;
+}
+
+// Unmap the part [start, end) of range. Pages of shared file mappings that were written to are written back
+static void unmap_userspace_memory_range(
+    struct task_struct *process,
+    struct userspace_memory_range *range,
+    uint64_t start,
+    uint64_t end,
+    bool free_tables
+) {
+    if (range->type == USERSPACE_MEMRANGE_FILE_SHARED) {
+        // The CPU sets the dirty bit of a PTE on the first write through it
+        for (uint64_t page = start; page < end; page += PAGE_SIZE) {
+            uint64_t *pte = find_pte(process->pml4_page, (void*)page);
+            if (pte != NULL && (*pte & PAGE_PRESENT) && (*pte & PAGE_DIRTY)) {
+                page_cache_mark_dirty(range->inode, (range->file_offset + page - (range->start & PAGE_ADDRESS_MASK)) / PAGE_SIZE);
+            }
+        }
+    }
+    unmap_page_table_range(process->pml4_page, 3, start, end, free_tables);
+    if (range->type == USERSPACE_MEMRANGE_FILE_SHARED) {
+        page_cache_writeback(range->inode);
+    }
+}
+
+// Unmap [start, end) and forget the memory ranges in it, splitting ranges that straddle its bounds
+// start and end must be page aligned. The caller must flush the TLB
+void remove_userspace_memory(struct task_struct *process, uint64_t start, uint64_t end) {
+    struct userspace_memory_range *range = find_userspace_memory_range_ending_after(process, start);
+    while (range != NULL && (range->start & PAGE_ADDRESS_MASK) < end) {
+        if (range->start < start) {
+            range = userspace_memory_range_split(process, range, start);
+        }
+        if (range->end > end) {
+            userspace_memory_range_split(process, range, end);
+        }
+        struct rb_node *next_node = rb_next(&range->memory_ranges_node);
+        unmap_userspace_memory_range(process, range, range->start & PAGE_ADDRESS_MASK, range->end, true);
+        if (process->heap_range == range) {
+            process->heap_range = NULL;
+        }
+        rb_erase(&range->memory_ranges_node, &process->memory_ranges_tree);
+        userspace_memory_range_free(range);
+        range = next_node ? rb_entry(next_node, struct userspace_memory_range, memory_ranges_node) : NULL;
+    }
+}
+
+static void free_memory_range_tree(struct rb_root *tree) {
+    while (tree->node != NULL) {
+        struct rb_node *node = tree->node;
+        rb_erase(node, tree);
+        userspace_memory_range_free(rb_entry(node, struct userspace_memory_range, memory_ranges_node));
+    }
+}
+
+// Returns true if no memory range of process overlaps [start, end)
+static bool userspace_memory_is_free(struct task_struct *process, uint64_t start, uint64_t end) {
+    struct userspace_memory_range *range = find_userspace_memory_range_ending_after(process, start);
+    return range == NULL || (range->start & PAGE_ADDRESS_MASK) >= end;
+}
+
+// Find the lowest free gap of length bytes in the mmap region. Returns 0 if there is none
+static uint64_t find_mmap_gap(struct task_struct *process, uint64_t length) {
+    uint64_t candidate = USERSPACE_MMAP_BASE;
+    struct userspace_memory_range *range = find_userspace_memory_range_ending_after(process, candidate);
+    while (range != NULL && (range->start & PAGE_ADDRESS_MASK) < candidate + length) {
+        uint64_t range_end = (range->end + PAGE_OFFSET_MASK) & PAGE_ADDRESS_MASK;
+        if (range_end > candidate) {
+            candidate = range_end;
+        }
+        struct rb_node *next_node = rb_next(&range->memory_ranges_node);
+        range = next_node ? rb_entry(next_node, struct userspace_memory_range, memory_ranges_node) : NULL;
+    }
+    if (candidate + length > USERSPACE_MMAP_END) {
+        return 0;
+    }
+    return candidate;
+}
+
+// Add a memory range of length bytes (page aligned) in the mmap region. Pages are mapped on first touch
+// address is a hint, used if it is page aligned and the range there is free. If fixed is set, address must be used
+// and existing memory there is unmapped. The caller must flush the TLB in that case
+// For file ranges, file_offset must be page aligned
+// Returns the start of the range, or 0 on failure
+uint64_t map_userspace_memory(
+    struct task_struct *process,
+    uint64_t address,
+    uint64_t length,
+    bool fixed,
+    uint8_t type,
+    struct inode *inode,
+    uint64_t file_offset
+) {
+    if (length == 0 || (length & PAGE_OFFSET_MASK) || length > USERSPACE_MMAP_END - USERSPACE_MMAP_BASE) {
+        return 0;
+    }
+    bool address_in_region = !(address & PAGE_OFFSET_MASK) &&
+        address >= USERSPACE_MMAP_BASE &&
+        address <= USERSPACE_MMAP_END - length;
+    if (fixed) {
+        if (!address_in_region) {
+            return 0;
+        }
+        remove_userspace_memory(process, address, address + length);
+    } else if (!address_in_region || !userspace_memory_is_free(process, address, address + length)) {
+        address = find_mmap_gap(process, length);
+        if (address == 0) {
+            return 0;
+        }
+    }
+    struct userspace_memory_range *range = userspace_memory_range_alloc();
+    range->start = address;
+    range->end = address + length;
+    range->type = type;
+    range->inode = inode;
+    range->file_offset = file_offset;
+    insert_userspace_memory_range(process, range);
+    userspace_memory_range_merge(process, range);
+    return address;
+}
+
+// Free the structs tracking the memory ranges of process, without touching its page tables
+void free_userspace_memory_ranges(struct task_struct *process) {
+    free_memory_range_tree(&process->memory_ranges_tree);
+    process->heap_range = NULL;
+}
+
+// Frees userspace pages and PT, PD and PTPD pages. Only the page tables covering memory ranges are visited
 // Does not free PML4 page
 void free_userspace_memory(struct task_struct *process) {
-    uint64_t *pml4_entries = process->pml4_page;
-    for (uint64_t *pml4_entry = pml4_entries; pml4_entry < pml4_entries + 256; pml4_entry++) {
-        if ((*pml4_entry & PAGE_ADDRESS_MASK) == 0) continue;
-        uint64_t *ptpd_entries = (void*)(*pml4_entry & PAGE_ADDRESS_MASK) + hhdm_offset;
-        for (uint64_t *ptpd_entry = ptpd_entries; ptpd_entry < ptpd_entries + 512; ptpd_entry++) {
-            if ((*ptpd_entry & PAGE_ADDRESS_MASK) == 0) continue;
-            uint64_t *pd_entries = (void*)(*ptpd_entry & PAGE_ADDRESS_MASK) + hhdm_offset;
-            for (uint64_t *pd_entry = pd_entries; pd_entry < pd_entries + 512; pd_entry++) {
-                if ((*pd_entry & PAGE_ADDRESS_MASK) == 0) continue;
-                uint64_t *pt_entries = (void*)(*pd_entry & PAGE_ADDRESS_MASK) + hhdm_offset;
-                for (uint64_t *pt_entry = pt_entries; pt_entry < pt_entries + 512; pt_entry++) {
-                    if ((*pt_entry & PAGE_ADDRESS_MASK) == 0) continue;
-                    void* page = (void*)(*pt_entry & PAGE_ADDRESS_MASK) + hhdm_offset;
-                    kpage_free(page, 1);
-                    *pt_entry = 0;
-                }
-                kpage_free(pt_entries, 1);
-                *pd_entry = 0;
+    for (struct rb_node *node = rb_first(&process->memory_ranges_tree); node != NULL; node = rb_next(node)) {
+        struct userspace_memory_range *range = rb_entry(node, struct userspace_memory_range, memory_ranges_node);
+        unmap_userspace_memory_range(process, range, range->start & PAGE_ADDRESS_MASK, range->end, true);
+        task_preempt_point(); // process is a zombie, so nothing else changes its ranges meanwhile
+    }
+    free_userspace_memory_ranges(process);
+}
+
+// First half of exec teardown. Unmaps all userspace pages but keeps the page tables, so that a new image
+// with the same layout maps its pages into the existing tables. The memory ranges of process are moved
+// to old_ranges_out and must be passed to free_unused_page_tables once the new image is loaded
+void unmap_userspace_memory_for_exec(struct task_struct *process, struct rb_root *old_ranges_out) {
+    for (struct rb_node *node = rb_first(&process->memory_ranges_tree); node != NULL; node = rb_next(node)) {
+        struct userspace_memory_range *range = rb_entry(node, struct userspace_memory_range, memory_ranges_node);
+        unmap_userspace_memory_range(process, range, range->start & PAGE_ADDRESS_MASK, range->end, false);
+    }
+    *old_ranges_out = process->memory_ranges_tree;
+    process->memory_ranges_tree.node = NULL;
+    process->heap_range = NULL;
+}
+
+// Second half of exec teardown. Frees the page tables under old_ranges that the new image left empty,
+// then frees old_ranges
+void free_unused_page_tables(struct task_struct *process, struct rb_root *old_ranges) {
+    for (struct rb_node *node = rb_first(old_ranges); node != NULL; node = rb_next(node)) {
+        struct userspace_memory_range *range = rb_entry(node, struct userspace_memory_range, memory_ranges_node);
+        vmstat.exec_page_tables_freed += free_empty_page_tables(process->pml4_page, 3, range->start & PAGE_ADDRESS_MASK, range->end);
+    }
+    free_memory_range_tree(old_ranges);
+}
+
+// Clone memory ranges of parent into child. Pages are shared copy-on-write:
+// writable PTEs are made read-only in both processes and marked with PAGE_COW.
+// Pages of shared file mappings stay writable in both processes.
+// The caller must flush the TLB of parent afterwards
+void clone_userspace_memory(struct task_struct *parent, struct task_struct *child) {
+    for (struct rb_node *node = rb_first(&parent->memory_ranges_tree); node != NULL; node = rb_next(node)) {
+        struct userspace_memory_range *memory_range = rb_entry(node, struct userspace_memory_range, memory_ranges_node);
+        struct userspace_memory_range *new_memory_range = userspace_memory_range_alloc();
+        new_memory_range->start = memory_range->start;
+        new_memory_range->end = memory_range->end;
+        new_memory_range->type = memory_range->type;
+        new_memory_range->inode = memory_range->inode;
+        new_memory_range->file_offset = memory_range->file_offset;
+        insert_userspace_memory_range(child, new_memory_range);
+        if (parent->heap_range == memory_range) {
+            child->heap_range = new_memory_range;
+        }
+        for (void *page = (void*)(memory_range->start & PAGE_ADDRESS_MASK); page < (void*)(memory_range->end); page += PAGE_SIZE) {
+            uint8_t level;
+            uint64_t *parent_pte = find_pte_level(parent->pml4_page, page, &level);
+            if (parent_pte == NULL || !(*parent_pte & PAGE_PRESENT)) {
+                continue;
             }
-            kpage_free(pd_entries, 1);
-            *ptpd_entry = 0;
+            if ((*parent_pte & PAGE_WRITABLE) && memory_range->type != USERSPACE_MEMRANGE_FILE_SHARED) {
+                *parent_pte = (*parent_pte & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+            }
+            kpage_get((void*)(*parent_pte & PAGE_ADDRESS_MASK) + hhdm_offset);
+            if (level == 1) {
+                // Share the whole 2 MiB page and skip to its end
+                *get_or_create_pde(child->pml4_page, page) = *parent_pte;
+                vmstat.fork_pages_shared += HUGE_PAGE_PAGES;
+                page = (void*)(((uint64_t)page | (HUGE_PAGE_SIZE - 1)) + 1) - PAGE_SIZE;
+                continue;
+            }
+            *get_or_create_pte(child->pml4_page, page) = *parent_pte;
+            vmstat.fork_pages_shared++;
         }
-        kpage_free(ptpd_entries, 1);
-        *pml4_entry = 0;
+        task_preempt_point(); // parent is the current task, so nothing else changes its ranges meanwhile
     }
+}
 
-    // Free list process->memory_ranges_lh
-    struct list_head *memory_ranges_le = process->memory_ranges_lh.next;
-    while(memory_ranges_le != &process->memory_ranges_lh) {
-        struct userspace_memory_range *range = container_of(memory_ranges_le, struct userspace_memory_range, memory_ranges_le);
-        memory_ranges_le = memory_ranges_le->next;
-        userspace_memory_range_free(range);
+// Map the page at page_address of a file range from the page cache of its inode
+// Private mappings share the cached page copy-on-write. Shared mappings map it writable
+// Returns false if the page is past the end of the file, or on writes to a read-only range
+static bool map_user_file_page(
+    struct task_struct *process,
+    struct userspace_memory_range *range,
+    void *page_address,
+    uint64_t error_code
+) {
+    if (range->type == USERSPACE_MEMRANGE_FILE_READONLY && (error_code & PAGE_FAULT_WRITE)) {
+        return false;
+    }
+    uint64_t index = (range->file_offset + ((uint64_t)page_address - (range->start & PAGE_ADDRESS_MASK))) / PAGE_SIZE;
+    bool read_from_file;
+    void *cached_page = page_cache_get(range->inode, index, &read_from_file);
+    if (cached_page == NULL) {
+        return false;
+    }
+    // Taken before allocating anything, since allocations may evict unmapped cached pages
+    kpage_get(cached_page);
+    if (read_from_file) {
+        process->major_faults++;
+    } else {
+        process->minor_faults++;
+    }
+    if (range->type == USERSPACE_MEMRANGE_FILE_PRIVATE && (error_code & PAGE_FAULT_WRITE)) {
+        // Copy right away instead of mapping the cached page and faulting again
+        void *new_page = kpage_alloc(1);
+        memcpy(new_page, cached_page, PAGE_SIZE);
+        kpage_put(cached_page, 1);
+        set_page_mapping(process->pml4_page, page_address, new_page - hhdm_offset, false);
+        vmstat.cow_pages_copied++;
+        return true;
     }
-    init_list(&process->memory_ranges_lh);
+    set_page_mapping(process->pml4_page, page_address, cached_page - hhdm_offset, false);
+    uint64_t *pte = find_pte(process->pml4_page, page_address);
+    if (range->type == USERSPACE_MEMRANGE_FILE_PRIVATE) {
+        *pte = (*pte & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+    } else if (range->type == USERSPACE_MEMRANGE_FILE_READONLY) {
+        *pte &= ~(uint64_t)PAGE_WRITABLE;
+    } else {
+        // Cleared so that unmapping can tell whether the page was written to
+        *pte &= ~(uint64_t)PAGE_DIRTY;
+    }
+    return true;
+}
+
+// Try to resolve a page fault on a userspace address in the current process
+// Returns true if the faulting access can be retried
+bool handle_user_page_fault(struct task_struct *process, uint64_t fault_address, uint64_t error_code) {
+    void *page_address = (void*)(fault_address & PAGE_ADDRESS_MASK);
+    uint8_t level;
+    uint64_t *pte = find_pte_level(process->pml4_page, page_address, &level);
+    if (pte == NULL || !(*pte & PAGE_PRESENT)) {
+        // First touch of a page in a known range. Pages are allocated and zeroed on demand
+        struct userspace_memory_range *range = find_userspace_memory_range(process, fault_address);
+        if (range == NULL) {
+            return false;
+        }
+        if (range->inode != NULL) {
+            return map_user_file_page(process, range, page_address, error_code);
+        }
+        process->minor_faults++;
+        if (pte == NULL && try_map_user_huge_page(process, range, fault_address)) {
+            vmstat.huge_page_faults++;
+        } else if (error_code & PAGE_FAULT_WRITE) {
+            map_user_page(process, page_address);
+            vmstat.demand_zero_pages++;
+        } else {
+            // Reads see the shared zero page until the first write
+            kpage_get(zero_page);
+            set_page_mapping(process->pml4_page, page_address, zero_page - hhdm_offset, false);
+            pte = find_pte(process->pml4_page, page_address);
+            *pte = (*pte & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+            vmstat.zero_page_maps++;
+        }
+        return true;
+    }
+    if (!(error_code & PAGE_FAULT_WRITE) || (*pte & PAGE_WRITABLE)) {
+        // Stale TLB entry. The PTE already allows this access
+        invlpg(page_address);
+        return true;
+    }
+    if (!(*pte & PAGE_COW)) {
+        return false;
+    }
+
+    process->minor_faults++;
+    vmstat.cow_faults++;
+    void *old_page = (void*)(*pte & PAGE_ADDRESS_MASK) + hhdm_offset;
+    uint64_t attributes = (*pte & ~PAGE_ADDRESS_MASK & ~(uint64_t)PAGE_COW) | PAGE_WRITABLE;
+    size_t num_pages = level == 1 ? HUGE_PAGE_PAGES : 1;
+    if (old_page == zero_page) {
+        // First write to untouched memory. No need to copy
+        void *new_page = kpage_alloc_zeroed();
+        *pte = ((uint64_t)new_page - hhdm_offset) | attributes;
+        kpage_put(old_page, 1);
+        vmstat.demand_zero_pages++;
+    } else if (kmem_page_of(old_page)->refcount == 1) {
+        // Other sharers are gone. Take over the page without copying
+        *pte = ((uint64_t)old_page - hhdm_offset) | attributes;
+    } else {
+        void *new_page = kpage_alloc(num_pages);
+        memcpy(new_page, old_page, num_pages * PAGE_SIZE);
+        *pte = ((uint64_t)new_page - hhdm_offset) | attributes;
+        kpage_put(old_page, num_pages);
+        vmstat.cow_pages_copied += num_pages;
+    }
+    invlpg(page_address);
+    return true;
+}
+
+// A read-only PT_LOAD segment can be mapped from the page cache if its file offset and address share
+// the same page offset, and no other segment touches its pages. Bytes past p_filesz in its last page
+// come from the file, so p_memsz must equal p_filesz
+static bool elf_segment_is_shareable(struct elf64_phdr *segment_headers, uint32_t num_segments, uint32_t index) {
+    struct elf64_phdr *segment = &segment_headers[index];
+    if (
+        segment->p_type != PT_LOAD ||
+        (segment->p_flags & PF_W) ||
+        segment->p_filesz != segment->p_memsz ||
+        segment->p_memsz == 0 ||
+        ((segment->p_offset ^ segment->p_vaddr) & PAGE_OFFSET_MASK)
+    ) {
+        return false;
+    }
+    uint64_t first_page = segment->p_vaddr & PAGE_ADDRESS_MASK;
+    uint64_t end_page = (segment->p_vaddr + segment->p_memsz + PAGE_OFFSET_MASK) & PAGE_ADDRESS_MASK;
+    for (uint32_t i = 0; i < num_segments; i++) {
+        struct elf64_phdr *other = &segment_headers[i];
+        if (i == index || (!other->p_vaddr && !other->p_memsz)) {
+            continue;
+        }
+        uint64_t other_first_page = other->p_vaddr & PAGE_ADDRESS_MASK;
+        uint64_t other_end_page = (other->p_vaddr + other->p_memsz + PAGE_OFFSET_MASK) & PAGE_ADDRESS_MASK;
+        if (other_first_page < end_page && first_page < other_end_page) {
+            return false;
+        }
+    }
+    return true;
 }
 
 // Load ELF64 to current process
-// Returns 0 on success
-void load_elf64(struct file *filp, struct loader_result *loader_result_out) {
-    struct elf64_hdr elf_file_header;
-    vfs_read(filp, &elf_file_header, sizeof(struct elf64_hdr));
-    
+// Read-only segments are mapped from the page cache of the file, so every process running
+// the same binary shares them. Other segments are copied into private pages
+// image is the parsed image of the binary open in filp, from elf_image_get
+void load_elf64(struct file *filp, struct elf_image *image, struct loader_result *loader_result_out) {
+    struct elf64_phdr *segment_headers = image->segments;
+
     void *largest_end_address = NULL;
-    for (uint32_t i = 0; i < elf_file_header.e_phnum; i++) {
-        struct elf64_phdr segment_header;
-        filp->offset = elf_file_header.e_phoff + i * sizeof(struct elf64_phdr);
-        vfs_read(filp, &segment_header, sizeof(struct elf64_phdr));
-        if (!segment_header.p_vaddr && !segment_header.p_memsz) {
+    for (uint32_t i = 0; i < image->num_segments; i++) {
+        struct elf64_phdr *segment_header = &segment_headers[i];
+        if (!segment_header->p_vaddr && !segment_header->p_memsz) {
             // Skip null
             continue;
         }
         struct userspace_memory_range *memory_range = userspace_memory_range_alloc(); // Freed in task_free
-        memory_range->type = USERSPACE_MEMRANGE_NORMAL;
-        memory_range->start = segment_header.p_vaddr;
-        memory_range->end = segment_header.p_vaddr + segment_header.p_memsz;
+        if (elf_segment_is_shareable(segment_headers, image->num_segments, i)) {
+            memory_range->type = USERSPACE_MEMRANGE_FILE_READONLY;
+            memory_range->inode = filp->inode;
+            memory_range->file_offset = segment_header->p_offset & PAGE_ADDRESS_MASK;
+            vmstat.exec_shared_segments++;
+        } else {
+            memory_range->type = USERSPACE_MEMRANGE_NORMAL;
+            memory_range->inode = NULL;
+            memory_range->file_offset = 0;
+        }
+        memory_range->start = segment_header->p_vaddr;
+        memory_range->end = segment_header->p_vaddr + segment_header->p_memsz;
         if ((void*)(memory_range->end) > largest_end_address) {
             largest_end_address = (void*)(memory_range->end);
         }
-        list_add_tail(&memory_range->memory_ranges_le, &current_task_ts->memory_ranges_lh);
+        insert_userspace_memory_range(current_task_ts, memory_range);
     }
 
     // 1 page of heap
     struct userspace_memory_range *heap_memory_range = userspace_memory_range_alloc(); // Freed in task_free
     heap_memory_range->type = USERSPACE_MEMRANGE_HEAP;
+    heap_memory_range->inode = NULL;
+    heap_memory_range->file_offset = 0;
     heap_memory_range->start = ((uint64_t)largest_end_address & PAGE_OFFSET_MASK) ? (((uint64_t)largest_end_address | PAGE_OFFSET_MASK) + 1) : (uint64_t)largest_end_address;
     heap_memory_range->end = heap_memory_range->start + PAGE_SIZE;
-    list_add_tail(&heap_memory_range->memory_ranges_le, &current_task_ts->memory_ranges_lh);
+    insert_userspace_memory_range(current_task_ts, heap_memory_range);
+    current_task_ts->heap_range = heap_memory_range;
 
     // 1MB of stack
     struct userspace_memory_range *stack_memory_range = userspace_memory_range_alloc(); // Freed in task_free
     stack_memory_range->type = USERSPACE_MEMRANGE_STACK;
+    stack_memory_range->inode = NULL;
+    stack_memory_range->file_offset = 0;
     stack_memory_range->start = 0x00007FFFFFF00000;
     stack_memory_range->end = 0x0000800000000000;
-    list_add_tail(&stack_memory_range->memory_ranges_le, &current_task_ts->memory_ranges_lh);
-    
-    setup_userspace_memory(current_task_ts);
+    insert_userspace_memory_range(current_task_ts, stack_memory_range);
 
-    for (uint32_t i = 0; i < elf_file_header.e_phnum; i++) {
-        struct elf64_phdr segment_header;
-        filp->offset = elf_file_header.e_phoff + i * sizeof(struct elf64_phdr);
-        vfs_read(filp, &segment_header, sizeof(struct elf64_phdr));
-        filp->offset = segment_header.p_offset;
-        vfs_read(filp, (void*)segment_header.p_vaddr, segment_header.p_filesz);
+    // Pages are mapped on first touch by handle_user_page_fault, including the writes below
+
+    for (uint32_t i = 0; i < image->num_segments; i++) {
+        struct elf64_phdr *segment_header = &segment_headers[i];
+        struct userspace_memory_range *memory_range = find_userspace_memory_range(current_task_ts, segment_header->p_vaddr);
+        if (memory_range != NULL && memory_range->type == USERSPACE_MEMRANGE_FILE_READONLY) {
+            continue;
+        }
+        filp->offset = segment_header->p_offset;
+        vfs_read(filp, (void*)segment_header->p_vaddr, segment_header->p_filesz);
     }
 
-    loader_result_out->user_entry_rip = elf_file_header.e_entry;
+    loader_result_out->user_entry_rip = image->entry;
     loader_result_out->user_entry_rsp = 0x0000800000000000;
 }
@@ -1,32 +1,82 @@
 #ifndef USERSPACE_H
 #define USERSPACE_H
 
+#include <stdbool.h>
 #include "lib/list.h"
+#include "lib/rbtree.h"
 #include "mm/slab.h"
 #include "kernel/scheduler.h"
 
+struct elf_image;
 struct file;
+struct inode;
 
 // In C
-void setup_userspace_memory(struct task_struct *process);
 extern void* mapped_user_code_page;
 extern void* mapped_user_stack_page;
 
 #define USERSPACE_MEMRANGE_NORMAL 0xA1
 #define USERSPACE_MEMRANGE_HEAP 0xA2
 #define USERSPACE_MEMRANGE_STACK 0xA3
+#define USERSPACE_MEMRANGE_ANONYMOUS 0xA4 // Created by mmap
+#define USERSPACE_MEMRANGE_FILE_PRIVATE 0xA5 // File pages mapped copy-on-write
+#define USERSPACE_MEMRANGE_FILE_SHARED 0xA6 // File pages mapped writable. Changes are written back to the file
+#define USERSPACE_MEMRANGE_FILE_READONLY 0xA7 // File pages mapped read-only, such as program text
 
+// Region of the address space where mmap places memory
+#define USERSPACE_MMAP_BASE 0x0000100000000000
+#define USERSPACE_MMAP_END 0x00007F0000000000
+
+// mmap flags
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+// A virtual memory area. The ranges of a process do not overlap, except that ELF segments may share a page
 struct userspace_memory_range {
-    uint64_t start; // Must be page aligned.
+    uint64_t start; // Page aligned, except for ELF segments
     uint64_t end; // First byte after end of memory. Must be page aligned
     uint8_t type;
-    struct list_head memory_ranges_le;
+    struct inode *inode; // Mapped file, for USERSPACE_MEMRANGE_FILE_* ranges
+    uint64_t file_offset; // Offset in inode of the page at start. Page aligned
+    struct rb_node memory_ranges_node; // In task_struct.memory_ranges_tree, ordered by start
 };
 
 extern struct slab_allocator userspace_memory_range_allocator;
 #define userspace_memory_range_alloc() slab_alloc(&userspace_memory_range_allocator)
 #define userspace_memory_range_free(x) slab_free(&userspace_memory_range_allocator, x)
 
+// Error code bits for page faults
+#define PAGE_FAULT_PRESENT 0x1
+#define PAGE_FAULT_WRITE 0x2
+#define PAGE_FAULT_USER 0x4
+
+// Counters exposed in /sys/vmstat
+struct vmstat {
+    uint64_t fork_count;
+    uint64_t fork_cycles; // Total TSC cycles spent in fork
+    uint64_t fork_pages_shared; // Pages shared copy-on-write by fork
+    uint64_t cow_faults;
+    uint64_t cow_pages_copied;
+    uint64_t demand_zero_pages; // Pages allocated and zeroed on first write
+    uint64_t zero_page_maps; // Read faults satisfied by mapping the shared zero page
+    uint64_t huge_page_faults; // Faults satisfied by mapping a 2 MiB page
+    uint64_t huge_page_splits; // 2 MiB pages turned into page tables because part of them was unmapped
+    uint64_t spawn_count;
+    uint64_t spawn_cycles; // Total TSC cycles spent in spawn, in the caller. Loading happens in the new process
+    uint64_t exec_count;
+    uint64_t exec_cycles; // Total TSC cycles spent in exec
+    uint64_t exec_page_tables_freed; // Page tables left empty by the new image. The rest are reused
+    uint64_t exit_count; // Processes reaped by waitpid
+    uint64_t exit_cycles; // Total TSC cycles spent tearing down reaped processes
+    uint64_t exec_shared_segments; // Read-only ELF segments mapped from the page cache instead of copied
+    uint64_t exec_elf_image_hits; // Execs that found the parsed ELF headers cached on the inode
+    uint64_t exec_elf_image_misses;
+};
+extern struct vmstat vmstat;
+extern void *zero_page;
+
 struct loader_result {
     uint64_t user_entry_rip;
     uint64_t user_entry_rsp;
@@ -34,7 +84,26 @@ struct loader_result {
 
 void userspace_init();
 void free_userspace_memory(struct task_struct *process);
-void load_elf64(struct file *filp, struct loader_result *loader_result_out);
+void unmap_userspace_memory_for_exec(struct task_struct *process, struct rb_root *old_ranges_out);
+void free_unused_page_tables(struct task_struct *process, struct rb_root *old_ranges);
+void load_elf64(struct file *filp, struct elf_image *image, struct loader_result *loader_result_out);
 void* map_user_page(struct task_struct *process, void* user_space_address);
+void insert_userspace_memory_range(struct task_struct *process, struct userspace_memory_range *range);
+struct userspace_memory_range *find_userspace_memory_range(struct task_struct *process, uint64_t address);
+struct userspace_memory_range *userspace_memory_range_split(struct task_struct *process, struct userspace_memory_range *range, uint64_t address);
+struct userspace_memory_range *userspace_memory_range_merge(struct task_struct *process, struct userspace_memory_range *range);
+void remove_userspace_memory(struct task_struct *process, uint64_t start, uint64_t end);
+void free_userspace_memory_ranges(struct task_struct *process);
+uint64_t map_userspace_memory(
+    struct task_struct *process,
+    uint64_t address,
+    uint64_t length,
+    bool fixed,
+    uint8_t type,
+    struct inode *inode,
+    uint64_t file_offset
+);
+void clone_userspace_memory(struct task_struct *parent, struct task_struct *child);
+bool handle_user_page_fault(struct task_struct *process, uint64_t fault_address, uint64_t error_code);
 
 #endif
@@ -0,0 +1,252 @@
+// Kernel virtual address allocator
+// Free ranges are kept in two red-black trees: by address (for coalescing) and by size (for best fit)
+#include <stdint.h>
+#include <stdbool.h>
+#include "arch/asm.h"
+#include "drivers/tty.h"
+#include "kernel/scheduler.h"
+#include "lib/cstd.h"
+#include "lib/rbtree.h"
+#include "mm/kmem.h"
+#include "mm/map.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/vmalloc.h"
+
+// Supervisor-only, so nothing below this PML4 entry is reachable from user mode
+#define VMALLOC_PML4_ATTRIBUTES 0x3
+
+struct slab_allocator vmalloc_area_allocator = SLAB_OF(struct vmalloc_area);
+#define vmalloc_area_alloc() slab_alloc(&vmalloc_area_allocator)
+#define vmalloc_area_free(x) slab_free(&vmalloc_area_allocator, x)
+
+struct rb_root vmalloc_free_by_address = RB_ROOT;
+struct rb_root vmalloc_free_by_size = RB_ROOT;
+struct rb_root vmalloc_used_by_address = RB_ROOT;
+uint64_t vmalloc_used_pages = 0;
+
+void *kernel_pml4_page() {
+    return (void*)(read_cr3() & PAGE_ADDRESS_MASK) + hhdm_offset;
+}
+
+void vmalloc_insert_by_address(struct rb_root *root, struct vmalloc_area *area) {
+    struct rb_node **link = &root->node;
+    struct rb_node *parent = NULL;
+    while (*link) {
+        parent = *link;
+        struct vmalloc_area *candidate = rb_entry(parent, struct vmalloc_area, address_node);
+        link = area->start < candidate->start ? &parent->left : &parent->right;
+    }
+    rb_link_node(&area->address_node, parent, link);
+    rb_insert_color(&area->address_node, root);
+}
+
+void vmalloc_insert_by_size(struct vmalloc_area *area) {
+    struct rb_node **link = &vmalloc_free_by_size.node;
+    struct rb_node *parent = NULL;
+    while (*link) {
+        parent = *link;
+        struct vmalloc_area *candidate = rb_entry(parent, struct vmalloc_area, size_node);
+        bool is_less = area->num_pages < candidate->num_pages ||
+            (area->num_pages == candidate->num_pages && area->start < candidate->start);
+        link = is_less ? &parent->left : &parent->right;
+    }
+    rb_link_node(&area->size_node, parent, link);
+    rb_insert_color(&area->size_node, &vmalloc_free_by_size);
+}
+
+void vmalloc_insert_free(uint64_t start, uint64_t num_pages) {
+    struct vmalloc_area *area = vmalloc_area_alloc();
+    area->start = start;
+    area->num_pages = num_pages;
+    area->is_free = true;
+    area->owns_pages = false;
+    vmalloc_insert_by_address(&vmalloc_free_by_address, area);
+    vmalloc_insert_by_size(area);
+}
+
+void vmalloc_init() {
+    slab_allocator_init(&vmalloc_area_allocator);
+
+    // Populate the PML4 entry now, before any process copies the kernel half of the PML4
+    uint64_t *pml4_entries = kernel_pml4_page();
+    if (pml4_entries[VMALLOC_PML4_INDEX] & PAGE_PRESENT) {
+        panic(u8p("vmalloc_init: vmalloc region is already mapped\n"));
+    }
+    void *ptpd_page = kpage_alloc_zeroed();
+    pml4_entries[VMALLOC_PML4_INDEX] = ((uint64_t)ptpd_page - hhdm_offset) | VMALLOC_PML4_ATTRIBUTES;
+
+    vmalloc_insert_free(VMALLOC_START, (VMALLOC_END - VMALLOC_START) >> 12);
+}
+
+// Reserve num_pages of kernel virtual address space, aligned to align_pages (a power of two)
+// A guard page is left unmapped after the area
+void *vmalloc_va_alloc(size_t num_pages, size_t align_pages) {
+    uint64_t align = align_pages * PAGE_SIZE;
+    uint64_t total_pages = num_pages + 1; // Guard page
+
+    // Find the smallest free area that is large enough: lower bound in the size tree, then walk up
+    struct rb_node *node = vmalloc_free_by_size.node;
+    struct rb_node *lower_bound = NULL;
+    while (node) {
+        struct vmalloc_area *candidate = rb_entry(node, struct vmalloc_area, size_node);
+        if (candidate->num_pages >= total_pages) {
+            lower_bound = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    struct vmalloc_area *area = NULL;
+    uint64_t aligned_start = 0;
+    for (node = lower_bound; node != NULL; node = rb_next(node)) {
+        struct vmalloc_area *candidate = rb_entry(node, struct vmalloc_area, size_node);
+        aligned_start = (candidate->start + align - 1) & ~(align - 1);
+        if (aligned_start + total_pages * PAGE_SIZE <= candidate->start + candidate->num_pages * PAGE_SIZE) {
+            area = candidate;
+            break;
+        }
+    }
+    if (area == NULL) {
+        panic(u8p("Out of kernel virtual address space\n"));
+    }
+
+    rb_erase(&area->size_node, &vmalloc_free_by_size);
+    rb_erase(&area->address_node, &vmalloc_free_by_address);
+    uint64_t area_end = area->start + area->num_pages * PAGE_SIZE;
+    uint64_t used_end = aligned_start + total_pages * PAGE_SIZE;
+    if (aligned_start > area->start) {
+        vmalloc_insert_free(area->start, (aligned_start - area->start) >> 12);
+    }
+    if (area_end > used_end) {
+        vmalloc_insert_free(used_end, (area_end - used_end) >> 12);
+    }
+
+    area->start = aligned_start;
+    area->num_pages = total_pages;
+    area->is_free = false;
+    area->owns_pages = false;
+    vmalloc_insert_by_address(&vmalloc_used_by_address, area);
+    return (void*)aligned_start;
+}
+
+struct vmalloc_area *vmalloc_find_used(uint64_t start) {
+    struct rb_node *node = vmalloc_used_by_address.node;
+    while (node) {
+        struct vmalloc_area *candidate = rb_entry(node, struct vmalloc_area, address_node);
+        if (start == candidate->start) {
+            return candidate;
+        }
+        node = start < candidate->start ? node->left : node->right;
+    }
+    return NULL;
+}
+
+// Release an area reserved by vmalloc_va_alloc. Its pages must already be unmapped
+void vmalloc_va_free(void *address) {
+    struct vmalloc_area *area = vmalloc_find_used((uint64_t)address);
+    if (area == NULL) {
+        panic(u8p("vmalloc_va_free: not an allocated area\n"));
+    }
+    rb_erase(&area->address_node, &vmalloc_used_by_address);
+    area->is_free = true;
+    area->owns_pages = false;
+    vmalloc_insert_by_address(&vmalloc_free_by_address, area);
+
+    // Coalesce with neighbouring free areas
+    struct rb_node *prev_node = rb_prev(&area->address_node);
+    if (prev_node) {
+        struct vmalloc_area *prev = rb_entry(prev_node, struct vmalloc_area, address_node);
+        if (prev->start + prev->num_pages * PAGE_SIZE == area->start) {
+            rb_erase(&prev->size_node, &vmalloc_free_by_size);
+            rb_erase(&prev->address_node, &vmalloc_free_by_address);
+            area->start = prev->start; // Position in the address tree is unchanged
+            area->num_pages += prev->num_pages;
+            vmalloc_area_free(prev);
+        }
+    }
+    struct rb_node *next_node = rb_next(&area->address_node);
+    if (next_node) {
+        struct vmalloc_area *next = rb_entry(next_node, struct vmalloc_area, address_node);
+        if (area->start + area->num_pages * PAGE_SIZE == next->start) {
+            rb_erase(&next->size_node, &vmalloc_free_by_size);
+            rb_erase(&next->address_node, &vmalloc_free_by_address);
+            area->num_pages += next->num_pages;
+            vmalloc_area_free(next);
+        }
+    }
+    vmalloc_insert_by_size(area);
+}
+
+// Allocate a virtually contiguous kernel buffer backed by individually allocated pages
+void *vmalloc(size_t num_pages) {
+    void *address = vmalloc_va_alloc(num_pages, 1);
+    void *pml4_page = kernel_pml4_page();
+    for (size_t i = 0; i < num_pages; i++) {
+        void *page = kpage_alloc(1);
+        set_page_mapping(pml4_page, address + i * PAGE_SIZE, page - hhdm_offset, false);
+    }
+    vmalloc_find_used((uint64_t)address)->owns_pages = true;
+    vmalloc_used_pages += num_pages;
+    return address;
+}
+
+// Unmap and free a buffer returned by vmalloc, or unmap a range returned by vmap_mmio
+void vfree(void *address) {
+    address = (void*)((uint64_t)address & PAGE_ADDRESS_MASK);
+    struct vmalloc_area *area = vmalloc_find_used((uint64_t)address);
+    if (area == NULL) {
+        panic(u8p("vfree: not an allocated area\n"));
+    }
+    void *pml4_page = kernel_pml4_page();
+    size_t num_pages = area->num_pages - 1; // Guard page is never mapped
+    for (void *page_address = address; page_address < address + num_pages * PAGE_SIZE; page_address += PAGE_SIZE) {
+        uint8_t level;
+        uint64_t *pte = find_pte_level(pml4_page, page_address, &level);
+        if (pte == NULL || !(*pte & PAGE_PRESENT)) {
+            continue;
+        }
+        if (level == 1) {
+            // Huge MMIO mapping. Never owns pages. Skip to the end of the 2 MiB block
+            *pte = 0;
+            invlpg(page_address);
+            page_address = (void*)(((uint64_t)page_address | (HUGE_PAGE_SIZE - 1)) + 1) - PAGE_SIZE;
+            continue;
+        }
+        if (area->owns_pages) {
+            kpage_free((void*)(*pte & PAGE_ADDRESS_MASK) + hhdm_offset, 1);
+        }
+        *pte = 0;
+        invlpg(page_address);
+    }
+    flush_tlb_all_address_spaces();
+    if (area->owns_pages) {
+        vmalloc_used_pages -= num_pages;
+    }
+    vmalloc_va_free(address);
+}
+
+// Map device memory into kernel virtual address space
+// Ranges of 2 MiB or more are 2 MiB aligned so they can use huge pages
+void *vmap_mmio(uint64_t phys_address, size_t length) {
+    uint64_t phys_start = phys_address & PAGE_ADDRESS_MASK;
+    size_t num_pages = (phys_address + length - phys_start + PAGE_SIZE - 1) >> 12;
+    size_t align_pages = num_pages >= HUGE_PAGE_PAGES ? HUGE_PAGE_PAGES : 1;
+    void *address = vmalloc_va_alloc(num_pages, align_pages);
+    map_mmio_range(kernel_pml4_page(), address, (void*)phys_start, num_pages * PAGE_SIZE);
+    return address + (phys_address - phys_start);
+}
+
+// Translate a kernel virtual address (HHDM or vmalloc) to a physical address
+uint64_t kvirt_to_phys(void *address) {
+    if ((uint64_t)address >= VMALLOC_START && (uint64_t)address < VMALLOC_END) {
+        uint8_t level;
+        uint64_t *pte = find_pte_level(kernel_pml4_page(), address, &level);
+        if (pte == NULL || !(*pte & PAGE_PRESENT)) {
+            panic(u8p("kvirt_to_phys: address is not mapped\n"));
+        }
+        uint64_t page_mask = level == 1 ? (HUGE_PAGE_SIZE - 1) : PAGE_OFFSET_MASK;
+        return (*pte & PAGE_ADDRESS_MASK & ~page_mask) | ((uint64_t)address & page_mask);
+    }
+    return (uint64_t)address - hhdm_offset;
+}
@@ -0,0 +1,32 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "lib/rbtree.h"
+
+// Kernel virtual areas live in a single PML4 slot, shared by every process
+#define VMALLOC_START 0xffffc00000000000
+#define VMALLOC_END 0xffffc08000000000
+#define VMALLOC_PML4_INDEX 384
+
+struct vmalloc_area {
+    uint64_t start;
+    uint64_t num_pages; // Including the guard page of used areas
+    bool is_free;
+    bool owns_pages; // Backing pages were allocated by vmalloc and are freed by vfree
+    struct rb_node address_node; // In vmalloc_free_by_address or vmalloc_used_by_address
+    struct rb_node size_node; // In vmalloc_free_by_size. Free areas only
+};
+
+extern uint64_t vmalloc_used_pages;
+
+void vmalloc_init();
+void *vmalloc_va_alloc(size_t num_pages, size_t align_pages);
+void vmalloc_va_free(void *address);
+void *vmalloc(size_t num_pages);
+void vfree(void *address);
+void *vmap_mmio(uint64_t phys_address, size_t length);
+uint64_t kvirt_to_phys(void *address);
+
+#endif
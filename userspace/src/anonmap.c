@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "cstd.h"
+#include <persistos.h>
+
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE 0x200000
+#define MAP_BASE ((uint8_t*)0x0000100040000000) // 2 MiB aligned, inside the mmap region
+#define MAP_LENGTH (2 * HUGE_PAGE_SIZE)
+#define HOLE_OFFSET (HUGE_PAGE_SIZE / 2) // Inside the first 2 MiB block, so that its huge page gets split
+#define HOLE_LENGTH (16 * PAGE_SIZE)
+
+void fail(uint8_t *message) {
+    fputs("anonmap: ", stderr);
+    fputs(message, stderr);
+    fputs("\n", stderr);
+    exit(1);
+}
+
+bool in_hole(uint64_t offset) {
+    return offset >= HOLE_OFFSET && offset < HOLE_OFFSET + HOLE_LENGTH;
+}
+
+// Read the byte at offset in a child process. Returns true if the child survived the read
+bool child_can_read(uint64_t offset) {
+    ssize_t child_pid = fork();
+    if (is_error(child_pid)) {
+        fail("fork failed");
+    }
+    if (child_pid == 0) {
+        volatile uint8_t value = MAP_BASE[offset];
+        exit(value == (uint8_t)(offset / PAGE_SIZE) ? 0 : 2);
+    }
+    uint64_t child_exit_code;
+    waitpid(child_pid, &child_exit_code);
+    if (child_exit_code == 2) {
+        fail("child read wrong value");
+    }
+    return child_exit_code == 0;
+}
+
+// Map two 2 MiB blocks at a fixed address and touch every page, so that both can get huge pages.
+// Unmap a hole in the middle of the first one, then check that the rest is intact and that the hole faults.
+// Mapping the hole again gives zeroed pages
+void main(int argc, char* argv[]) {
+    uint8_t *address = mmap(MAP_BASE, MAP_LENGTH, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, 0, 0);
+    if (address != MAP_BASE) {
+        fail("mmap with MAP_FIXED failed");
+    }
+    for (uint64_t offset = 0; offset < MAP_LENGTH; offset += PAGE_SIZE) {
+        MAP_BASE[offset] = offset / PAGE_SIZE;
+    }
+
+    if (is_error(munmap(MAP_BASE + HOLE_OFFSET, HOLE_LENGTH))) {
+        fail("munmap failed");
+    }
+    for (uint64_t offset = 0; offset < MAP_LENGTH; offset += PAGE_SIZE) {
+        if (!in_hole(offset) && MAP_BASE[offset] != (uint8_t)(offset / PAGE_SIZE)) {
+            fail("page next to the hole lost its data");
+        }
+    }
+    if (!child_can_read(HOLE_OFFSET - PAGE_SIZE) || !child_can_read(HOLE_OFFSET + HOLE_LENGTH)) {
+        fail("page next to the hole faulted");
+    }
+    if (child_can_read(HOLE_OFFSET) || child_can_read(HOLE_OFFSET + HOLE_LENGTH - PAGE_SIZE)) {
+        fail("unmapped page did not fault");
+    }
+
+    address = mmap(MAP_BASE + HOLE_OFFSET, HOLE_LENGTH, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, 0, 0);
+    if (address != MAP_BASE + HOLE_OFFSET) {
+        fail("mmap of the hole failed");
+    }
+    for (uint64_t offset = HOLE_OFFSET; offset < HOLE_OFFSET + HOLE_LENGTH; offset += PAGE_SIZE) {
+        if (MAP_BASE[offset] != 0) {
+            fail("page mapped again is not zeroed");
+        }
+    }
+    if (is_error(munmap(MAP_BASE, MAP_LENGTH))) {
+        fail("munmap of the whole range failed");
+    }
+    puts("ok\n");
+    exit(0);
+}
@@ -0,0 +1,222 @@
+#include <stdint.h>
+#include "cstd.h"
+#include <persistos.h>
+
+#define DEFAULT_ITERATIONS 100
+#define PINGPONG_PAGES 64 // Working set touched by each side between task switches
+#define PARALLEL_SPINS 100000000 // Work done by each process of bench_parallel
+#define PARALLEL_MAX_PROCESSES 64
+#define LATENCY_SLEEP_MILLIS 10
+#define LATENCY_HOGS 8 // CPU bound processes competing with the sleeper in bench_latency
+
+uint64_t read_tsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+void print_result(uint8_t *name, uint64_t iterations, uint64_t cycles) {
+    uint8_t num_buf[12];
+    puts(name);
+    puts(": iterations = ");
+    sprintf_dec(iterations, num_buf, 0, 0);
+    puts(num_buf);
+    puts(", avg_cycles = ");
+    sprintf_dec(cycles / iterations, num_buf, 0, 0);
+    puts(num_buf);
+    puts("\n");
+}
+
+// Fork a child that exits immediately, and wait for it
+void bench_fork(uint64_t iterations) {
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < iterations; i++) {
+        ssize_t child_pid = fork();
+        if (is_error(child_pid)) {
+            fputs("bench: fork failed\n", stderr);
+            exit(1);
+        }
+        if (child_pid == 0) {
+            exit(0);
+        }
+        uint64_t child_exit_code;
+        waitpid(child_pid, &child_exit_code);
+    }
+    print_result("fork", iterations, read_tsc() - start);
+}
+
+// Fork a child that execs "bench nop", and wait for it. The child image has the same layout as the parent
+void bench_exec(uint64_t iterations) {
+    uint8_t *exec_argv[] = { u8p("bin/bench"), u8p("nop"), NULL };
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < iterations; i++) {
+        ssize_t child_pid = fork();
+        if (is_error(child_pid)) {
+            fputs("bench: fork failed\n", stderr);
+            exit(1);
+        }
+        if (child_pid == 0) {
+            exec(exec_argv[0], exec_argv);
+            fputs("bench: exec failed\n", stderr);
+            exit(1);
+        }
+        uint64_t child_exit_code;
+        waitpid(child_pid, &child_exit_code);
+    }
+    print_result("fork+exec+exit", iterations, read_tsc() - start);
+}
+
+// Spawn "bench nop" and wait for it
+void bench_spawn(uint64_t iterations) {
+    uint8_t *spawn_argv[] = { u8p("bin/bench"), u8p("nop"), NULL };
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < iterations; i++) {
+        ssize_t child_pid = spawn(spawn_argv[0], spawn_argv, NULL);
+        if (is_error(child_pid)) {
+            fputs("bench: spawn failed\n", stderr);
+            exit(1);
+        }
+        uint64_t child_exit_code;
+        waitpid(child_pid, &child_exit_code);
+    }
+    print_result("spawn+exit", iterations, read_tsc() - start);
+}
+
+// Read one byte of every page in buffer. Returns the TSC cycles taken
+uint64_t touch_pages(volatile uint8_t *buffer) {
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < PINGPONG_PAGES; i++) {
+        buffer[i * 4096];
+    }
+    return read_tsc() - start;
+}
+
+// Fork a child and switch between the two with sched_yield. Each side touches its own pages after
+// being switched back in, so the cost of refilling its TLB entries shows in touch cycles
+void bench_pingpong(uint64_t iterations) {
+    volatile uint8_t *buffer = malloc(PINGPONG_PAGES * 4096);
+    for (uint64_t i = 0; i < PINGPONG_PAGES; i++) {
+        buffer[i * 4096] = 1; // Fault in before forking, then again in the child on first write
+    }
+    ssize_t child_pid = fork();
+    if (is_error(child_pid)) {
+        fputs("bench: fork failed\n", stderr);
+        exit(1);
+    }
+    if (child_pid == 0) {
+        for (uint64_t i = 0; i < PINGPONG_PAGES; i++) {
+            buffer[i * 4096] = 2;
+        }
+        for (uint64_t i = 0; i < iterations; i++) {
+            touch_pages(buffer);
+            sched_yield();
+        }
+        exit(0);
+    }
+    uint64_t touch_cycles = 0;
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < iterations; i++) {
+        touch_cycles += touch_pages(buffer);
+        sched_yield();
+    }
+    uint64_t total_cycles = read_tsc() - start;
+    uint64_t child_exit_code;
+    waitpid(child_pid, &child_exit_code);
+    print_result("pingpong", iterations, total_cycles);
+    print_result("pingpong touch", iterations, touch_cycles);
+}
+
+// Fork processes that each spin for a fixed number of loops, and wait for all of them
+// With several CPUs, the average per process drops below the time one process takes alone
+void bench_parallel(uint64_t processes) {
+    if (processes > PARALLEL_MAX_PROCESSES) {
+        fputs("bench: too many processes\n", stderr);
+        exit(1);
+    }
+    ssize_t child_pids[PARALLEL_MAX_PROCESSES];
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < processes; i++) {
+        child_pids[i] = fork();
+        if (is_error(child_pids[i])) {
+            fputs("bench: fork failed\n", stderr);
+            exit(1);
+        }
+        if (child_pids[i] == 0) {
+            for (volatile uint64_t spin = 0; spin < PARALLEL_SPINS; spin++) {
+            }
+            exit(0);
+        }
+    }
+    for (uint64_t i = 0; i < processes; i++) {
+        uint64_t child_exit_code;
+        waitpid(child_pids[i], &child_exit_code);
+    }
+    print_result("parallel", processes, read_tsc() - start);
+}
+
+uint64_t measure_sleep(uint64_t iterations) {
+    uint64_t start = read_tsc();
+    for (uint64_t i = 0; i < iterations; i++) {
+        sleep(LATENCY_SLEEP_MILLIS);
+    }
+    return read_tsc() - start;
+}
+
+// Time short sleeps, first on an idle system and then while processes spin in user mode
+// The difference is how long a woken task waits for the CPU behind the spinners
+void bench_latency(uint64_t iterations) {
+    print_result("sleep idle", iterations, measure_sleep(iterations));
+    ssize_t hog_pids[LATENCY_HOGS];
+    for (uint64_t i = 0; i < LATENCY_HOGS; i++) {
+        hog_pids[i] = fork();
+        if (is_error(hog_pids[i])) {
+            fputs("bench: fork failed\n", stderr);
+            exit(1);
+        }
+        if (hog_pids[i] == 0) {
+            while (true) {
+            }
+        }
+    }
+    print_result("sleep loaded", iterations, measure_sleep(iterations));
+    for (uint64_t i = 0; i < LATENCY_HOGS; i++) {
+        uint64_t hog_exit_code;
+        kill(hog_pids[i], 9);
+        waitpid(hog_pids[i], &hog_exit_code);
+    }
+}
+
+void main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fputs("Usage: bench fork|exec|spawn|pingpong|parallel|latency [iterations]\n", stderr);
+        exit(1);
+    }
+    uint64_t iterations = DEFAULT_ITERATIONS;
+    if (argc >= 3) {
+        uint8_t parse_result = parse_n_dec(argv[2], 100, &iterations);
+        if (parse_result != strlen(argv[2]) || iterations == 0) {
+            fputs("bench: parse error\n", stderr);
+            exit(1);
+        }
+    }
+
+    if (strcmp(argv[1], "nop") == 0) {
+        // Exit immediately. Used as the exec target of bench_exec
+    } else if (strcmp(argv[1], "fork") == 0) {
+        bench_fork(iterations);
+    } else if (strcmp(argv[1], "exec") == 0) {
+        bench_exec(iterations);
+    } else if (strcmp(argv[1], "spawn") == 0) {
+        bench_spawn(iterations);
+    } else if (strcmp(argv[1], "pingpong") == 0) {
+        bench_pingpong(iterations);
+    } else if (strcmp(argv[1], "parallel") == 0) {
+        bench_parallel(iterations);
+    } else if (strcmp(argv[1], "latency") == 0) {
+        bench_latency(iterations);
+    } else {
+        fputs("bench: unknown benchmark\n", stderr);
+        exit(1);
+    }
+    exit(0);
+}
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "cstd.h"
+#include <persistos.h>
+
+#define PAGE_SIZE 4096
+#define STATIC_PAGES 16
+#define SMALL_HEAP_PAGES 16
+#define LARGE_HEAP_PAGES 1024 // Spans at least one whole 2 MiB block, which may get a huge page
+
+uint8_t static_buffer[STATIC_PAGES * PAGE_SIZE];
+
+// Write seed-derived values to the first and last byte of every page of buffer
+void fill_pages(uint8_t *buffer, uint64_t pages, uint8_t seed) {
+    for (uint64_t i = 0; i < pages; i++) {
+        buffer[i * PAGE_SIZE] = seed + i;
+        buffer[i * PAGE_SIZE + PAGE_SIZE - 1] = seed + i + 1;
+    }
+}
+
+bool check_pages(uint8_t *buffer, uint64_t pages, uint8_t seed) {
+    for (uint64_t i = 0; i < pages; i++) {
+        if (buffer[i * PAGE_SIZE] != (uint8_t)(seed + i) || buffer[i * PAGE_SIZE + PAGE_SIZE - 1] != (uint8_t)(seed + i + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void fill_all(uint8_t *small_heap, uint8_t *large_heap, uint8_t seed) {
+    fill_pages(static_buffer, STATIC_PAGES, seed);
+    fill_pages(small_heap, SMALL_HEAP_PAGES, seed + 1);
+    fill_pages(large_heap, LARGE_HEAP_PAGES, seed + 2);
+}
+
+bool check_all(uint8_t *small_heap, uint8_t *large_heap, uint8_t seed) {
+    return check_pages(static_buffer, STATIC_PAGES, seed) &&
+        check_pages(small_heap, SMALL_HEAP_PAGES, seed + 1) &&
+        check_pages(large_heap, LARGE_HEAP_PAGES, seed + 2);
+}
+
+// Fork with memory written by the parent, then write different values in both processes.
+// Each must read back its own values, and the child must first see those of the parent
+void main(int argc, char* argv[]) {
+    uint8_t *small_heap = malloc(SMALL_HEAP_PAGES * PAGE_SIZE);
+    uint8_t *large_heap = malloc(LARGE_HEAP_PAGES * PAGE_SIZE);
+    if (small_heap == NULL || large_heap == NULL) {
+        fputs("cow: malloc failed\n", stderr);
+        exit(1);
+    }
+    fill_all(small_heap, large_heap, 10);
+
+    ssize_t child_pid = fork();
+    if (is_error(child_pid)) {
+        fputs("cow: fork failed\n", stderr);
+        exit(1);
+    }
+    if (child_pid == 0) {
+        if (!check_all(small_heap, large_heap, 10)) {
+            exit(2);
+        }
+        fill_all(small_heap, large_heap, 50);
+        exit(check_all(small_heap, large_heap, 50) ? 0 : 3);
+    }
+    fill_all(small_heap, large_heap, 90);
+    uint64_t child_exit_code;
+    waitpid(child_pid, &child_exit_code);
+    if (child_exit_code != 0) {
+        fputs("cow: child read wrong values\n", stderr);
+        exit(1);
+    }
+    if (!check_all(small_heap, large_heap, 90)) {
+        fputs("cow: parent read wrong values\n", stderr);
+        exit(1);
+    }
+    puts("ok\n");
+    exit(0);
+}
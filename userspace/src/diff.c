@@ -2,9 +2,42 @@
 #include "cstd.h"
 #include <persistos.h>
 
+#define DIFF_BUFFER_SIZE 262144
+
+// Compare two files by mapping them, without copying their contents
+// Exits if the files could be mapped. Returns if either file cannot be mapped
+void diff_mapped(uint64_t a_fd, uint64_t b_fd) {
+    ssize_t a_length = lseek(a_fd, 0, SEEK_END);
+    ssize_t b_length = lseek(b_fd, 0, SEEK_END);
+    lseek(a_fd, 0, SEEK_SET);
+    lseek(b_fd, 0, SEEK_SET);
+    if (is_error(a_length) || is_error(b_length)) {
+        return;
+    }
+    if (a_length != b_length) {
+        puts("Files differ, they have different lengths\n");
+        exit(2);
+    }
+    if (a_length == 0) {
+        exit(0);
+    }
+    uint8_t *a_map = mmap(NULL, a_length, MAP_PRIVATE, a_fd, 0);
+    if (is_error((ssize_t)a_map)) {
+        return;
+    }
+    uint8_t *b_map = mmap(NULL, b_length, MAP_PRIVATE, b_fd, 0);
+    if (is_error((ssize_t)b_map)) {
+        munmap(a_map, a_length);
+        return;
+    }
+    if (memcmp(a_map, b_map, a_length) != 0) {
+        puts("Files differ\n");
+        exit(2);
+    }
+    exit(0);
+}
+
 void main(int argc, char* argv[]) {
-    uint8_t a_buf[4096];
-    uint8_t b_buf[4096];
     if (argc != 3) {
         fputs("diff: expected two arguments\n", stderr);
         exit(1);
@@ -28,13 +61,23 @@ void main(int argc, char* argv[]) {
         exit(1);
     }
 
+    diff_mapped(a_fd, b_fd);
+
+    // Large enough to compare most files in one read. Given back to the kernel by free
+    uint8_t *a_buf = malloc(DIFF_BUFFER_SIZE);
+    uint8_t *b_buf = malloc(DIFF_BUFFER_SIZE);
+    if (a_buf == NULL || b_buf == NULL) {
+        fputs("diff: out of memory\n", stderr);
+        exit(1);
+    }
+
     while (true) {
-        uint64_t a_bytes_read = read(a_fd, a_buf, 4096);
+        uint64_t a_bytes_read = read(a_fd, a_buf, DIFF_BUFFER_SIZE);
         if (is_error(a_bytes_read)) {
             fputs("diff: error reading file a\n", stderr);
             exit(1);
         }
-        uint64_t b_bytes_read = read(b_fd, b_buf, 4096);
+        uint64_t b_bytes_read = read(b_fd, b_buf, DIFF_BUFFER_SIZE);
         if (is_error(b_bytes_read)) {
             fputs("diff: error reading file b\n", stderr);
             exit(1);
@@ -43,10 +86,15 @@ void main(int argc, char* argv[]) {
             puts("Files differ, they have different lengths\n");
             exit(2);
         }
-        if (memcmp(&a_buf, &b_buf, a_bytes_read) != 0) {
+        if (memcmp(a_buf, b_buf, a_bytes_read) != 0) {
             puts("Files differ\n");
             exit(2);
         }
-        exit(0);
+        if (a_bytes_read == 0) {
+            break;
+        }
     }
+    free(a_buf);
+    free(b_buf);
+    exit(0);
 }
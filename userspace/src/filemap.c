@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "cstd.h"
+#include <persistos.h>
+
+#define PAGE_SIZE 4096
+#define FILE_LENGTH (2 * PAGE_SIZE + 100)
+#define TRUNCATED_LENGTH 100
+
+uint8_t *path;
+
+void fail(uint8_t *message) {
+    fputs("filemap: ", stderr);
+    fputs(message, stderr);
+    fputs("\n", stderr);
+    exit(1);
+}
+
+uint8_t pattern(uint64_t offset) {
+    return 'a' + offset % 26;
+}
+
+// Create the test file with FILE_LENGTH bytes of pattern, replacing what it held before
+ssize_t create_file() {
+    ssize_t fd = open(path, O_CREAT);
+    if (is_error(fd) || is_error(ftruncate(fd, 0))) {
+        fail("open failed");
+    }
+    uint8_t buffer[256];
+    for (uint64_t offset = 0; offset < FILE_LENGTH; offset += sizeof(buffer)) {
+        uint64_t length = FILE_LENGTH - offset < sizeof(buffer) ? FILE_LENGTH - offset : sizeof(buffer);
+        for (uint64_t i = 0; i < length; i++) {
+            buffer[i] = pattern(offset + i);
+        }
+        if (write(fd, buffer, length) != (ssize_t)length) {
+            fail("write failed");
+        }
+    }
+    return fd;
+}
+
+uint8_t *map_file(ssize_t fd, uint64_t flags) {
+    uint8_t *map = mmap(NULL, FILE_LENGTH, flags, fd, 0);
+    if (is_error((ssize_t)map)) {
+        fail("mmap failed");
+    }
+    return map;
+}
+
+// Read the byte at offset with read(), not through a mapping
+uint8_t read_byte(ssize_t fd, uint64_t offset) {
+    uint8_t value;
+    lseek(fd, offset, SEEK_SET);
+    if (read(fd, &value, 1) != 1) {
+        fail("read failed");
+    }
+    return value;
+}
+
+// Writes through a shared mapping are seen by read() right away, and stay in the file after munmap
+void test_shared_munmap() {
+    ssize_t fd = create_file();
+    uint8_t *map = map_file(fd, MAP_SHARED);
+    map[5] = 'X';
+    map[PAGE_SIZE + 7] = 'Y';
+    if (read_byte(fd, 5) != 'X' || read_byte(fd, PAGE_SIZE + 7) != 'Y') {
+        fail("read() does not see writes through a shared mapping");
+    }
+    munmap(map, FILE_LENGTH);
+    close(fd);
+    fd = open(path, 0);
+    if (read_byte(fd, 5) != 'X' || read_byte(fd, PAGE_SIZE + 7) != 'Y' || read_byte(fd, 6) != pattern(6)) {
+        fail("shared mapping not written back on munmap");
+    }
+    close(fd);
+}
+
+// A process that exits without munmap still writes its shared mapping back
+void test_shared_exit() {
+    ssize_t fd = create_file();
+    ssize_t child_pid = fork();
+    if (is_error(child_pid)) {
+        fail("fork failed");
+    }
+    if (child_pid == 0) {
+        uint8_t *map = map_file(fd, MAP_SHARED);
+        map[2 * PAGE_SIZE + 3] = 'Z';
+        exit(0);
+    }
+    uint64_t child_exit_code;
+    waitpid(child_pid, &child_exit_code);
+    if (child_exit_code != 0 || read_byte(fd, 2 * PAGE_SIZE + 3) != 'Z') {
+        fail("shared mapping not written back on exit");
+    }
+    close(fd);
+}
+
+// Writes through a private mapping are seen by nobody else, and never reach the file
+void test_private_cow() {
+    ssize_t fd = create_file();
+    uint8_t *shared_map = map_file(fd, MAP_SHARED);
+    uint8_t *private_map = map_file(fd, MAP_PRIVATE);
+    if (private_map[10] != pattern(10)) {
+        fail("private mapping reads wrong data");
+    }
+    private_map[10] = 'P';
+    if (private_map[10] != 'P' || shared_map[10] != pattern(10) || read_byte(fd, 10) != pattern(10)) {
+        fail("write through a private mapping is visible outside of it");
+    }
+    shared_map[11] = 'S';
+    munmap(private_map, FILE_LENGTH);
+    munmap(shared_map, FILE_LENGTH);
+    if (read_byte(fd, 10) != pattern(10) || read_byte(fd, 11) != 'S') {
+        fail("private mapping written back");
+    }
+    close(fd);
+}
+
+// ftruncate zeroes mapped bytes past the new end, and keeps writes to the page that holds the new end
+void test_ftruncate_mapped() {
+    ssize_t fd = create_file();
+    uint8_t *map = map_file(fd, MAP_SHARED);
+    map[50] = 'T';
+    map[TRUNCATED_LENGTH + 1] = 'U';
+    map[PAGE_SIZE] = 'V';
+    if (is_error(ftruncate(fd, TRUNCATED_LENGTH))) {
+        fail("ftruncate failed");
+    }
+    if (map[TRUNCATED_LENGTH + 1] != 0 || map[PAGE_SIZE - 1] != 0 || map[PAGE_SIZE] != 0) {
+        fail("mapped bytes past the new end are not zeroed");
+    }
+    munmap(map, FILE_LENGTH);
+    if (lseek(fd, 0, SEEK_END) != TRUNCATED_LENGTH) {
+        fail("wrong length after ftruncate");
+    }
+    if (read_byte(fd, 50) != 'T' || read_byte(fd, 49) != pattern(49)) {
+        fail("write before ftruncate lost");
+    }
+    close(fd);
+}
+
+// Usage: filemap PATH. Creates PATH and replaces it in each test
+void main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fputs("filemap: expected file path argument\n", stderr);
+        exit(1);
+    }
+    path = argv[1];
+    test_shared_munmap();
+    test_shared_exit();
+    test_private_cow();
+    test_ftruncate_mapped();
+    puts("ok\n");
+    exit(0);
+}
@@ -32,12 +32,30 @@ void main(int argc, char* argv[]) {
         exit(1);
     }
 
-    uint8_t binary_buffer[16];
+    // Map regular files to scan them without read() copies. Other files are read
+    uint8_t *mapped_file = NULL;
+    ssize_t file_length = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+    if (!is_error(file_length) && file_length > 0) {
+        uint8_t *map_result = mmap(NULL, file_length, MAP_PRIVATE, fd, 0);
+        if (!is_error((ssize_t)map_result)) {
+            mapped_file = map_result;
+        }
+    }
+
+    uint8_t read_buffer[16];
     uint8_t text_buffer[38];
     uint32_t file_offset = 0;
     
     while (true) {
-        ssize_t bytes_read = read(fd, &binary_buffer, 16);
+        uint8_t *binary_buffer = read_buffer;
+        ssize_t bytes_read;
+        if (mapped_file != NULL) {
+            binary_buffer = mapped_file + file_offset;
+            bytes_read = file_length - file_offset < 16 ? file_length - file_offset : 16;
+        } else {
+            bytes_read = read(fd, read_buffer, 16);
+        }
         if (is_error(bytes_read)) {
             fputs("Error reading\n", stderr);
             exit(1);
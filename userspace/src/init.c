@@ -4,13 +4,9 @@
 #include <persistos.h>
 
 void exec_shell() {
-    uint32_t shell_pid = fork();
-    if (shell_pid == 0) {
-        uint8_t *shell_argv[] = { u8p("bin/shell"), NULL };
-        if (is_error(exec(shell_argv[0], shell_argv))) {
-            fputs(u8p("init: error starting shell\n"), stderr);
-            return;
-        }
+    uint8_t *shell_argv[] = { u8p("bin/shell"), NULL };
+    if (is_error(spawn(shell_argv[0], shell_argv, NULL))) {
+        fputs(u8p("init: error starting shell\n"), stderr);
     }
 }
 
@@ -2,6 +2,16 @@
 #include "cstd.h"
 #include <persistos.h>
 
+// Allocations of at least this many bytes get their own mmap range, which free gives back
+#define MALLOC_MMAP_THRESHOLD 65536
+#define MALLOC_PAGE_SIZE 4096
+
+// Header in front of an mmap allocation. Keeps the returned pointer 16 byte aligned
+struct malloc_mmap_header {
+    size_t length; // Of the whole mapping, including the header
+    uint64_t reserved;
+};
+
 void *heap_bottom;
 void *heap_top;
 void *program_break;
@@ -10,6 +20,15 @@ void libc_init() {
 }
 
 void *malloc(size_t size) {
+    if (size >= MALLOC_MMAP_THRESHOLD) {
+        size_t length = (size + sizeof(struct malloc_mmap_header) + MALLOC_PAGE_SIZE - 1) & ~(size_t)(MALLOC_PAGE_SIZE - 1);
+        struct malloc_mmap_header *header = mmap(NULL, length, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+        if (is_error((ssize_t)header)) {
+            return NULL;
+        }
+        header->length = length;
+        return header + 1;
+    }
     void *old_heap_top = heap_top;
     heap_top += size;
     if (heap_top > program_break) {
@@ -19,8 +38,14 @@ void *malloc(size_t size) {
 }
 
 void free(void *addr) {
-    (void)addr; // unused
-    // free is a no-op in bump allocator
+    if (addr >= heap_bottom && addr < program_break) {
+        // free is a no-op in bump allocator
+        return;
+    }
+    if (addr != NULL) {
+        struct malloc_mmap_header *header = (struct malloc_mmap_header*)addr - 1;
+        munmap(header, header->length);
+    }
 }
 
 struct FILE std_files[3] = {
@@ -21,6 +21,13 @@ bool is_error(ssize_t x);
 
 // persistos.s
 
+// For spawn. The child gets a copy of parent_fd as child_fd
+struct spawn_fd_mapping {
+    uint64_t child_fd;
+    uint64_t parent_fd;
+};
+#define SPAWN_FD_MAP_END ((uint64_t)-1)
+
 /* 1  */ ssize_t write(uint64_t fd, uint8_t *buf, size_t size);
 /* 2  */ ssize_t read(uint64_t fd, uint8_t *buf, size_t size);
 /* 3  */ void exit(uint8_t exit_code);
@@ -41,8 +48,20 @@ bool is_error(ssize_t x);
 /* 18 */ ssize_t kill(uint64_t pid, uint64_t sig);
 /* 19 */ ssize_t sleep(uint64_t millis);
 /* 20 */ ssize_t mount(uint8_t *dev_name, uint8_t *dir_name, uint8_t *type);
+/* 21 */ void *mmap(void *addr, size_t length, uint64_t flags, uint64_t fd, uint64_t offset);
+/* 22 */ ssize_t munmap(void *addr, size_t length);
+/* 23 */ ssize_t spawn(uint8_t *path, uint8_t **argv, struct spawn_fd_mapping *fd_map);
+/* 24 */ ssize_t setnice(uint64_t pid, int64_t nice);
 
 #define O_CREAT 0x1
 #define O_TRUNCATE 0x2
 
+#define SEEK_SET 0
+#define SEEK_END 2
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
 #endif
@@ -180,3 +180,39 @@ mount:
     movq $20, %rdi
     int $0x80
     retq
+
+.global mmap
+mmap:
+    // fd and offset are read from r9 and r8
+    movq %rcx, %r9
+    movq %rdx, %rcx
+    movq %rsi, %rdx
+    movq %rdi, %rsi
+    movq $21, %rdi
+    int $0x80
+    retq
+
+.global munmap
+munmap:
+    movq %rsi, %rdx
+    movq %rdi, %rsi
+    movq $22, %rdi
+    int $0x80
+    retq
+
+.global spawn
+spawn:
+    movq %rdx, %rcx
+    movq %rsi, %rdx
+    movq %rdi, %rsi
+    movq $23, %rdi
+    int $0x80
+    retq
+
+.global setnice
+setnice:
+    movq %rsi, %rdx
+    movq %rdi, %rsi
+    movq $24, %rdi
+    int $0x80
+    retq
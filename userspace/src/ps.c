@@ -10,10 +10,26 @@ void main(int argc, char* argv[]) {
         fputs("Error in gettasks\n", stderr);
         exit(1);
     }
+    puts("  PID   MINOR MAJOR NICE WEIGHT RUNTIME_MS NAME\n");
     uint8_t *x = buf;
     while (x < buf + bytes_read) {
         uint32_t pid = *((uint32_t*)x);
         x += sizeof(uint32_t);
+
+        uint64_t minor_faults = *((uint64_t*)x);
+        x += sizeof(uint64_t);
+
+        uint64_t major_faults = *((uint64_t*)x);
+        x += sizeof(uint64_t);
+
+        int8_t nice = *((int8_t*)x);
+        x += sizeof(int8_t);
+
+        uint32_t weight = *((uint32_t*)x);
+        x += sizeof(uint32_t);
+
+        uint64_t runtime_millis = *((uint64_t*)x);
+        x += sizeof(uint64_t);
         
         uint16_t len = *((uint16_t*)x);
         x += sizeof(uint16_t);
@@ -24,6 +40,27 @@ void main(int argc, char* argv[]) {
         sprintf_dec(pid, &pid_buf, ' ', 5);
         puts(pid_buf);
         puts(" ");
+        sprintf_dec(minor_faults, &pid_buf, ' ', 7);
+        puts(pid_buf);
+        puts(" ");
+        sprintf_dec(major_faults, &pid_buf, ' ', 5);
+        puts(pid_buf);
+        puts(" ");
+        sprintf_dec(nice < 0 ? -nice : nice, &pid_buf, 0, 0);
+        for (size_t i = strlen(pid_buf) + (nice < 0); i < 4; i++) {
+            puts(" ");
+        }
+        if (nice < 0) {
+            puts("-");
+        }
+        puts(pid_buf);
+        puts(" ");
+        sprintf_dec(weight, &pid_buf, ' ', 6);
+        puts(pid_buf);
+        puts(" ");
+        sprintf_dec(runtime_millis, &pid_buf, ' ', 10);
+        puts(pid_buf);
+        puts(" ");
         puts(name);
         puts("\n");
     }
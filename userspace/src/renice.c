@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include "cstd.h"
+#include <persistos.h>
+
+void main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fputs("renice: expected some arguments\n", stderr);
+        exit(1);
+    }
+    uint8_t *nice_arg = argv[1];
+    bool negative = nice_arg[0] == '-';
+    if (negative) {
+        nice_arg++;
+    }
+    uint64_t nice = 0;
+    uint8_t parse_result = parse_n_dec(nice_arg, 100, &nice);
+    if (parse_result == 0 || parse_result != strlen(nice_arg)) {
+        fputs("renice: parse error\n", stderr);
+        exit(1);
+    }
+    uint64_t pid = 0;
+    parse_result = parse_n_dec(argv[2], 100, &pid);
+    if (parse_result != strlen(argv[2])) {
+        fputs("renice: parse error\n", stderr);
+        exit(1);
+    }
+
+    ssize_t setnice_result = setnice(pid, negative ? -(int64_t)nice : (int64_t)nice);
+    if (is_error(setnice_result)) {
+        fputs("renice: error\n", stderr);
+        exit(1);
+    }
+    exit(0);
+}
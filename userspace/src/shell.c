@@ -382,41 +382,49 @@ uint64_t exec_shell_line(uint8_t *start, size_t length) {
         exit(exit_code);
     }
 
-    uint64_t child_pid = fork();
-    uint64_t child_exit_code;
-    if (child_pid == 0) {
-        for (int i = 0; i < num_redirects; i++) {
-            struct redirect_info ri = redirect_infos[i];
-            uint64_t old_fd = open(ri.target_path, O_CREAT | O_TRUNCATE);
-            if (is_error(old_fd)) {
-                fputs(u8p("shell: failed to open file for redirect\n"), stderr);
-                exit(1);
-            }
-            uint64_t dup2_result = dup2(old_fd, ri.fd);
-            if (is_error(dup2_result)) {
-                fputs(u8p("shell: failed to duplicate fd"), stderr);
-                exit(1);
-            }
-            close(old_fd);
+    // Open redirect targets here and let spawn place them in the child
+    struct spawn_fd_mapping *fd_map = malloc((num_redirects + 1) * sizeof(struct spawn_fd_mapping));
+    uint64_t num_opened_fds = 0;
+    uint64_t child_exit_code = 1;
+    bool redirects_opened = true;
+    for (int i = 0; i < num_redirects; i++) {
+        struct redirect_info ri = redirect_infos[i];
+        ssize_t opened_fd = open(ri.target_path, O_CREAT | O_TRUNCATE);
+        if (is_error(opened_fd)) {
+            fputs(u8p("shell: failed to open file for redirect\n"), stderr);
+            redirects_opened = false;
+            break;
         }
+        fd_map[num_opened_fds].child_fd = ri.fd;
+        fd_map[num_opened_fds].parent_fd = opened_fd;
+        num_opened_fds++;
+    }
+    fd_map[num_opened_fds].parent_fd = SPAWN_FD_MAP_END;
 
+    if (redirects_opened) {
         // Try with no prefix
-        exec(exec_argv[0], exec_argv);
-        // Try with "bin" prefix
-        uint8_t buffer[KEYBOARD_COMMAND_BUFFER_LENGTH];
-        strcpy(buffer, "bin/");
-        strcpy(buffer + 4, exec_argv[0]);
-        exec(buffer, exec_argv);
-        // Give up
-        fputs(u8p("shell: command not found: "), stderr);
-        fputs(exec_argv[0], stderr);
-        fputs(u8p("\n"), stderr);
-        exit(1);
-    } else {
-        if (is_error(waitpid(child_pid, &child_exit_code))) {
+        ssize_t child_pid = spawn(exec_argv[0], exec_argv, fd_map);
+        if (is_error(child_pid)) {
+            // Try with "bin" prefix
+            uint8_t buffer[KEYBOARD_COMMAND_BUFFER_LENGTH];
+            strcpy(buffer, "bin/");
+            strcpy(buffer + 4, exec_argv[0]);
+            child_pid = spawn(buffer, exec_argv, fd_map);
+        }
+        if (is_error(child_pid)) {
+            // Give up
+            fputs(u8p("shell: command not found: "), stderr);
+            fputs(exec_argv[0], stderr);
+            fputs(u8p("\n"), stderr);
+        } else if (is_error(waitpid(child_pid, &child_exit_code))) {
             fputs("shell: error waiting for subprocess\n", stderr);
         }
     }
+
+    for (uint64_t i = 0; i < num_opened_fds; i++) {
+        close(fd_map[i].parent_fd);
+    }
+    free(fd_map);
     // write(1, pair->start, pair->end - pair->start);
     // puts(u8p("\n"));
 
@@ -62,4 +62,19 @@ cat /sys/meminfo > td/sysfs_meminfo.out
 echo test_sysfs_nvme
 cat /sys/nvme > td/sysfs_nvme.out
 
+echo test_fork_cow
+cow > td/fork_cow.out
+echo ok > td/fork_cow.expected
+diff td/fork_cow.out td/fork_cow.expected
+
+echo test_mmap_partial_unmap
+anonmap > td/mmap_partial_unmap.out
+echo ok > td/mmap_partial_unmap.expected
+diff td/mmap_partial_unmap.out td/mmap_partial_unmap.expected
+
+echo test_mmap_file
+filemap td/mmap_file.txt > td/mmap_file.out
+echo ok > td/mmap_file.expected
+diff td/mmap_file.out td/mmap_file.expected
+
 echo All tests successful